@@ -8,17 +8,30 @@
 #include "karchive_p.h"
 
 #include <QtCore/qbuffer.h>
+#include <QtCore/qcryptographichash.h>
 #include <QtCore/qdebug.h>
 #include <QtCore/qdir.h>
+#include <QtCore/qendian.h>
 #include <QtCore/qfile.h>
+#include <QtCore/qfileinfo.h>
+#include <QtCore/qhash.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qrunnable.h>
+#include <QtCore/qsemaphore.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qthreadpool.h>
 #include <qplatformdefs.h>
 
+#include "kaesdecryptor_p.h"
 #include "kcompressiondevice.h"
-#include "klimitediodevice_p.h"
 #include "kfilterbase.h"
 #include "kxzfilter.h"
+#include "kzstdfilter.h"
 
 #include <zlib.h>
+#include <zstd.h>
+#include <algorithm>
+#include <limits>
 #include <memory>
 #include <ctime> // time()
 
@@ -32,6 +45,15 @@
 
 #define BUFFER_SIZE 8 * 1024
 
+// Memory kept for decoded folders by default, see K7Zip::setFolderCacheSize()
+static const qint64 DEFAULT_FOLDER_CACHE_SIZE = 256 * 1024 * 1024;
+
+// How much of the 7zAES key derivation input is hashed at once
+static const int AES_KEY_BATCH_SIZE = 64 * 1024;
+
+// How much of each input of the BCJ2 decoder is decoded at once
+static const int BCJ2_CHUNK_SIZE = 256 * 1024;
+
 static const unsigned char k7zip_signature[6] = {'7', 'z', 0xBC, 0xAF, 0x27, 0x1C};
 // static const unsigned char XZ_HEADER_MAGIC[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
 
@@ -44,6 +66,15 @@ static const unsigned char k7zip_signature[6] = {'7', 'z', 0xBC, 0xAF, 0x27, 0x1
 
 #define LZMA2_DIC_SIZE_FROM_PROP(p) (((quint32)2 | ((p)&1)) << ((p) / 2 + 11))
 
+// Dictionary size used by the LZMA2 encoder with the default preset
+#define LZMA2_PRESET_DICT_SIZE (8 * 1024 * 1024)
+
+// A block buffered for compression in the thread pool is instead compressed straight
+// into the archive once it holds more than twice the solid block size (or this size,
+// for non-solid archives), so that big files don't have to fit in memory
+#define MIN_STREAMING_THRESHOLD (16 * 1024 * 1024)
+#define MAX_STREAMING_THRESHOLD (1024 * 1024 * 1024)
+
 #define FILE_ATTRIBUTE_READONLY 1
 #define FILE_ATTRIBUTE_HIDDEN 2
 #define FILE_ATTRIBUTE_SYSTEM 4
@@ -101,13 +132,14 @@ enum class HeaderType {
 
 // Method ID
 // static const quint64 k_Copy = 0x00;
-// static const quint64 k_Delta = 0x03;
+static const quint64 k_Delta = 0x03;
 // static const quint64 k_x86 = 0x04; //BCJ
 // static const quint64 k_PPC = 0x05; // BIG Endian
 // static const quint64 k_IA64 = 0x06;
 // static const quint64 k_ARM = 0x07; // little Endian
 // static const quint64 k_ARM_Thumb = 0x08; // little Endian
 // static const quint64 k_SPARC = 0x09;
+static const quint64 k_ARM64 = 0x0A;
 static const quint64 k_LZMA2 = 0x21;
 // static const quint64 k_Swap2 = 0x020302;
 // static const quint64 k_Swap4 = 0x020304;
@@ -143,6 +175,7 @@ static const quint64 k_BZip2 = 0x040202;
 // static const quint64 k_Cab = 0x0408;
 // static const quint64 k_DeflateNSIS = 0x040901;
 // static const quint64 k_Bzip2NSIS = 0x040902;
+static const quint64 k_ZSTD = 0x04F71101; // as registered by 7-Zip ZS
 static const quint64 k_AES = 0x06F10701;
 
 /**
@@ -152,6 +185,10 @@ class K7ZipFileEntry : public KArchiveFile
 {
     Q_DISABLE_COPY_MOVE(K7ZipFileEntry)
 public:
+    /**
+     * @param pos the position of the file in the unpacked data of the archive
+     * @param folderIndex the folder holding the data of the file, -1 if it has none
+     */
     explicit K7ZipFileEntry(K7Zip *zip,
                    const QString &name,
                    int access,
@@ -161,19 +198,19 @@ public:
                    const QString &symlink,
                    qint64 pos,
                    qint64 size,
-                   const QByteArray &data);
+                   int folderIndex);
 
     ~K7ZipFileEntry();
 
     /**
      * @return the content of this file.
-     * Call data() with care (only once per file), this data isn't cached.
+     * The folder holding the file is decoded the first time one of its files is read.
      */
     QByteArray data() const override;
 
     /**
-     * This method returns QIODevice (internal class: KLimitedIODevice)
-     * on top of the underlying QIODevice. This is obviously for reading only.
+     * This method returns a QIODevice on the content of the file.
+     * This is obviously for reading only.
      *
      * WARNING: Note that the ownership of the device is being transferred to the caller,
      * who will have to delete it.
@@ -183,50 +220,39 @@ public:
      */
     QIODevice *createDevice() const override;
 
-private:
-    const QByteArray m_data;
-    QBuffer *m_buffer;
-};
+    int folderIndex() const
+    {
+        return m_folderIndex;
+    }
 
-K7ZipFileEntry::K7ZipFileEntry(K7Zip *zip,
-                               const QString &name,
-                               int access,
-                               const QDateTime &date,
-                               const QString &user,
-                               const QString &group,
-                               const QString &symlink,
-                               qint64 pos,
-                               qint64 size,
-                               const QByteArray &data)
-    : KArchiveFile(zip, name, access, date, user, group, symlink, pos, size)
-    , m_data(data)
-    , m_buffer(new QBuffer)
-{
-    m_buffer->setData(m_data);
-    m_buffer->open(QIODevice::ReadOnly);
-}
+    /**
+     * The CRC32 of the data written so far, when writing.
+     */
+    quint32 crc() const
+    {
+        return m_crc;
+    }
 
-K7ZipFileEntry::~K7ZipFileEntry()
-{
-    delete m_buffer;
-}
+    void setCrc(quint32 crc)
+    {
+        m_crc = crc;
+    }
 
-QByteArray K7ZipFileEntry::data() const
-{
-    return m_data.mid(position(), size());
-}
+protected:
+    void virtual_hook(int id, void *data) override;
 
-QIODevice *K7ZipFileEntry::createDevice() const
-{
-    return new KLimitedIODevice(m_buffer, position(), size());
-}
+private:
+    const int m_folderIndex;
+    quint32 m_crc;
+};
 
 class FileInfo
 {
-    Q_DISABLE_COPY_MOVE(FileInfo)
 public:
     explicit FileInfo()
         : size(0)
+        , pos(0)
+        , folderIndex(-1)
         , attributes(0)
         , crc(0)
         , attribDefined(false)
@@ -238,6 +264,9 @@ public:
 
     QString path;
     quint64 size;
+    // Where the data of the file is when reading, see K7ZipFileEntry
+    qint64 pos;
+    int folderIndex;
     quint32 attributes;
     quint32 crc;
     bool attribDefined;
@@ -245,6 +274,7 @@ public:
     bool hasStream;
     bool isDir;
 };
+Q_DECLARE_TYPEINFO(FileInfo, Q_MOVABLE_TYPE);
 
 class Folder
 {
@@ -398,6 +428,353 @@ public:
     QVector<quint64> unpackSizes;
 };
 
+static unsigned char lzma2DictionaryProperty(quint32 dictSize)
+{
+    const quint32 kMinReduceSize = (1 << 16);
+    if (dictSize < kMinReduceSize) {
+        dictSize = kMinReduceSize;
+    }
+
+    int dict;
+    for (dict = 0; dict < 40; dict++) {
+        if (dictSize <= LZMA2_DIC_SIZE_FROM_PROP(dict)) {
+            break;
+        }
+    }
+    return dict;
+}
+
+static KCompressionDevice::CompressionType blockCompressionType(K7Zip::CompressionMethod method)
+{
+    return method == K7Zip::CompressionMethod::Zstd ? KCompressionDevice::CompressionType::Zstd : KCompressionDevice::CompressionType::Xz;
+}
+
+static int zstdCompressionLevel(int level)
+{
+    return level < 0 ? ZSTD_CLEVEL_DEFAULT : qBound(1, level, ZSTD_maxCLevel());
+}
+
+// Returns the method ID of the coder for a block of up to dictSize bytes, and fills its properties
+static quint64 blockCoderProperties(K7Zip::CompressionMethod method, int level, quint32 dictSize, QVector<unsigned char> &properties)
+{
+    properties.clear();
+    if (method == K7Zip::CompressionMethod::Zstd) {
+        // Same layout as 7-Zip ZS: library version, level, and two reserved bytes
+        properties << ZSTD_VERSION_MAJOR << ZSTD_VERSION_MINOR << zstdCompressionLevel(level) << 0 << 0;
+        return k_ZSTD;
+    }
+    properties.append(lzma2DictionaryProperty(dictSize));
+    return k_LZMA2;
+}
+
+// (Re)initializes a filter created for blockCompressionType(method) to compress a block
+static bool initBlockEncoder(KFilterBase *filter, K7Zip::CompressionMethod method, int level, const QVector<unsigned char> &properties)
+{
+    if (method == K7Zip::CompressionMethod::Zstd) {
+        static_cast<KZstdFilter *>(filter)->setCompressionLevel(zstdCompressionLevel(level));
+        return filter->init(QIODevice::WriteOnly);
+    }
+    return static_cast<KXzFilter *>(filter)->init(QIODevice::WriteOnly, KXzFilter::Flag::LZMA2, properties);
+}
+
+static quint64 filterMethodID(K7Zip::Filter filter)
+{
+    switch (filter) {
+    case K7Zip::Filter::X86:
+        return k_BCJ;
+    case K7Zip::Filter::Arm64:
+        return k_ARM64;
+    case K7Zip::Filter::Delta:
+        return k_Delta;
+    default:
+        return 0;
+    }
+}
+
+static QVector<unsigned char> filterProperties(quint64 filterID, int deltaDistance)
+{
+    QVector<unsigned char> properties;
+    if (filterID == k_Delta) {
+        properties.append(deltaDistance - 1);
+    }
+    return properties;
+}
+
+// Chooses the pre-filter of a file from its first bytes, returns 0 if none applies
+static quint64 detectFilter(const char *data, qint64 size, int &deltaDistance)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+
+    // ELF: e_machine, in the byte order given by EI_DATA
+    if (size >= 20 && memcmp(p, "\x7F" "ELF", 4) == 0) {
+        const int machine = p[5] == 2 ? (p[18] << 8 | p[19]) : (p[18] | p[19] << 8);
+        if (machine == 3 || machine == 62) { // EM_386, EM_X86_64
+            return k_BCJ;
+        }
+        return machine == 183 ? k_ARM64 : 0; // EM_AARCH64
+    }
+
+    // PE: the machine follows the signature the DOS header points to
+    if (size >= 64 && p[0] == 'M' && p[1] == 'Z') {
+        const quint32 peOffset = qFromLittleEndian<quint32>(p + 0x3C);
+        if (quint64(peOffset) + 6 > quint64(size) || memcmp(p + peOffset, "PE\0\0", 4) != 0) {
+            return 0;
+        }
+        const quint16 machine = qFromLittleEndian<quint16>(p + peOffset + 4);
+        if (machine == 0x014C || machine == 0x8664) {
+            return k_BCJ;
+        }
+        return machine == 0xAA64 ? k_ARM64 : 0;
+    }
+
+    // 64-bit little endian Mach-O
+    if (size >= 8 && qFromLittleEndian<quint32>(p) == 0xFEEDFACF) {
+        const quint32 cpuType = qFromLittleEndian<quint32>(p + 4);
+        if (cpuType == 0x01000007) {
+            return k_BCJ;
+        }
+        return cpuType == 0x0100000C ? k_ARM64 : 0;
+    }
+
+    // PCM WAV whose format chunk comes first: the distance is the size of a sample frame
+    if (size >= 36 && memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WAVEfmt ", 8) == 0) {
+        const quint16 format = qFromLittleEndian<quint16>(p + 20);
+        const quint16 blockAlign = qFromLittleEndian<quint16>(p + 32);
+        if (format == 1 && blockAlign >= 1 && blockAlign <= 256) {
+            deltaDistance = blockAlign;
+            return k_Delta;
+        }
+    }
+    return 0;
+}
+
+/**
+ * The state of a pre-filter between two chunks of the same stream.
+ */
+struct K7ZipFilterState {
+    K7ZipFilterState()
+        : position(0)
+        , x86State(0)
+    {
+        memset(history, 0, sizeof(history));
+    }
+
+    quint32 position;
+    quint32 x86State;
+    // The last bytes of the Delta filter
+    unsigned char history[256];
+};
+
+static size_t convertFilter(quint64 filterID, int deltaDistance, K7ZipFilterState &state, unsigned char *data, size_t size, bool encoding);
+
+/**
+ * Compresses a solid block in a thread pool.
+ * The writer waits for done before using the result.
+ */
+class K7ZipBlockCompressor : public QRunnable
+{
+    Q_DISABLE_COPY_MOVE(K7ZipBlockCompressor)
+public:
+    explicit K7ZipBlockCompressor(const QByteArray &data,
+                                  int numStreams,
+                                  quint32 crc,
+                                  K7Zip::CompressionMethod method,
+                                  int level,
+                                  quint64 filterID,
+                                  int deltaDistance)
+        : input(data)
+        , method(method)
+        , level(level)
+        , filterID(filterID)
+        , deltaDistance(deltaDistance)
+        , numStreams(numStreams)
+        , crc(crc)
+        , unpackSize(data.size())
+        , ok(false)
+    {
+        setAutoDelete(false);
+        methodID = blockCoderProperties(method, level, qMin(unpackSize, quint64(LZMA2_PRESET_DICT_SIZE)), properties);
+    }
+
+    void run() override
+    {
+        if (filterID != 0) {
+            // The converters leave a few bytes at the end of the block as they are, which is what the decoder expects
+            K7ZipFilterState state;
+            convertFilter(filterID, deltaDistance, state, reinterpret_cast<unsigned char *>(input.data()), input.size(), true);
+        }
+        std::unique_ptr<KFilterBase> filter(KCompressionDevice::filterForCompressionType(blockCompressionType(method)));
+        if (filter && initBlockEncoder(filter.get(), method, level, properties)) {
+            filter->setInBuffer(input.constData(), input.size());
+            const int chunkSize = 64 * 1024;
+            KFilterBase::Result result = KFilterBase::Result::Ok;
+            while (result == KFilterBase::Result::Ok) {
+                const int oldSize = output.size();
+                output.resize(oldSize + chunkSize);
+                filter->setOutBuffer(output.data() + oldSize, chunkSize);
+                result = filter->compress(true);
+                output.resize(output.size() - filter->outBufferAvailable());
+            }
+            ok = result == KFilterBase::Result::End;
+            filter->terminate();
+        }
+        input.clear();
+        done.release();
+    }
+
+    QByteArray input;
+    QByteArray output;
+    const K7Zip::CompressionMethod method;
+    const int level;
+    const quint64 filterID;
+    const int deltaDistance;
+    quint64 methodID;
+    QVector<unsigned char> properties;
+    const int numStreams;
+    const quint32 crc;
+    const quint64 unpackSize;
+    bool ok;
+    QSemaphore done;
+};
+
+// Derives the 7zAES key from the password (in UTF-16LE), the salt and 2^numCyclesPower rounds of SHA-256
+static QByteArray deriveAesKey(const QByteArray &password, const QByteArray &salt, int numCyclesPower)
+{
+    if (numCyclesPower == 0x3F) {
+        QByteArray key = (salt + password).left(32);
+        key.append(QByteArray(32 - key.size(), '\0'));
+        return key;
+    }
+
+    // Each round hashes the salt, the password and the round number. The rounds are laid out
+    // back to back in a large buffer, so that the hash is fed a few large blocks rather than
+    // millions of tiny ones
+    const int recordSize = salt.size() + password.size() + 8;
+    const int recordsPerBatch = qMax(1, AES_KEY_BATCH_SIZE / recordSize);
+    QByteArray batch(recordsPerBatch * recordSize, Qt::Uninitialized);
+    for (int i = 0; i < recordsPerBatch; ++i) {
+        char *record = batch.data() + i * recordSize;
+        memcpy(record, salt.constData(), salt.size());
+        memcpy(record + salt.size(), password.constData(), password.size());
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    const quint64 numRounds = quint64(1) << numCyclesPower;
+    for (quint64 round = 0; round < numRounds;) {
+        const int count = int(qMin(quint64(recordsPerBatch), numRounds - round));
+        char *counter = batch.data() + salt.size() + password.size();
+        for (int i = 0; i < count; ++i, ++round, counter += recordSize) {
+            qToLittleEndian<quint64>(round, counter);
+        }
+        hash.addData(batch.constData(), count * recordSize);
+    }
+    return hash.result();
+}
+
+/**
+ * Derives the 7zAES keys from the password. The derivation is slow by design, so the keys
+ * are remembered for each salt and number of rounds, and shared by the folders decoded in parallel.
+ */
+class K7ZipKeyCache
+{
+    Q_DISABLE_COPY_MOVE(K7ZipKeyCache)
+public:
+    K7ZipKeyCache()
+        : m_hasPassword(false)
+    {
+    }
+
+    void setPassword(const QString &password)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_password.resize(password.size() * 2);
+        for (int i = 0; i < password.size(); ++i) {
+            qToLittleEndian<quint16>(password.at(i).unicode(), m_password.data() + 2 * i);
+        }
+        m_hasPassword = !password.isNull();
+        m_keys.clear();
+    }
+
+    bool hasPassword() const
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_hasPassword;
+    }
+
+    QByteArray key(int numCyclesPower, const QByteArray &salt)
+    {
+        QMutexLocker locker(&m_mutex);
+        QByteArray id(1, char(numCyclesPower));
+        id += salt;
+        auto it = m_keys.constFind(id);
+        if (it != m_keys.constEnd()) {
+            return *it;
+        }
+        const QByteArray key = deriveAesKey(m_password, salt, numCyclesPower);
+        m_keys.insert(id, key);
+        return key;
+    }
+
+private:
+    mutable QMutex m_mutex;
+    QByteArray m_password;
+    bool m_hasPassword;
+    QHash<QByteArray, QByteArray> m_keys;
+};
+
+/**
+ * Decodes a folder in a thread pool, from its packed streams read beforehand.
+ * The reader waits for done before using the result.
+ */
+class K7ZipFolderDecoder : public QRunnable
+{
+    Q_DISABLE_COPY_MOVE(K7ZipFolderDecoder)
+public:
+    explicit K7ZipFolderDecoder(int folderIndex, const Folder *folder, const QVector<QByteArray> &datas, K7ZipKeyCache *keys)
+        : folderIndex(folderIndex)
+        , folder(folder)
+        , keys(keys)
+        , datas(datas)
+    {
+        setAutoDelete(false);
+    }
+
+    void run() override;
+
+    const int folderIndex;
+    const Folder *const folder;
+    K7ZipKeyCache *const keys;
+    QVector<QByteArray> datas;
+    QByteArray output;
+    QSemaphore done;
+};
+
+/**
+ * The decoded header of an archive, shared by the instances that opened it, see KArchive::setCatalogueShared().
+ * It is never modified once published.
+ */
+class K7ZipSharedHeader
+{
+    Q_DISABLE_COPY_MOVE(K7ZipSharedHeader)
+public:
+    explicit K7ZipSharedHeader() = default;
+
+    ~K7ZipSharedHeader()
+    {
+        qDeleteAll(folders);
+    }
+
+    QVector<Folder *> folders;
+    QVector<FileInfo> fileInfos;
+    QVector<bool> mTimesDefined;
+    QVector<quint64> mTimes;
+    quint64 packPos = 0;
+    QVector<quint64> packSizes;
+    QVector<int> folderFirstPackStreams;
+    QVector<quint64> folderPackOffsets;
+    QVector<quint64> folderUnpackOffsets;
+};
+
 class Q_DECL_HIDDEN K7Zip::K7ZipPrivate
 {
     Q_DISABLE_COPY_MOVE(K7ZipPrivate)
@@ -406,19 +783,45 @@ public:
         : q(parent)
         , packPos(0)
         , numPackStreams(0)
+        , folderCacheCost(0)
+        , folderCacheSize(DEFAULT_FOLDER_CACHE_SIZE)
+        , folderCacheHits(0)
+        , folderCacheMisses(0)
+        , folderCacheEvictions(0)
+        , decodingThreadCount(QThread::idealThreadCount())
+        , decodingPool(nullptr)
         , buffer(nullptr)
         , pos(0)
         , end(0)
         , headerSize(0)
         , countSize(0)
         , m_currentFile(nullptr)
+        , m_solidBlockSize(K7Zip::SolidArchive)
+        , m_compressionMethod(K7Zip::CompressionMethod::Lzma2)
+        , m_compressionLevel(-1)
+        , m_filter(K7Zip::Filter::NoFilter)
+        , m_deltaDistance(1)
+        , m_currentFileHasData(false)
+        , m_compressionThreadCount(QThread::idealThreadCount())
+        , m_compressionPool(nullptr)
+        , m_blockStreams(0)
+        , m_blockUnpackSize(0)
+        , m_blockCRC(0)
+        , m_blockFilterID(0)
+        , m_blockDeltaDistance(1)
+        , m_encoder(nullptr)
+        , m_encoderMethodID(0)
+        , m_encoderStart(0)
     {
     }
 
     ~K7ZipPrivate()
     {
-        qDeleteAll(folders);
-        qDeleteAll(fileInfos);
+        if (!sharedHeader) {
+            qDeleteAll(folders);
+        }
+        resetWriting();
+        delete decodingPool;
     }
 
     K7Zip *q;
@@ -427,8 +830,10 @@ public:
     QVector<quint32> packCRCs;
     QVector<quint64> numUnpackStreamsInFolders;
 
+    // Owned by sharedHeader when set
     QVector<Folder *> folders;
-    QVector<FileInfo *> fileInfos;
+    // Stored contiguously, archives can list millions of files
+    QVector<FileInfo> fileInfos;
     // File information
     QVector<bool> cTimesDefined;
     QVector<quint64> cTimes;
@@ -449,6 +854,24 @@ public:
 
     QVector<bool> isAnti;
 
+    // Where the packed streams and the unpacked data of each folder start, see computeFolderPackStreams()
+    QVector<int> folderFirstPackStreams;
+    QVector<quint64> folderPackOffsets;
+    QVector<quint64> folderUnpackOffsets;
+    // Decoded folders by index, the least recently used first in folderCacheOrder
+    QHash<int, QByteArray> decodedFolders;
+    QVector<int> folderCacheOrder;
+    qint64 folderCacheCost;
+    qint64 folderCacheSize;
+    quint64 folderCacheHits;
+    quint64 folderCacheMisses;
+    quint64 folderCacheEvictions;
+    // Folders following the one being read are decoded ahead in this pool, see folderData()
+    int decodingThreadCount;
+    QThreadPool *decodingPool;
+    K7ZipKeyCache keyCache;
+    std::shared_ptr<const K7ZipSharedHeader> sharedHeader;
+
     const char *buffer;
     quint64 pos;
     quint64 end;
@@ -457,18 +880,51 @@ public:
 
     // Write
     QByteArray header;
-    QByteArray outData; // Store data in this buffer before compress and write in archive.
     K7ZipFileEntry *m_currentFile;
-    QVector<KArchiveEntry *> m_entryList;
+    // Files and symlinks whose data is in the packed stream, in the order it was written
+    QVector<K7ZipFileEntry *> m_entryList;
+    qint64 m_solidBlockSize;
+    K7Zip::CompressionMethod m_compressionMethod;
+    int m_compressionLevel;
+    K7Zip::Filter m_filter;
+    int m_deltaDistance;
+    // Whether data was written for m_currentFile, see chooseFileFilter()
+    bool m_currentFileHasData;
+    int m_compressionThreadCount;
+    // Blocks being compressed in the pool, written to the archive in this order
+    QThreadPool *m_compressionPool;
+    QVector<K7ZipBlockCompressor *> m_pendingBlocks;
+    // The block being filled
+    QByteArray m_blockData;
+    int m_blockStreams;
+    quint64 m_blockUnpackSize;
+    quint32 m_blockCRC;
+    // The pre-filter of the block, 0 for none
+    quint64 m_blockFilterID;
+    int m_blockDeltaDistance;
+    // Set when the current block is compressed straight into the archive, see streamingThreshold()
+    KCompressionDevice *m_encoder;
+    quint64 m_encoderMethodID;
+    QVector<unsigned char> m_encoderProperties;
+    quint64 m_encoderStart;
+    // The data of the streamed block the pre-filter can't convert yet
+    K7ZipFilterState m_encoderFilterState;
+    QByteArray m_encoderFilterBuffer;
+    // The blocks written to the archive so far
+    QVector<Folder *> m_writtenFolders;
+    QVector<quint64> m_writtenPackSizes;
+    QVector<quint64> m_writtenStreamCounts;
 
     void clear()
     {
         packCRCsDefined.clear();
         packCRCs.clear();
         numUnpackStreamsInFolders.clear();
-        qDeleteAll(folders);
+        if (!sharedHeader) {
+            qDeleteAll(folders);
+        }
+        sharedHeader.reset();
         folders.clear();
-        qDeleteAll(fileInfos);
         fileInfos.clear();
         cTimesDefined.clear();
         cTimes.clear();
@@ -484,6 +940,10 @@ public:
         digestsDefined.clear();
         digests.clear();
         isAnti.clear();
+        folderFirstPackStreams.clear();
+        folderPackOffsets.clear();
+        folderUnpackOffsets.clear();
+        clearFolderCache();
 
         buffer = nullptr;
         pos = 0;
@@ -493,6 +953,7 @@ public:
     }
 
     // Read
+    bool hasBytes(quint64 count) const;
     int readByte();
     quint32 readUInt32();
     quint64 readUInt64();
@@ -511,9 +972,39 @@ public:
     bool readUnpackInfo();
     bool readSubStreamsInfo();
     QByteArray readAndDecodePackedStreams(bool readMainStreamInfo = true);
+    void computeFolderPackStreams();
+    bool readFolderPackedStreams(int folderIndex, QVector<QByteArray> &datas);
+    QByteArray decodeFolder(int folderIndex);
+    QByteArray folderData(int folderIndex);
+    void clearFolderCache();
+    void trimFolderCache();
+    QByteArray catalogueCacheKey(const char *startHeader) const;
+    bool loadCatalogueCache(const QByteArray &key);
+    void saveCatalogueCache(const QByteArray &key) const;
+    QByteArray sharedHeaderKey(const QByteArray &cacheKey) const;
+    bool adoptSharedHeader(const QByteArray &key);
+    void shareHeader(const QByteArray &key);
+    void startReading();
 
     // Write
-    void createItemsFromEntities(const KArchiveDirectory *, const QString &, QByteArray &);
+    void resetWriting();
+    qint64 streamingThreshold() const;
+    bool chooseFileFilter(const char *data, qint64 size);
+    bool writeEntryData(const char *data, qint64 size);
+    bool writeToEncoder(const char *data, qint64 size);
+    bool finishBlock();
+    bool finishBlockIfFull();
+    bool writeOldestPendingBlock();
+    bool flushPendingBlocks();
+    void addWrittenFolder(quint64 packSize,
+                          quint64 unpackSize,
+                          quint32 crc,
+                          quint64 methodID,
+                          const QVector<unsigned char> &properties,
+                          quint64 filterID,
+                          int deltaDistance,
+                          int numStreams);
+    void createItemsFromEntities(const KArchiveDirectory *, const QString &, QHash<const KArchiveEntry *, QString> &);
     void writeByte(unsigned char b);
     void writeNumber(quint64 value);
     void writeBoolVector(const QVector<bool> &boolVector);
@@ -554,6 +1045,67 @@ K7Zip::~K7Zip()
     delete d;
 }
 
+K7ZipFileEntry::K7ZipFileEntry(K7Zip *zip,
+                               const QString &name,
+                               int access,
+                               const QDateTime &date,
+                               const QString &user,
+                               const QString &group,
+                               const QString &symlink,
+                               qint64 pos,
+                               qint64 size,
+                               int folderIndex)
+    : KArchiveFile(zip, name, access, date, user, group, symlink, pos, size)
+    , m_folderIndex(folderIndex)
+    , m_crc(0)
+{
+}
+
+K7ZipFileEntry::~K7ZipFileEntry()
+{
+}
+
+QByteArray K7ZipFileEntry::data() const
+{
+    if (m_folderIndex < 0) {
+        return QByteArray();
+    }
+    K7Zip *zip = static_cast<K7Zip *>(archive());
+    const qint64 offset = position() - zip->d->folderUnpackOffsets.value(m_folderIndex);
+    return zip->d->folderData(m_folderIndex).mid(offset, size());
+}
+
+QIODevice *K7ZipFileEntry::createDevice() const
+{
+    QBuffer *buffer = new QBuffer;
+    buffer->setData(data());
+    buffer->open(QIODevice::ReadOnly);
+    return buffer;
+}
+
+void K7ZipFileEntry::virtual_hook(int id, void *data)
+{
+    if (id != KArchiveReadChunksHook::Id) {
+        KArchiveFile::virtual_hook(id, data);
+        return;
+    }
+    // The decoded folder is in memory already, the file is visited in one chunk without copying it
+    KArchiveReadChunksHook *hook = static_cast<KArchiveReadChunksHook *>(data);
+    hook->handled = true;
+    if (m_folderIndex < 0) {
+        hook->result = true;
+        return;
+    }
+    K7Zip *zip = static_cast<K7Zip *>(archive());
+    const QByteArray folder = zip->d->folderData(m_folderIndex);
+    const qint64 offset = position() - zip->d->folderUnpackOffsets.value(m_folderIndex);
+    if (offset < 0 || offset + size() > folder.size()) {
+        hook->result = false;
+        return;
+    }
+    hook->result = hook->visit(folder.constData() + offset, size());
+}
+
 int K7Zip::K7ZipPrivate::readByte()
 {
     if (!buffer || pos + 1 > end) {
@@ -607,40 +1159,44 @@ quint64 K7Zip::K7ZipPrivate::readNumber()
     return value;
 }
 
-QString K7Zip::K7ZipPrivate::readString()
+// Returns the number of UTF-16 code units before the null terminator of the string at data,
+// or -1 if there is none within maxUnits. Checks four code units at a time
+static qint64 utf16StringLength(const char *data, quint64 maxUnits)
 {
-    if (!buffer) {
-        return QString();
-    }
-
-    const char *buf = buffer + pos;
-    size_t rem = (end - pos) / 2 * 2;
-    {
-        size_t i;
-        for (i = 0; i < rem; i += 2) {
-            if (buf[i] == 0 && buf[i + 1] == 0) {
-                break;
-            }
+    quint64 i = 0;
+    for (; i + 4 <= maxUnits; i += 4) {
+        quint64 units;
+        memcpy(&units, data + 2 * i, sizeof(units));
+        // Non-zero if and only if one of the four 16-bit lanes is zero
+        if (((units - 0x0001000100010001ULL) & ~units & 0x8000800080008000ULL) != 0) {
+            break;
         }
-        if (i == rem) {
-            qCDebug(KArchiveLog) << "read string error";
-            return QString();
+    }
+    for (; i < maxUnits; ++i) {
+        if (data[2 * i] == 0 && data[2 * i + 1] == 0) {
+            return i;
         }
-        rem = i;
     }
+    return -1;
+}
 
-    int len = (int)(rem / 2);
-    if (len < 0 || (size_t)len * 2 != rem) {
-        qCDebug(KArchiveLog) << "read string unsupported";
+QString K7Zip::K7ZipPrivate::readString()
+{
+    if (!buffer) {
         return QString();
     }
 
-    QString p;
-    for (int i = 0; i < len; i++, buf += 2) {
-        p += (wchar_t)GetUi16(buf, 0);
+    const qint64 len = utf16StringLength(buffer + pos, (end - pos) / 2);
+    if (len < 0 || len > std::numeric_limits<int>::max()) {
+        qCDebug(KArchiveLog) << "read string error";
+        return QString();
     }
 
-    pos += rem + 2;
+    // A plain copy on little endian hosts
+    QString p(int(len), Qt::Uninitialized);
+    qFromLittleEndian<quint16>(buffer + pos, len, p.data());
+
+    pos += 2 * len + 2;
     return p;
 }
 
@@ -670,27 +1226,38 @@ bool K7Zip::K7ZipPrivate::findAttribute(int attribute)
     }
 }
 
+bool K7Zip::K7ZipPrivate::hasBytes(quint64 count) const
+{
+    return buffer && pos <= end && end - pos >= count;
+}
+
 void K7Zip::K7ZipPrivate::readBoolVector(int numItems, QVector<bool> &v)
 {
-    if (!buffer) {
+    if (!buffer || numItems <= 0) {
+        return;
+    }
+
+    // The items are always added, false when the vector is truncated, so that callers can index them
+    const int first = v.size();
+    v.resize(first + numItems);
+    const quint64 numBytes = (quint64(numItems) + 7) / 8;
+    if (!hasBytes(numBytes)) {
+        qCDebug(KArchiveLog) << "bool vector out of bounds";
+        pos = end;
         return;
     }
 
-    unsigned char b = 0;
-    unsigned char mask = 0;
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(buffer + pos);
+    bool *out = v.data() + first;
     for (int i = 0; i < numItems; i++) {
-        if (mask == 0) {
-            b = readByte();
-            mask = 0x80;
-        }
-        v.append((b & mask) != 0);
-        mask >>= 1;
+        out[i] = (in[i >> 3] & (0x80 >> (i & 7))) != 0;
     }
+    pos += numBytes;
 }
 
 void K7Zip::K7ZipPrivate::readBoolVector2(int numItems, QVector<bool> &v)
 {
-    if (!buffer) {
+    if (!buffer || numItems < 0) {
         return;
     }
 
@@ -700,25 +1267,33 @@ void K7Zip::K7ZipPrivate::readBoolVector2(int numItems, QVector<bool> &v)
         return;
     }
 
-    for (int i = 0; i < numItems; i++) {
-        v.append(true);
-    }
+    const int first = v.size();
+    v.resize(first + numItems);
+    std::fill(v.begin() + first, v.end(), true);
 }
 
 void K7Zip::K7ZipPrivate::readHashDigests(int numItems, QVector<bool> &digestsDefined, QVector<quint32> &digests)
 {
-    if (!buffer) {
+    if (!buffer || numItems < 0) {
         return;
     }
 
     readBoolVector2(numItems, digestsDefined);
+    const bool *defined = digestsDefined.constData() + digestsDefined.size() - numItems;
+    const int first = digests.size();
+    digests.resize(first + numItems);
+    if (!hasBytes(4 * quint64(std::count(defined, defined + numItems, true)))) {
+        qCDebug(KArchiveLog) << "digests out of bounds";
+        pos = end;
+        return;
+    }
+
+    quint32 *out = digests.data() + first;
     for (int i = 0; i < numItems; i++) {
-        quint32 crc = 0;
-        if (digestsDefined[i]) {
-            crc = GetUi32(buffer, pos);
+        if (defined[i]) {
+            out[i] = GetUi32(buffer, pos);
             pos += 4;
         }
-        digests.append(crc);
     }
 }
 
@@ -821,7 +1396,7 @@ Folder *K7Zip::K7ZipPrivate::folderItem()
 
 bool K7Zip::K7ZipPrivate::readUInt64DefVector(int numFiles, QVector<quint64> &values, QVector<bool> &defined)
 {
-    if (!buffer) {
+    if (!buffer || numFiles < 0) {
         return false;
     }
 
@@ -838,12 +1413,20 @@ bool K7Zip::K7ZipPrivate::readUInt64DefVector(int numFiles, QVector<quint64> &va
         // TODO : go to the new index
     }
 
+    const bool *isDefined = defined.constData() + defined.size() - numFiles;
+    const int first = values.size();
+    values.resize(first + numFiles);
+    if (!hasBytes(8 * quint64(std::count(isDefined, isDefined + numFiles, true)))) {
+        qCDebug(KArchiveLog) << "values out of bounds";
+        return false;
+    }
+
+    quint64 *out = values.data() + first;
     for (int i = 0; i < numFiles; i++) {
-        quint64 t = 0;
-        if (defined[i]) {
-            t = readUInt64();
+        if (isDefined[i]) {
+            out[i] = GetUi64(buffer, pos);
+            pos += 8;
         }
-        values.append(t);
     }
     return true;
 }
@@ -992,6 +1575,16 @@ bool K7Zip::K7ZipPrivate::readSubStreamsInfo()
         }
     }
 
+    // Presize from the declared counts, bounded by the header size as each size takes at least a byte
+    quint64 numStreamsTotal = 0;
+    for (quint64 numSubstreams : qAsConst(numUnpackStreamsInFolders)) {
+        numStreamsTotal += numSubstreams;
+    }
+    const int reserved = int(qMin(numStreamsTotal, quint64(folders.size()) + (end - pos)));
+    unpackSizes.reserve(unpackSizes.size() + reserved);
+    digestsDefined.reserve(digestsDefined.size() + reserved);
+    digests.reserve(digests.size() + reserved);
+
     for (int i = 0; i < numUnpackStreamsInFolders.size(); i++) {
         quint64 numSubstreams = numUnpackStreamsInFolders.at(i);
         if (numSubstreams == 0) {
@@ -1043,10 +1636,8 @@ bool K7Zip::K7ZipPrivate::readSubStreamsInfo()
             }
         } else if (static_cast<HeaderType>(type) == HeaderType::kEnd) {
             if (digestsDefined.isEmpty()) {
-                for (int i = 0; i < numDigestsTotal; i++) {
-                    digestsDefined.append(false);
-                    digests.append(0);
-                }
+                digestsDefined.fill(false, numDigestsTotal);
+                digests.fill(0, numDigestsTotal);
             }
 
             break;
@@ -1169,78 +1760,6 @@ bool K7Zip::K7ZipPrivate::readMainStreamsInfo()
     return false;
 }
 
-static bool getInStream(const Folder *folder, quint32 streamIndex, int &seqInStream, quint32 &coderIndex)
-{
-    for (int i = 0; i < folder->packedStreams.size(); i++) {
-        if (folder->packedStreams[i] == streamIndex) {
-            seqInStream = i;
-            return true;
-        }
-    }
-
-    int binderIndex = folder->findBindPairForInStream(streamIndex);
-    if (binderIndex < 0) {
-        return false;
-    }
-
-    quint32 coderStreamIndex;
-    folder->findOutStream(folder->outIndexes[binderIndex], coderIndex, coderStreamIndex);
-
-    quint32 startIndex = folder->getCoderInStreamIndex(coderIndex);
-
-    if (folder->folderInfos[coderIndex]->numInStreams > 1) {
-        return false;
-    }
-
-    for (int i = 0; i < (int)folder->folderInfos[coderIndex]->numInStreams; i++) {
-        getInStream(folder, startIndex + i, seqInStream, coderIndex);
-    }
-
-    return true;
-}
-
-static bool getOutStream(const Folder *folder, quint32 streamIndex, int &seqOutStream)
-{
-    QVector<quint32> outStreams;
-    quint32 outStreamIndex = 0;
-    for (int i = 0; i < folder->folderInfos.size(); i++) {
-        const Folder::FolderInfo *coderInfo = folder->folderInfos.at(i);
-
-        for (int j = 0; j < coderInfo->numOutStreams; j++, outStreamIndex++) {
-            if (folder->findBindPairForOutStream(outStreamIndex) < 0) {
-                outStreams.append(outStreamIndex);
-            }
-        }
-    }
-
-    for (int i = 0; i < outStreams.size(); i++) {
-        if (outStreams[i] == streamIndex) {
-            seqOutStream = i;
-            return true;
-        }
-    }
-
-    int binderIndex = folder->findBindPairForOutStream(streamIndex);
-    if (binderIndex < 0) {
-        return false;
-    }
-
-    quint32 coderIndex, coderStreamIndex;
-    folder->findInStream(folder->inIndexes[binderIndex], coderIndex, coderStreamIndex);
-
-    quint32 startIndex = folder->getCoderOutStreamIndex(coderIndex);
-
-    if (folder->folderInfos[coderIndex]->numOutStreams > 1) {
-        return false;
-    }
-
-    for (int i = 0; i < (int)folder->folderInfos[coderIndex]->numOutStreams; i++) {
-        getOutStream(folder, startIndex + i, seqOutStream);
-    }
-
-    return true;
-}
-
 const int kNumTopBits = 24;
 const quint32 kTopValue = (1 << kNumTopBits);
 
@@ -1262,7 +1781,7 @@ public:
 
     unsigned char readByte()
     {
-        return stream[pos++];
+        return pos < stream.size() ? stream.at(pos++) : 0;
     }
 
     void normalize()
@@ -1403,81 +1922,162 @@ inline unsigned getIndex(unsigned char b0, unsigned char b1)
 
 const int kNumMoveBits = 5;
 
-static QByteArray decodeBCJ2(const QByteArray &mainStream, const QByteArray &callStream, const QByteArray &jumpStream, const QByteArray &rangeBuffer)
+// Converts the relative call and jump targets of x86 code back from (or to) absolute addresses,
+// as the BCJ filter does. state carries the recent E8/E9 positions between calls.
+// Returns the number of bytes processed, the last four bytes of a buffer are left to the next call
+static size_t x86Convert(unsigned char *data, size_t size, quint32 ip, quint32 &state, bool encoding)
 {
-    unsigned char prevByte = 0;
-    QByteArray outStream;
-    int mainStreamPos = 0;
-    int callStreamPos = 0;
-    int jumpStreamPos = 0;
-
-    RangeDecoder rangeDecoder;
-    rangeDecoder.setStream(rangeBuffer);
-    rangeDecoder.init();
-
-    QVector<CBitDecoder<kNumMoveBits>> statusDecoder(256 + 2);
+    static const bool maskToAllowedStatus[8] = {true, true, true, false, true, false, false, false};
+    static const int maskToBitNumber[8] = {0, 1, 2, 2, 3, 3, 3, 3};
+    const auto isMostSignificantByte = [](unsigned char b) {
+        return b == 0 || b == 0xFF;
+    };
 
-    for (int i = 0; i < 256 + 2; i++) {
-        statusDecoder[i].init();
+    if (size < 5) {
+        return 0;
     }
+    ip += 5;
+    size_t bufferPos = 0;
+    size_t prevPos = size_t(0) - 1;
+    quint32 prevMask = state & 0x7;
 
     for (;;) {
-        quint32 i;
-        unsigned char b = 0;
-        const quint32 kBurstSize = (1 << 18);
-        for (i = 0; i < kBurstSize; i++) {
-            if (mainStreamPos == mainStream.size()) {
-                return outStream;
-            }
-
-            b = mainStream[mainStreamPos++];
-            outStream.append(b);
-
-            if (isJ(prevByte, b)) {
-                break;
-            }
-            prevByte = b;
+        unsigned char *p = data + bufferPos;
+        unsigned char *limit = data + size - 4;
+        while (p < limit && (*p & 0xFE) != 0xE8) {
+            ++p;
         }
-
-        if (i == kBurstSize) {
-            continue;
+        bufferPos = p - data;
+        if (p >= limit) {
+            break;
         }
-
-        unsigned index = getIndex(prevByte, b);
-        if (statusDecoder[index].decode(&rangeDecoder) == 1) {
-            if (b == 0xE8) {
-                if (callStreamPos + 4 > callStream.size()) {
-                    return QByteArray();
-                }
-            } else {
-                if (jumpStreamPos + 4 > jumpStream.size()) {
-                    return QByteArray();
+        prevPos = bufferPos - prevPos;
+        if (prevPos > 3) {
+            prevMask = 0;
+        } else {
+            prevMask = (prevMask << (int(prevPos) - 1)) & 0x7;
+            if (prevMask != 0) {
+                const unsigned char b = p[4 - maskToBitNumber[prevMask]];
+                if (!maskToAllowedStatus[prevMask] || isMostSignificantByte(b)) {
+                    prevPos = bufferPos;
+                    prevMask = ((prevMask << 1) & 0x7) | 1;
+                    ++bufferPos;
+                    continue;
                 }
             }
-            quint32 src = 0;
-            for (int i = 0; i < 4; i++) {
-                unsigned char b0;
-                if (b == 0xE8) {
-                    b0 = callStream[callStreamPos++];
+        }
+        prevPos = bufferPos;
+
+        if (isMostSignificantByte(p[4])) {
+            quint32 src = quint32(p[4]) << 24 | quint32(p[3]) << 16 | quint32(p[2]) << 8 | quint32(p[1]);
+            quint32 dest;
+            for (;;) {
+                if (encoding) {
+                    dest = (ip + quint32(bufferPos)) + src;
                 } else {
-                    b0 = jumpStream[jumpStreamPos++];
+                    dest = src - (ip + quint32(bufferPos));
                 }
-                src <<= 8;
-                src |= ((quint32)b0);
+                if (prevMask == 0) {
+                    break;
+                }
+                const int index = maskToBitNumber[prevMask] * 8;
+                const unsigned char b = dest >> (24 - index);
+                if (!isMostSignificantByte(b)) {
+                    break;
+                }
+                src = dest ^ ((1u << (32 - index)) - 1);
+            }
+            p[4] = ~(((dest >> 24) & 1) - 1);
+            p[3] = dest >> 16;
+            p[2] = dest >> 8;
+            p[1] = dest;
+            bufferPos += 5;
+        } else {
+            prevMask = ((prevMask << 1) & 0x7) | 1;
+            ++bufferPos;
+        }
+    }
+    prevPos = bufferPos - prevPos;
+    state = prevPos > 3 ? 0 : ((prevMask << (int(prevPos) - 1)) & 0x7);
+    return bufferPos;
+}
+
+// Converts the relative targets of ARM64 BL and ADRP instructions to absolute addresses, or back.
+// Returns the number of bytes processed, a multiple of 4
+static size_t arm64Convert(unsigned char *data, size_t size, quint32 pc, bool encoding)
+{
+    size_t i;
+    for (i = 0; i + 4 <= size; i += 4) {
+        quint32 instruction = quint32(data[i]) | quint32(data[i + 1]) << 8 | quint32(data[i + 2]) << 16 | quint32(data[i + 3]) << 24;
+        const quint32 position = pc + quint32(i);
+
+        if ((instruction >> 26) == 0x25) {
+            // BL
+            const quint32 offset = encoding ? position >> 2 : 0u - (position >> 2);
+            instruction = 0x94000000 | ((instruction + offset) & 0x03FFFFFF);
+        } else if ((instruction & 0x9F000000) == 0x90000000) {
+            // ADRP, only converted within +/-512 MiB so that small addresses remain small
+            const quint32 src = ((instruction >> 29) & 3) | ((instruction >> 3) & 0x001FFFFC);
+            if ((src + 0x00020000) & 0x001C0000) {
+                continue;
             }
+            const quint32 offset = encoding ? position >> 12 : 0u - (position >> 12);
+            const quint32 dest = src + offset;
+            instruction &= 0x9000001F;
+            instruction |= (dest & 3) << 29;
+            instruction |= (dest & 0x0003FFFC) << 3;
+            instruction |= (0u - (dest & 0x00020000)) & 0x00E00000;
+        } else {
+            continue;
+        }
 
-            quint32 dest = src - (quint32(outStream.size()) + 4);
-            outStream.append((unsigned char)(dest));
-            outStream.append((unsigned char)(dest >> 8));
-            outStream.append((unsigned char)(dest >> 16));
-            outStream.append((unsigned char)(dest >> 24));
-            prevByte = (unsigned char)(dest >> 24);
+        data[i] = instruction;
+        data[i + 1] = instruction >> 8;
+        data[i + 2] = instruction >> 16;
+        data[i + 3] = instruction >> 24;
+    }
+    return i;
+}
+
+// Replaces each byte with its difference to the byte distance positions before it, or back.
+// history holds the last 256 bytes of original data, indexed by their position
+static void deltaConvert(unsigned char *data, size_t size, int distance, quint32 position, unsigned char *history, bool encoding)
+{
+    for (size_t i = 0; i < size; ++i, ++position) {
+        const unsigned char previous = history[(position - distance) & 0xFF];
+        if (encoding) {
+            history[position & 0xFF] = data[i];
+            data[i] -= previous;
         } else {
-            prevByte = b;
+            data[i] += previous;
+            history[position & 0xFF] = data[i];
         }
     }
 }
 
+// Applies the pre-filter filterID to data in place, continuing from state. Returns how many bytes were
+// converted; the others are to be passed again with the data that follows, or left as they are at its end
+static size_t convertFilter(quint64 filterID, int deltaDistance, K7ZipFilterState &state, unsigned char *data, size_t size, bool encoding)
+{
+    size_t done = 0;
+    switch (filterID) {
+    case k_BCJ:
+        done = x86Convert(data, size, state.position, state.x86State, encoding);
+        break;
+    case k_ARM64:
+        done = arm64Convert(data, size, state.position, encoding);
+        break;
+    case k_Delta:
+        deltaConvert(data, size, deltaDistance, state.position, state.history, encoding);
+        done = size;
+        break;
+    default:
+        break;
+    }
+    state.position += done;
+    return done;
+}
+
 QByteArray K7Zip::K7ZipPrivate::readAndDecodePackedStreams(bool readMainStreamInfo)
 {
     if (!buffer) {
@@ -1488,265 +2088,1317 @@ QByteArray K7Zip::K7ZipPrivate::readAndDecodePackedStreams(bool readMainStreamIn
         readMainStreamsInfo();
     }
 
-    QByteArray inflatedData;
+    computeFolderPackStreams();
 
-    quint64 startPos = 32 + packPos;
+    QByteArray inflatedData;
     for (int i = 0; i < folders.size(); i++) {
-        const Folder *folder = folders.at(i);
-        quint64 unpackSize64 = folder->getUnpackSize();
-        size_t unpackSize = (size_t)unpackSize64;
-        if (unpackSize != unpackSize64) {
-            qCDebug(KArchiveLog) << "unsupported";
-            return inflatedData;
-        }
-
-        // Find main coder
-        quint32 mainCoderIndex = 0;
-        QVector<int> outStreamIndexed;
-        int outStreamIndex = 0;
-        for (int j = 0; j < folder->folderInfos.size(); j++) {
-            const Folder::FolderInfo *info = folder->folderInfos[j];
-            for (int k = 0; k < info->numOutStreams; k++, outStreamIndex++) {
-                if (folder->findBindPairForOutStream(outStreamIndex) < 0) {
-                    outStreamIndexed.append(outStreamIndex);
-                    break;
-                }
-            }
+        const QByteArray inflated = decodeFolder(i);
+        if (inflated.isEmpty()) {
+            return QByteArray();
         }
+        inflatedData.append(inflated);
 
-        quint32 temp = 0;
-        if (!outStreamIndexed.isEmpty()) {
-            folder->findOutStream(outStreamIndexed[0], mainCoderIndex, temp);
+        for (int j = 0; j < folders.at(i)->packedStreams.size(); j++) {
+            const quint64 size = packSizes.value(folderFirstPackStreams[i] + j);
+            pos += size;
+            headerSize += size;
         }
+    }
+
+    return inflatedData;
+}
 
-        quint32 startInIndex = folder->getCoderInStreamIndex(mainCoderIndex);
-        quint32 startOutIndex = folder->getCoderOutStreamIndex(mainCoderIndex);
+void K7Zip::K7ZipPrivate::computeFolderPackStreams()
+{
+    folderFirstPackStreams.clear();
+    folderPackOffsets.clear();
+    folderUnpackOffsets.clear();
+    folderFirstPackStreams.reserve(folders.size());
+    folderPackOffsets.reserve(folders.size());
+    folderUnpackOffsets.reserve(folders.size());
+
+    int packStream = 0;
+    quint64 offset = 32 + packPos;
+    quint64 unpackOffset = 0;
+    for (const Folder *folder : qAsConst(folders)) {
+        folderFirstPackStreams.append(packStream);
+        folderPackOffsets.append(offset);
+        folderUnpackOffsets.append(unpackOffset);
+        for (int j = 0; j < folder->packedStreams.size() && packStream < packSizes.size(); j++) {
+            offset += packSizes.at(packStream++);
+        }
+        unpackOffset += folder->getUnpackSize();
+    }
+}
 
-        Folder::FolderInfo *mainCoder = folder->folderInfos[mainCoderIndex];
+bool K7Zip::K7ZipPrivate::readFolderPackedStreams(int i, QVector<QByteArray> &datas)
+{
+    if (i < 0 || i >= folders.size() || i >= folderPackOffsets.size()) {
+        return false;
+    }
 
-        QVector<int> seqInStreams;
-        QVector<quint32> coderIndexes;
-        seqInStreams.reserve(mainCoder->numInStreams);
-        coderIndexes.reserve(mainCoder->numInStreams);
-        for (int j = 0; j < (int)mainCoder->numInStreams; j++) {
-            int seqInStream;
-            quint32 coderIndex;
-            getInStream(folder, startInIndex + j, seqInStream, coderIndex);
-            seqInStreams.append(seqInStream);
-            coderIndexes.append(coderIndex);
+    const Folder *folder = folders.at(i);
+    quint64 startPos = folderPackOffsets.at(i);
+    const int firstPackStream = folderFirstPackStreams.at(i);
+    QIODevice *dev = q->device();
+    for (int j = 0; j < folder->packedStreams.size(); j++) {
+        if (firstPackStream + j >= packSizes.size()) {
+            qCDebug(KArchiveLog) << "missing pack stream" << firstPackStream + j;
+            return false;
+        }
+        const qint64 size = packSizes.at(firstPackStream + j);
+        if (!dev->seek(startPos)) {
+            return false;
         }
+        const QByteArray deflatedData = dev->read(size);
+        if (deflatedData.size() != size) {
+            qCDebug(KArchiveLog) << "Failed read next size, should read " << size << ", read " << deflatedData.size();
+            return false;
+        }
+        datas.append(deflatedData);
+        startPos += size;
+    }
+    return true;
+}
 
-        QVector<int> seqOutStreams;
-        seqOutStreams.reserve(mainCoder->numOutStreams);
-        for (int j = 0; j < (int)mainCoder->numOutStreams; j++) {
-            int seqOutStream;
-            getOutStream(folder, startOutIndex + j, seqOutStream);
-            seqOutStreams.append(seqOutStream);
+// Decrypts a 7zAES stream in place, leaving its first outSize bytes
+static bool decryptAes(const Folder::FolderInfo *coder, K7ZipKeyCache *keys, QByteArray &data, quint64 outSize)
+{
+    const QVector<unsigned char> &properties = coder->properties;
+    if (properties.isEmpty()) {
+        return false;
+    }
+    const int numCyclesPower = properties[0] & 0x3F;
+    QByteArray salt;
+    unsigned char iv[16] = {0};
+    if (properties[0] & 0xC0) {
+        if (properties.size() < 2) {
+            return false;
+        }
+        const int saltSize = ((properties[0] >> 7) & 1) + (properties[1] >> 4);
+        const int ivSize = ((properties[0] >> 6) & 1) + (properties[1] & 0x0F);
+        if (properties.size() < 2 + saltSize + ivSize) {
+            return false;
+        }
+        for (int i = 0; i < saltSize; ++i) {
+            salt.append(char(properties[2 + i]));
         }
+        for (int i = 0; i < ivSize; ++i) {
+            iv[i] = properties[2 + saltSize + i];
+        }
+    }
+    if (numCyclesPower > 24 && numCyclesPower != 0x3F) {
+        qCDebug(KArchiveLog) << "unsupported number of key derivation rounds" << numCyclesPower;
+        return false;
+    }
+    if (!keys || !keys->hasPassword()) {
+        qCDebug(KArchiveLog) << "encrypted data, but no password was set";
+        return false;
+    }
+    if (data.size() % 16 != 0 || quint64(data.size()) < outSize) {
+        qCDebug(KArchiveLog) << "wrong encrypted stream size" << data.size();
+        return false;
+    }
 
-        QVector<QByteArray> datas;
-        for (int j = 0; j < (int)mainCoder->numInStreams; j++) {
-            int size = packSizes[j + i];
-            std::unique_ptr<char[]> encodedBuffer(new char[size]);
-            QIODevice *dev = q->device();
-            dev->seek(startPos);
-            quint64 n = dev->read(encodedBuffer.get(), size);
-            if (n != (quint64)size) {
-                qCDebug(KArchiveLog) << "Failed read next size, should read " << size << ", read " << n;
-                return inflatedData;
-            }
-            QByteArray deflatedData(encodedBuffer.get(), size);
-            datas.append(deflatedData);
-            startPos += size;
-            pos += size;
-            headerSize += size;
+    const QByteArray key = keys->key(numCyclesPower, salt);
+    KAesDecryptor decryptor(reinterpret_cast<const unsigned char *>(key.constData()), iv);
+    decryptor.decrypt(reinterpret_cast<unsigned char *>(data.data()), data.size());
+    data.truncate(outSize);
+    return true;
+}
+
+// Creates the filter decoding a compression coder, nullptr if it isn't one or its properties are wrong
+static KFilterBase *createDecodingFilter(const Folder::FolderInfo *coder)
+{
+    KFilterBase *filter = nullptr;
+    bool ok = false;
+    switch (coder->methodID) {
+    case k_LZMA:
+    case k_LZMA2: {
+        const bool lzma2 = coder->methodID == k_LZMA2;
+        if (coder->properties.size() != (lzma2 ? 1 : 5)) {
+            qCDebug(KArchiveLog) << "wrong LZMA properties";
+            return nullptr;
+        }
+        filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::CompressionType::Xz);
+        if (filter) {
+            ok = static_cast<KXzFilter *>(filter)->init(QIODevice::ReadOnly, lzma2 ? KXzFilter::Flag::LZMA2 : KXzFilter::Flag::LZMA, coder->properties);
+        }
+        break;
+    }
+    case k_BZip2:
+        filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::CompressionType::BZip2);
+        if (filter) {
+            ok = filter->init(QIODevice::ReadOnly);
         }
+        break;
+    case k_ZSTD:
+        filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::CompressionType::Zstd);
+        if (filter) {
+            ok = filter->init(QIODevice::ReadOnly);
+        }
+        break;
+    default:
+        break;
+    }
+    if (!ok) {
+        delete filter;
+        return nullptr;
+    }
+    return filter;
+}
 
-        QVector<QByteArray> inflatedDatas;
-        QByteArray deflatedData;
-        for (int j = 0; j < seqInStreams.size(); ++j) {
-            Folder::FolderInfo *coder = nullptr;
-            if ((quint32)j != mainCoderIndex) {
-                coder = folder->folderInfos[coderIndexes[j]];
-            } else {
-                coder = folder->folderInfos[mainCoderIndex];
+// Decodes up to size bytes from the input of filter into out.
+// Returns how many were decoded, less only at the end of the input, or -1 on error
+static qint64 decodeChunk(KFilterBase *filter, quint64 methodID, char *out, qint64 size)
+{
+    qint64 written = 0;
+    while (written < size) {
+        const int inAvailable = filter->inBufferAvailable();
+        filter->setOutBuffer(out + written, size - written);
+        const KFilterBase::Result result = filter->uncompress();
+        if (result == KFilterBase::Result::Error) {
+            qCDebug(KArchiveLog) << " decode error";
+            return -1;
+        }
+        const qint64 produced = (size - written) - filter->outBufferAvailable();
+        written += produced;
+        if (result == KFilterBase::Result::End) {
+            // Multithreaded zstd encoders write one frame per chunk
+            if (methodID == k_ZSTD && !filter->inBufferEmpty()) {
+                continue;
             }
+            break;
+        }
+        if (produced == 0 && filter->inBufferAvailable() == inAvailable) {
+            break;
+        }
+    }
+    return written;
+}
 
-            deflatedData = datas[seqInStreams[j]];
+// Runs a coder with a single input stream, decoding it into exactly outSize bytes
+static bool decodeWithFilter(const Folder::FolderInfo *coder, const QByteArray &in, quint64 outSize, QByteArray &out)
+{
+    std::unique_ptr<KFilterBase> filter(createDecodingFilter(coder));
+    if (!filter) {
+        qCDebug(KArchiveLog) << "unsupported method" << coder->methodID;
+        return false;
+    }
 
-            KFilterBase *filter = nullptr;
+    // The size of the output is known, decode straight into it
+    out.resize(outSize);
+    filter->setInBuffer(in.constData(), in.size());
+    const qint64 written = decodeChunk(filter.get(), coder->methodID, out.data(), outSize);
+    filter->terminate();
 
-            switch (coder->methodID) {
-            case k_LZMA:
-                filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::CompressionType::Xz);
-                if (!filter) {
-                    qCDebug(KArchiveLog) << "filter not found";
-                    return QByteArray();
-                }
-                static_cast<KXzFilter *>(filter)->init(QIODevice::ReadOnly, KXzFilter::Flag::LZMA, coder->properties);
-                break;
-            case k_LZMA2:
-                filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::CompressionType::Xz);
-                if (!filter) {
-                    qCDebug(KArchiveLog) << "filter not found";
-                    return QByteArray();
-                }
-                static_cast<KXzFilter *>(filter)->init(QIODevice::ReadOnly, KXzFilter::Flag::LZMA2, coder->properties);
-                break;
-            case k_PPMD: {
-                /*if (coder->properties.size() == 5) {
-                    //Byte order = *(const Byte *)coder.Props;
-                    qint32 dicSize = ((unsigned char)coder->properties[1]        |
-                                     (((unsigned char)coder->properties[2]) <<  8) |
-                                     (((unsigned char)coder->properties[3]) << 16) |
-                                     (((unsigned char)coder->properties[4]) << 24));
-                }*/
-                break;
-            }
-            case k_AES:
-                if (coder->properties.size() >= 1) {
-                    // const Byte *data = (const Byte *)coder.Props;
-                    // Byte firstByte = *data++;
-                    // UInt32 numCyclesPower = firstByte & 0x3F;
-                }
-                break;
-            case k_BCJ:
-                filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::CompressionType::Xz);
-                if (!filter) {
-                    qCDebug(KArchiveLog) << "filter not found";
-                    return QByteArray();
-                }
-                static_cast<KXzFilter *>(filter)->init(QIODevice::ReadOnly, KXzFilter::Flag::BCJ, coder->properties);
-                break;
-            case k_BCJ2: {
-                QByteArray bcj2 = decodeBCJ2(inflatedDatas[0], inflatedDatas[1], inflatedDatas[2], deflatedData);
-                inflatedDatas.clear();
-                inflatedDatas.append(bcj2);
-                break;
-            }
-            case k_BZip2:
-                filter = KCompressionDevice::filterForCompressionType(KCompressionDevice::CompressionType::BZip2);
-                if (!filter) {
-                    qCDebug(KArchiveLog) << "filter not found";
-                    return QByteArray();
-                }
-                filter->init(QIODevice::ReadOnly);
-                break;
-            }
+    if (written != qint64(outSize)) {
+        qCDebug(KArchiveLog) << "decode failed, got" << written << "bytes out of" << outSize;
+        return false;
+    }
+    return true;
+}
 
-            if (coder->methodID == k_BCJ2) {
-                continue;
-            }
+/**
+ * Reads an input of the BCJ2 decoder sequentially: either a stream in memory, or the
+ * output of a compression coder, decoded a chunk at a time as it is consumed.
+ */
+class K7ZipStreamReader
+{
+    Q_DISABLE_COPY_MOVE(K7ZipStreamReader)
+public:
+    K7ZipStreamReader()
+        : m_methodID(0)
+        , m_remaining(0)
+        , m_chunk(nullptr)
+        , m_pos(0)
+        , m_end(0)
+        , m_failed(false)
+    {
+    }
 
-            if (!filter) {
-                return QByteArray();
-            }
+    ~K7ZipStreamReader()
+    {
+        if (m_filter) {
+            m_filter->terminate();
+        }
+    }
 
-            filter->setInBuffer(deflatedData.data(), deflatedData.size());
+    void setData(const QByteArray &data)
+    {
+        m_input = data;
+        m_chunk = m_input.constData();
+        m_end = m_input.size();
+    }
 
-            QByteArray outBuffer;
-            // reserve memory
-            outBuffer.resize(unpackSize);
+    void setFilter(KFilterBase *filter, quint64 methodID, const QByteArray &input, quint64 size)
+    {
+        m_filter.reset(filter);
+        m_methodID = methodID;
+        m_input = input;
+        m_remaining = size;
+        m_filter->setInBuffer(m_input.constData(), m_input.size());
+        m_buffer.resize(BCJ2_CHUNK_SIZE);
+    }
 
-            KFilterBase::Result result = KFilterBase::Result::Ok;
-            QByteArray inflatedDataTmp;
-            while (result != KFilterBase::Result::End && result != KFilterBase::Result::Error && !filter->inBufferEmpty()) {
-                filter->setOutBuffer(outBuffer.data(), outBuffer.size());
-                result = filter->uncompress();
-                if (result == KFilterBase::Result::Error) {
-                    qCDebug(KArchiveLog) << " decode error";
-                    filter->terminate();
-                    delete filter;
-                    return QByteArray();
-                }
-                int uncompressedBytes = outBuffer.size() - filter->outBufferAvailable();
+    bool readByte(unsigned char &b)
+    {
+        if (m_pos == m_end && !refill()) {
+            return false;
+        }
+        b = m_chunk[m_pos++];
+        return true;
+    }
 
-                // append the uncompressed data to inflate buffer
-                inflatedDataTmp.append(outBuffer.data(), uncompressedBytes);
+    bool failed() const
+    {
+        return m_failed;
+    }
 
-                if (result == KFilterBase::Result::End) {
-                    // qCDebug(KArchiveLog) << "Finished unpacking";
-                    break; // Finished.
-                }
-            }
+private:
+    bool refill()
+    {
+        if (!m_filter || m_remaining == 0) {
+            return false;
+        }
+        const qint64 produced = decodeChunk(m_filter.get(), m_methodID, m_buffer.data(), qMin(quint64(m_buffer.size()), m_remaining));
+        if (produced <= 0) {
+            qCDebug(KArchiveLog) << "BCJ2 input stream ended early";
+            m_failed = true;
+            return false;
+        }
+        m_remaining -= produced;
+        m_chunk = m_buffer.constData();
+        m_pos = 0;
+        m_end = produced;
+        return true;
+    }
 
-            if (result != KFilterBase::Result::End && !filter->inBufferEmpty()) {
-                qCDebug(KArchiveLog) << "decode failed result" << static_cast<int>(result);
-                filter->terminate();
-                delete filter;
-                return QByteArray();
-            }
+    std::unique_ptr<KFilterBase> m_filter;
+    quint64 m_methodID;
+    QByteArray m_input;
+    QByteArray m_buffer;
+    quint64 m_remaining;
+    const char *m_chunk;
+    qint64 m_pos;
+    qint64 m_end;
+    bool m_failed;
+};
 
-            filter->terminate();
-            delete filter;
+// Decodes exactly outSize bytes into out. The call and jump targets are stored apart from
+// the main stream, with a range coded flag telling which E8/E9/Jcc opcodes have one
+static bool decodeBCJ2(K7ZipStreamReader &mainStream,
+                       K7ZipStreamReader &callStream,
+                       K7ZipStreamReader &jumpStream,
+                       const QByteArray &rangeBuffer,
+                       quint64 outSize,
+                       QByteArray &out)
+{
+    if (rangeBuffer.size() < 5) {
+        return false;
+    }
 
-            inflatedDatas.append(inflatedDataTmp);
-        }
+    out.resize(outSize);
+    unsigned char *output = reinterpret_cast<unsigned char *>(out.data());
+    quint64 written = 0;
+    unsigned char prevByte = 0;
+
+    RangeDecoder rangeDecoder;
+    rangeDecoder.setStream(rangeBuffer);
+    rangeDecoder.init();
+
+    QVector<CBitDecoder<kNumMoveBits>> statusDecoder(256 + 2);
+
+    for (int i = 0; i < 256 + 2; i++) {
+        statusDecoder[i].init();
+    }
 
-        QByteArray inflated;
-        for (const QByteArray &data : qAsConst(inflatedDatas)) {
-            inflated.append(data);
+    for (;;) {
+        unsigned char b = 0;
+        bool jump = false;
+        while (mainStream.readByte(b)) {
+            if (written == outSize) {
+                return false;
+            }
+            output[written++] = b;
+
+            if (isJ(prevByte, b)) {
+                jump = true;
+                break;
+            }
+            prevByte = b;
+        }
+
+        if (!jump) {
+            break;
+        }
+
+        unsigned index = getIndex(prevByte, b);
+        if (statusDecoder[index].decode(&rangeDecoder) == 1) {
+            K7ZipStreamReader &targets = b == 0xE8 ? callStream : jumpStream;
+            quint32 src = 0;
+            for (int i = 0; i < 4; i++) {
+                unsigned char b0;
+                if (!targets.readByte(b0)) {
+                    return false;
+                }
+                src <<= 8;
+                src |= ((quint32)b0);
+            }
+
+            if (written + 4 > outSize) {
+                return false;
+            }
+            quint32 dest = src - (quint32(written) + 4);
+            output[written++] = (unsigned char)(dest);
+            output[written++] = (unsigned char)(dest >> 8);
+            output[written++] = (unsigned char)(dest >> 16);
+            output[written++] = (unsigned char)(dest >> 24);
+            prevByte = (unsigned char)(dest >> 24);
+        } else {
+            prevByte = b;
+        }
+    }
+
+    return !mainStream.failed() && written == outSize;
+}
+
+static bool decodeCoderOutput(const Folder *folder, QVector<QByteArray> &datas, quint32 coderIndex, K7ZipKeyCache *keys, int depth, QByteArray &out);
+
+// Gets the data of the in stream inIndex of the folder: a packed stream, or the output of the coder bound to it
+static bool decodeInStream(const Folder *folder, QVector<QByteArray> &datas, quint32 inIndex, K7ZipKeyCache *keys, int depth, QByteArray &in)
+{
+    const int packIndex = folder->findPackStreamArrayIndex(inIndex);
+    if (packIndex >= 0) {
+        if (packIndex >= datas.size()) {
+            qCDebug(KArchiveLog) << "missing packed stream" << packIndex;
+            return false;
+        }
+        // Take the packed stream over, so that coders like 7zAES can work in place
+        in = std::move(datas[packIndex]);
+        return true;
+    }
+
+    const int bindPair = folder->findBindPairForInStream(inIndex);
+    if (bindPair < 0) {
+        return false;
+    }
+    quint32 coderIndex = 0;
+    quint32 coderStreamIndex = 0;
+    folder->findOutStream(folder->outIndexes[bindPair], coderIndex, coderStreamIndex);
+    return decodeCoderOutput(folder, datas, coderIndex, keys, depth + 1, in);
+}
+
+// Prepares reader for the in stream inIndex of the folder. The output of a compression coder
+// is decoded as it is read, anything else is decoded beforehand
+static bool openInStreamReader(const Folder *folder, QVector<QByteArray> &datas, quint32 inIndex, K7ZipKeyCache *keys, int depth, K7ZipStreamReader &reader)
+{
+    const int bindPair = folder->findPackStreamArrayIndex(inIndex) < 0 ? folder->findBindPairForInStream(inIndex) : -1;
+    if (bindPair >= 0 && depth < folder->folderInfos.size()) {
+        quint32 coderIndex = 0;
+        quint32 coderStreamIndex = 0;
+        folder->findOutStream(folder->outIndexes[bindPair], coderIndex, coderStreamIndex);
+        const Folder::FolderInfo *coder = folder->folderInfos.value(coderIndex);
+        if (coder && coder->isSimpleCoder()) {
+            std::unique_ptr<KFilterBase> filter(createDecodingFilter(coder));
+            if (filter) {
+                QByteArray in;
+                if (!decodeInStream(folder, datas, folder->getCoderInStreamIndex(coderIndex), keys, depth + 1, in)) {
+                    return false;
+                }
+                reader.setFilter(filter.release(), coder->methodID, in, folder->unpackSizes.value(folder->getCoderOutStreamIndex(coderIndex)));
+                return true;
+            }
+        }
+    }
+
+    QByteArray data;
+    if (!decodeInStream(folder, datas, inIndex, keys, depth, data)) {
+        return false;
+    }
+    reader.setData(data);
+    return true;
+}
+
+// BCJ2 has four inputs: the main stream, the call targets, the jump targets and the range
+// coded flags. The first three usually come from LZMA coders, which are decoded a chunk at a
+// time as BCJ2 consumes them, rather than each into a buffer of its own beforehand
+static bool decodeBCJ2Coder(const Folder *folder, QVector<QByteArray> &datas, quint32 firstInStream, K7ZipKeyCache *keys, int depth, quint64 outSize, QByteArray &out)
+{
+    K7ZipStreamReader mainStream;
+    K7ZipStreamReader callStream;
+    K7ZipStreamReader jumpStream;
+    QByteArray rangeStream;
+    if (!openInStreamReader(folder, datas, firstInStream, keys, depth, mainStream)
+        || !openInStreamReader(folder, datas, firstInStream + 1, keys, depth, callStream)
+        || !openInStreamReader(folder, datas, firstInStream + 2, keys, depth, jumpStream)
+        || !decodeInStream(folder, datas, firstInStream + 3, keys, depth, rangeStream)) {
+        return false;
+    }
+    if (!decodeBCJ2(mainStream, callStream, jumpStream, rangeStream, outSize, out)) {
+        qCDebug(KArchiveLog) << "BCJ2 decoding failed";
+        return false;
+    }
+    return true;
+}
+
+// Decodes the output of a coder, decoding the coders it is bound to first
+static bool decodeCoderOutput(const Folder *folder, QVector<QByteArray> &datas, quint32 coderIndex, K7ZipKeyCache *keys, int depth, QByteArray &out)
+{
+    // The bind pairs of a corrupted archive could form a cycle
+    if (depth > folder->folderInfos.size() || coderIndex >= quint32(folder->folderInfos.size())) {
+        return false;
+    }
+    const Folder::FolderInfo *coder = folder->folderInfos.at(coderIndex);
+    if (coder->numOutStreams != 1) {
+        qCDebug(KArchiveLog) << "unsupported coder with" << coder->numOutStreams << "out streams";
+        return false;
+    }
+    const quint64 outSize = folder->unpackSizes.value(folder->getCoderOutStreamIndex(coderIndex));
+    if (outSize > quint64(std::numeric_limits<int>::max())) {
+        qCDebug(KArchiveLog) << "unsupported";
+        return false;
+    }
+
+    if (coder->numInStreams != (coder->methodID == k_BCJ2 ? 4 : 1)) {
+        qCDebug(KArchiveLog) << "unsupported coder with" << coder->numInStreams << "in streams";
+        return false;
+    }
+
+    const quint32 firstInStream = folder->getCoderInStreamIndex(coderIndex);
+    if (coder->methodID == k_BCJ2) {
+        return decodeBCJ2Coder(folder, datas, firstInStream, keys, depth, outSize, out);
+    }
+
+    QVector<QByteArray> ins(coder->numInStreams);
+    for (int i = 0; i < coder->numInStreams; ++i) {
+        if (!decodeInStream(folder, datas, firstInStream + i, keys, depth, ins[i])) {
+            return false;
+        }
+    }
+
+    if (coder->methodID == k_AES) {
+        out = std::move(ins[0]);
+        if (!decryptAes(coder, keys, out, outSize)) {
+            return false;
+        }
+    } else if (coder->methodID == k_BCJ || coder->methodID == k_ARM64 || coder->methodID == k_Delta) {
+        out = std::move(ins[0]);
+        K7ZipFilterState state;
+        int deltaDistance = 1;
+        if (coder->methodID == k_Delta && !coder->properties.isEmpty()) {
+            deltaDistance = coder->properties.at(0) + 1;
+        } else if (coder->methodID == k_ARM64 && coder->properties.size() == 4) {
+            // The start offset of the code
+            state.position = qFromLittleEndian<quint32>(coder->properties.constData());
+        }
+        convertFilter(coder->methodID, deltaDistance, state, reinterpret_cast<unsigned char *>(out.data()), out.size(), false);
+    } else if (!decodeWithFilter(coder, ins[0], outSize, out)) {
+        return false;
+    }
+
+    if (quint64(out.size()) != outSize) {
+        qCDebug(KArchiveLog) << "wrong decoded size" << out.size() << "expected" << outSize;
+        return false;
+    }
+    return true;
+}
+
+// Only uses its arguments, so that folders can be decoded in parallel
+static QByteArray decodeFolderStreams(const Folder *folder, QVector<QByteArray> datas, K7ZipKeyCache *keys)
+{
+    // Find the main coder, whose output isn't bound to another coder
+    int mainCoderIndex = -1;
+    int outStreamIndex = 0;
+    for (int j = 0; j < folder->folderInfos.size() && mainCoderIndex < 0; j++) {
+        const Folder::FolderInfo *info = folder->folderInfos[j];
+        for (int k = 0; k < info->numOutStreams; k++, outStreamIndex++) {
+            if (folder->findBindPairForOutStream(outStreamIndex) < 0) {
+                mainCoderIndex = j;
+                break;
+            }
+        }
+    }
+    if (mainCoderIndex < 0) {
+        qCDebug(KArchiveLog) << "no main coder";
+        return QByteArray();
+    }
+
+    QByteArray inflated;
+    if (!decodeCoderOutput(folder, datas, mainCoderIndex, keys, 0, inflated)) {
+        return QByteArray();
+    }
+
+    if (folder->unpackCRCDefined) {
+        quint32 crc = crc32(0, (Bytef *)(inflated.data()), inflated.size());
+        if (crc != folder->unpackCRC) {
+            qCDebug(KArchiveLog) << "wrong crc";
+            return QByteArray();
+        }
+    }
+
+    return inflated;
+}
+
+void K7ZipFolderDecoder::run()
+{
+    output = decodeFolderStreams(folder, std::move(datas), keys);
+    done.release();
+}
+
+QByteArray K7Zip::K7ZipPrivate::decodeFolder(int i)
+{
+    QVector<QByteArray> datas;
+    if (!readFolderPackedStreams(i, datas)) {
+        return QByteArray();
+    }
+    return decodeFolderStreams(folders.at(i), std::move(datas), &keyCache);
+}
+
+QByteArray K7Zip::K7ZipPrivate::folderData(int folderIndex)
+{
+    auto it = decodedFolders.constFind(folderIndex);
+    if (it != decodedFolders.constEnd()) {
+        ++folderCacheHits;
+        folderCacheOrder.removeOne(folderIndex);
+        folderCacheOrder.append(folderIndex);
+        return *it;
+    }
+
+    ++folderCacheMisses;
+    if (folderIndex < 0 || folderIndex >= folders.size()) {
+        return QByteArray();
+    }
+
+    // Files are mostly read in archive order (see KArchiveDirectory::copyTo), so decode the next
+    // folders at the same time, as long as they fit in the cache along with this one.
+    // The packed streams are read here, only the decoding happens in parallel.
+    QVector<K7ZipFolderDecoder *> decoders;
+    quint64 decodedSize = 0;
+    for (int i = folderIndex; i < folders.size() && decoders.size() < decodingThreadCount; ++i) {
+        if (i != folderIndex) {
+            if (decodedFolders.contains(i)) {
+                break;
+            }
+            decodedSize += folders.at(i)->getUnpackSize();
+            if (decodedSize > quint64(folderCacheSize)) {
+                break;
+            }
+        } else {
+            decodedSize += folders.at(i)->getUnpackSize();
+        }
+        QVector<QByteArray> datas;
+        if (!readFolderPackedStreams(i, datas)) {
+            if (i == folderIndex) {
+                qCWarning(KArchiveLog) << "Could not read folder" << folderIndex;
+                return QByteArray();
+            }
+            break;
+        }
+        decoders.append(new K7ZipFolderDecoder(i, folders.at(i), datas, &keyCache));
+    }
+
+    if (decoders.size() == 1) {
+        decoders.at(0)->run();
+    } else {
+        if (!decodingPool) {
+            decodingPool = new QThreadPool;
+        }
+        decodingPool->setMaxThreadCount(decodingThreadCount);
+        for (K7ZipFolderDecoder *decoder : qAsConst(decoders)) {
+            decodingPool->start(decoder);
+        }
+    }
+
+    // Insert the requested folder last, so that it is the one kept by trimFolderCache()
+    QByteArray inflated;
+    for (int i = decoders.size() - 1; i >= 0; --i) {
+        K7ZipFolderDecoder *decoder = decoders.at(i);
+        decoder->done.acquire();
+        if (!decoder->output.isEmpty()) {
+            if (decoder->folderIndex == folderIndex) {
+                inflated = decoder->output;
+            }
+            decodedFolders.insert(decoder->folderIndex, decoder->output);
+            folderCacheOrder.append(decoder->folderIndex);
+            folderCacheCost += decoder->output.size();
+        }
+        delete decoder;
+    }
+    trimFolderCache();
+
+    if (inflated.isEmpty()) {
+        qCWarning(KArchiveLog) << "Could not decode folder" << folderIndex;
+    }
+    return inflated;
+}
+
+void K7Zip::K7ZipPrivate::clearFolderCache()
+{
+    decodedFolders.clear();
+    folderCacheOrder.clear();
+    folderCacheCost = 0;
+}
+
+void K7Zip::K7ZipPrivate::trimFolderCache()
+{
+    // The most recently used folder is always kept, even if it is bigger than the budget,
+    // otherwise reading the files of a big solid folder one after the other would decode it every time
+    while (folderCacheCost > folderCacheSize && folderCacheOrder.size() > 1) {
+        const int folderIndex = folderCacheOrder.takeFirst();
+        folderCacheCost -= decodedFolders.take(folderIndex).size();
+        ++folderCacheEvictions;
+    }
+}
+
+///////////////// Catalogue cache ////////////////////
+
+// The cache file starts with the key the archive must match, followed by the decoded header:
+// the counts, the pack sizes, the folders, one fixed size record per file and the UTF-16 names.
+// Everything is little-endian and aligned to its size, so that it can be read straight from a
+// mapping of the file. A CRC32 of all that ends the file.
+static const char k7zipCacheMagic[8] = {'K', 'A', '7', 'Z', 'C', 'A', 'T', '\n'};
+static const quint32 k7zipCacheVersion = 1;
+static const int k7zipCacheFileRecordSize = 48;
+
+enum K7ZipCacheFileFlag {
+    CacheHasStream = 0x1,
+    CacheIsDir = 0x2,
+    CacheCrcDefined = 0x4,
+    CacheAttribDefined = 0x8,
+    CacheMTimeDefined = 0x10,
+};
+
+template<typename T>
+static void appendLittleEndian(QByteArray &out, T value)
+{
+    const int pos = out.size();
+    out.resize(pos + int(sizeof(T)));
+    qToLittleEndian<T>(value, out.data() + pos);
+}
+
+static void appendPadding(QByteArray &out)
+{
+    out.append(-out.size() & 7, '\0');
+}
+
+static void appendCacheVector(QByteArray &out, const QVector<quint64> &values)
+{
+    appendLittleEndian<quint64>(out, values.size());
+    for (quint64 value : values) {
+        appendLittleEndian<quint64>(out, value);
+    }
+}
+
+/**
+ * Bounds checked reads from the contents of a cache file.
+ */
+class K7ZipCacheReader
+{
+public:
+    explicit K7ZipCacheReader(const uchar *data, qint64 size)
+        : m_data(data)
+        , m_size(size)
+        , m_pos(0)
+        , m_ok(true)
+    {
+    }
+
+    bool isOk() const
+    {
+        return m_ok;
+    }
+
+    void fail()
+    {
+        m_ok = false;
+    }
+
+    // Whether @p count more items of @p itemSize bytes are available, so that counts can be checked before allocating
+    bool has(quint64 count, quint64 itemSize = 1)
+    {
+        m_ok = m_ok && count <= quint64(m_size - m_pos) / itemSize;
+        return m_ok;
+    }
+
+    template<typename T>
+    T read()
+    {
+        if (!has(sizeof(T))) {
+            return T();
+        }
+        const T value = qFromLittleEndian<T>(m_data + m_pos);
+        m_pos += sizeof(T);
+        return value;
+    }
+
+    // Returns @p size bytes and skips the padding that follows them
+    const uchar *take(quint64 size)
+    {
+        const quint64 padded = (size + 7) & ~quint64(7);
+        if (size > padded || !has(padded)) {
+            return nullptr;
+        }
+        const uchar *data = m_data + m_pos;
+        m_pos += padded;
+        return data;
+    }
+
+    bool readVector(QVector<quint64> &values)
+    {
+        const quint64 count = read<quint64>();
+        if (!has(count, sizeof(quint64))) {
+            return false;
+        }
+        values.resize(int(count));
+        for (quint64 &value : values) {
+            value = read<quint64>();
+        }
+        return true;
+    }
+
+private:
+    const uchar *const m_data;
+    const qint64 m_size;
+    qint64 m_pos;
+    bool m_ok;
+};
+
+QByteArray K7Zip::K7ZipPrivate::catalogueCacheKey(const char *startHeader) const
+{
+    QIODevice *dev = q->device();
+    qint64 modificationTime = -1;
+    if (QFileDevice *file = qobject_cast<QFileDevice *>(dev)) {
+        const QDateTime time = file->fileTime(QFileDevice::FileModificationTime);
+        if (time.isValid()) {
+            modificationTime = time.toMSecsSinceEpoch();
+        }
+    }
+
+    // The start header holds the CRC of the whole header, which stands for a digest of its contents
+    QByteArray key(k7zipCacheMagic, sizeof(k7zipCacheMagic));
+    appendLittleEndian<quint32>(key, k7zipCacheVersion);
+    appendLittleEndian<quint32>(key, 0);
+    appendLittleEndian<qint64>(key, dev->size());
+    appendLittleEndian<qint64>(key, modificationTime);
+    key.append(startHeader, 32);
+    return key;
+}
+
+bool K7Zip::K7ZipPrivate::loadCatalogueCache(const QByteArray &key)
+{
+    const KArchiveCacheFile file(q, key);
+    if (!file.isValid()) {
+        return false;
+    }
+
+    clear();
+    K7ZipCacheReader reader(file.payload(), file.payloadSize());
+    packPos = reader.read<quint64>();
+    const quint64 numPackSizes = reader.read<quint64>();
+    const quint64 numFolders = reader.read<quint64>();
+    const quint64 numFiles = reader.read<quint64>();
+    const quint64 namesSize = reader.read<quint64>();
+
+    if (!reader.has(numPackSizes, sizeof(quint64))) {
+        clear();
+        return false;
+    }
+    packSizes.resize(int(numPackSizes));
+    for (quint64 &packSize : packSizes) {
+        packSize = reader.read<quint64>();
+    }
+    numPackStreams = numPackSizes;
+
+    // Each folder takes at least 6 words
+    if (!reader.has(numFolders, 6 * sizeof(quint64))) {
+        clear();
+        return false;
+    }
+    folders.reserve(int(numFolders));
+    for (quint64 i = 0; i < numFolders && reader.isOk(); ++i) {
+        Folder *folder = new Folder;
+        folders.append(folder);
+        const quint64 numCoders = reader.read<quint64>();
+        if (!reader.has(numCoders, 4 * sizeof(quint64))) {
+            break;
+        }
+        for (quint64 j = 0; j < numCoders; ++j) {
+            Folder::FolderInfo *info = new Folder::FolderInfo;
+            folder->folderInfos.append(info);
+            info->methodID = reader.read<quint64>();
+            const quint64 numInStreams = reader.read<quint64>();
+            const quint64 numOutStreams = reader.read<quint64>();
+            const quint64 propertiesSize = reader.read<quint64>();
+            const uchar *properties = reader.take(propertiesSize);
+            if (!properties || numInStreams > 64 || numOutStreams > 64) {
+                reader.fail();
+                break;
+            }
+            info->numInStreams = int(numInStreams);
+            info->numOutStreams = int(numOutStreams);
+            info->properties = QVector<unsigned char>(properties, properties + propertiesSize);
+        }
+        reader.readVector(folder->inIndexes);
+        reader.readVector(folder->outIndexes);
+        reader.readVector(folder->packedStreams);
+        reader.readVector(folder->unpackSizes);
+        folder->unpackCRCDefined = reader.read<quint64>() != 0;
+        folder->unpackCRC = quint32(reader.read<quint64>());
+        if (folder->inIndexes.size() != folder->outIndexes.size()) {
+            reader.fail();
+        }
+    }
+
+    if (!reader.isOk() || !reader.has(numFiles, k7zipCacheFileRecordSize) || numFiles > quint64(std::numeric_limits<int>::max())) {
+        clear();
+        return false;
+    }
+    const uchar *records = reader.take(numFiles * k7zipCacheFileRecordSize);
+    const uchar *names = reader.has(namesSize, 2) ? reader.take(namesSize * 2) : nullptr;
+    if (!records || !names) {
+        clear();
+        return false;
+    }
+
+    fileInfos.resize(int(numFiles));
+    mTimes.resize(int(numFiles));
+    mTimesDefined.resize(int(numFiles));
+    for (int i = 0; i < int(numFiles); ++i) {
+        const uchar *record = records + i * k7zipCacheFileRecordSize;
+        FileInfo &fileInfo = fileInfos[i];
+        fileInfo.size = qFromLittleEndian<quint64>(record);
+        fileInfo.pos = qFromLittleEndian<qint64>(record + 8);
+        mTimes[i] = qFromLittleEndian<quint64>(record + 16);
+        fileInfo.attributes = qFromLittleEndian<quint32>(record + 24);
+        fileInfo.crc = qFromLittleEndian<quint32>(record + 28);
+        fileInfo.folderIndex = qFromLittleEndian<qint32>(record + 32);
+        const quint32 nameOffset = qFromLittleEndian<quint32>(record + 36);
+        const quint32 nameLength = qFromLittleEndian<quint32>(record + 40);
+        const quint32 flags = qFromLittleEndian<quint32>(record + 44);
+        if (fileInfo.folderIndex < -1 || fileInfo.folderIndex >= int(numFolders) || nameLength > namesSize || nameOffset > namesSize - nameLength) {
+            clear();
+            return false;
+        }
+        fileInfo.hasStream = flags & CacheHasStream;
+        fileInfo.isDir = flags & CacheIsDir;
+        fileInfo.crcDefined = flags & CacheCrcDefined;
+        fileInfo.attribDefined = flags & CacheAttribDefined;
+        mTimesDefined[i] = flags & CacheMTimeDefined;
+        fileInfo.path.resize(int(nameLength));
+        qFromLittleEndian<quint16>(names + 2 * quint64(nameOffset), nameLength, fileInfo.path.data());
+    }
+    return true;
+}
+
+void K7Zip::K7ZipPrivate::saveCatalogueCache(const QByteArray &key) const
+{
+    qint64 namesSize = 0;
+    for (const FileInfo &fileInfo : fileInfos) {
+        namesSize += fileInfo.path.size();
+    }
+    if (namesSize > std::numeric_limits<quint32>::max()) {
+        return;
+    }
+
+    QByteArray out = key;
+    out.reserve(key.size() + 48 + 8 * packSizes.size() + 64 * folders.size() + k7zipCacheFileRecordSize * fileInfos.size() + 2 * namesSize + 12);
+    appendLittleEndian<quint64>(out, packPos);
+    appendLittleEndian<quint64>(out, packSizes.size());
+    appendLittleEndian<quint64>(out, folders.size());
+    appendLittleEndian<quint64>(out, fileInfos.size());
+    appendLittleEndian<quint64>(out, namesSize);
+    for (quint64 packSize : packSizes) {
+        appendLittleEndian<quint64>(out, packSize);
+    }
+
+    for (const Folder *folder : folders) {
+        appendLittleEndian<quint64>(out, folder->folderInfos.size());
+        for (const Folder::FolderInfo *info : folder->folderInfos) {
+            appendLittleEndian<quint64>(out, info->methodID);
+            appendLittleEndian<quint64>(out, info->numInStreams);
+            appendLittleEndian<quint64>(out, info->numOutStreams);
+            appendLittleEndian<quint64>(out, info->properties.size());
+            out.append(reinterpret_cast<const char *>(info->properties.constData()), info->properties.size());
+            appendPadding(out);
+        }
+        appendCacheVector(out, folder->inIndexes);
+        appendCacheVector(out, folder->outIndexes);
+        appendCacheVector(out, folder->packedStreams);
+        appendCacheVector(out, folder->unpackSizes);
+        appendLittleEndian<quint64>(out, folder->unpackCRCDefined);
+        appendLittleEndian<quint64>(out, folder->unpackCRC);
+    }
+
+    quint32 nameOffset = 0;
+    for (int i = 0; i < fileInfos.size(); ++i) {
+        const FileInfo &fileInfo = fileInfos.at(i);
+        const bool mTimeDefined = mTimesDefined.value(i);
+        quint32 flags = 0;
+        flags |= fileInfo.hasStream ? CacheHasStream : 0;
+        flags |= fileInfo.isDir ? CacheIsDir : 0;
+        flags |= fileInfo.crcDefined ? CacheCrcDefined : 0;
+        flags |= fileInfo.attribDefined ? CacheAttribDefined : 0;
+        flags |= mTimeDefined ? CacheMTimeDefined : 0;
+        appendLittleEndian<quint64>(out, fileInfo.size);
+        appendLittleEndian<qint64>(out, fileInfo.pos);
+        appendLittleEndian<quint64>(out, mTimeDefined ? mTimes.at(i) : 0);
+        appendLittleEndian<quint32>(out, fileInfo.attributes);
+        appendLittleEndian<quint32>(out, fileInfo.crc);
+        appendLittleEndian<qint32>(out, fileInfo.folderIndex);
+        appendLittleEndian<quint32>(out, nameOffset);
+        appendLittleEndian<quint32>(out, fileInfo.path.size());
+        appendLittleEndian<quint32>(out, flags);
+        nameOffset += fileInfo.path.size();
+    }
+
+    for (const FileInfo &fileInfo : fileInfos) {
+        const int pos = out.size();
+        out.resize(pos + 2 * fileInfo.path.size());
+        qToLittleEndian<quint16>(fileInfo.path.constData(), fileInfo.path.size(), out.data() + pos);
+    }
+    appendPadding(out);
+    KArchivePrivate::writeCatalogueCache(q, std::move(out));
+}
+
+///////////////// Shared headers ////////////////////
+
+QByteArray K7Zip::K7ZipPrivate::sharedHeaderKey(const QByteArray &cacheKey) const
+{
+    return KArchivePrivate::sharedCatalogueKey(q, cacheKey);
+}
+
+bool K7Zip::K7ZipPrivate::adoptSharedHeader(const QByteArray &key)
+{
+    // Only headers are shared under the keys of headers
+    auto header = std::static_pointer_cast<const K7ZipSharedHeader>(KArchivePrivate::findSharedCatalogue(key));
+    if (!header) {
+        return false;
+    }
+
+    // All implicitly shared, so this only takes references
+    clear();
+    folders = header->folders;
+    fileInfos = header->fileInfos;
+    mTimesDefined = header->mTimesDefined;
+    mTimes = header->mTimes;
+    packPos = header->packPos;
+    packSizes = header->packSizes;
+    numPackStreams = packSizes.size();
+    folderFirstPackStreams = header->folderFirstPackStreams;
+    folderPackOffsets = header->folderPackOffsets;
+    folderUnpackOffsets = header->folderUnpackOffsets;
+    sharedHeader = std::move(header);
+    return true;
+}
+
+void K7Zip::K7ZipPrivate::shareHeader(const QByteArray &key)
+{
+    // The folders now belong to the shared header
+    auto header = std::make_shared<K7ZipSharedHeader>();
+    header->folders = folders;
+    header->fileInfos = fileInfos;
+    header->mTimesDefined = mTimesDefined;
+    header->mTimes = mTimes;
+    header->packPos = packPos;
+    header->packSizes = packSizes;
+    header->folderFirstPackStreams = folderFirstPackStreams;
+    header->folderPackOffsets = folderPackOffsets;
+    header->folderUnpackOffsets = folderUnpackOffsets;
+    sharedHeader = header;
+    KArchivePrivate::shareCatalogue(key, header);
+}
+
+///////////////// Write ////////////////////
+
+void K7Zip::K7ZipPrivate::resetWriting()
+{
+    if (m_compressionPool) {
+        m_compressionPool->waitForDone();
+        delete m_compressionPool;
+        m_compressionPool = nullptr;
+    }
+    qDeleteAll(m_pendingBlocks);
+    m_pendingBlocks.clear();
+    delete m_encoder;
+    m_encoder = nullptr;
+    m_blockData.clear();
+    m_blockStreams = 0;
+    m_blockUnpackSize = 0;
+    m_blockCRC = 0;
+    m_blockFilterID = 0;
+    m_blockDeltaDistance = 1;
+    m_encoderFilterBuffer.clear();
+    qDeleteAll(m_writtenFolders);
+    m_writtenFolders.clear();
+    m_writtenPackSizes.clear();
+    m_writtenStreamCounts.clear();
+    m_entryList.clear();
+    m_currentFile = nullptr;
+}
+
+qint64 K7Zip::K7ZipPrivate::streamingThreshold() const
+{
+    if (m_solidBlockSize == K7Zip::SolidArchive) {
+        // A single block, nothing to parallelize
+        return 0;
+    }
+    if (m_solidBlockSize == K7Zip::NonSolid) {
+        return MIN_STREAMING_THRESHOLD;
+    }
+    return qBound(qint64(MIN_STREAMING_THRESHOLD), 2 * m_solidBlockSize, qint64(MAX_STREAMING_THRESHOLD));
+}
+
+bool K7Zip::K7ZipPrivate::chooseFileFilter(const char *data, qint64 size)
+{
+    if (m_filter != K7Zip::Filter::Automatic || m_currentFileHasData || size <= 0) {
+        return true;
+    }
+    m_currentFileHasData = true;
+
+    int deltaDistance = 1;
+    const quint64 filterID = detectFilter(data, size, deltaDistance);
+    if (filterID == 0 || (filterID == m_blockFilterID && deltaDistance == m_blockDeltaDistance)) {
+        // Files of unknown types go along with whatever block is being filled
+        return true;
+    }
+    if (!finishBlock()) {
+        return false;
+    }
+    m_blockFilterID = filterID;
+    m_blockDeltaDistance = deltaDistance;
+    return true;
+}
+
+bool K7Zip::K7ZipPrivate::writeEntryData(const char *data, qint64 size)
+{
+    if (size <= 0) {
+        return true;
+    }
+
+    if (m_blockUnpackSize == 0 && m_filter != K7Zip::Filter::Automatic) {
+        m_blockFilterID = filterMethodID(m_filter);
+        m_blockDeltaDistance = m_deltaDistance;
+    }
+
+    m_blockCRC = crc32(m_blockCRC, reinterpret_cast<const Bytef *>(data), size);
+    m_blockUnpackSize += size;
+
+    if (!m_encoder) {
+        if (m_blockData.size() + size <= streamingThreshold()) {
+            m_blockData.append(data, size);
+            return true;
+        }
+
+        // The block is too big to be buffered, compress it straight into the archive
+        // once the blocks in front of it are written
+        if (!flushPendingBlocks()) {
+            return false;
+        }
+        m_encoderStart = q->device()->pos();
+        m_encoder = new KCompressionDevice(q->device(), false, blockCompressionType(m_compressionMethod));
+        if (!m_encoder->open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        // The size of the block isn't known in advance, so use the dictionary size of the encoder preset
+        m_encoderMethodID = blockCoderProperties(m_compressionMethod, m_compressionLevel, LZMA2_PRESET_DICT_SIZE, m_encoderProperties);
+        if (!initBlockEncoder(m_encoder->filterBase(), m_compressionMethod, m_compressionLevel, m_encoderProperties)) {
+            return false;
+        }
+        m_encoderFilterState = K7ZipFilterState();
+        m_encoderFilterBuffer.clear();
+        if (!m_blockData.isEmpty()) {
+            if (!writeToEncoder(m_blockData.constData(), m_blockData.size())) {
+                return false;
+            }
+            m_blockData = QByteArray();
+        }
+    }
+
+    return writeToEncoder(data, size);
+}
+
+bool K7Zip::K7ZipPrivate::writeToEncoder(const char *data, qint64 size)
+{
+    if (m_blockFilterID == 0) {
+        if (m_encoder->write(data, size) != size) {
+            qCDebug(KArchiveLog) << "write error" << m_encoder->error();
+            return false;
+        }
+        return true;
+    }
+
+    m_encoderFilterBuffer.append(data, size);
+    unsigned char *buffer = reinterpret_cast<unsigned char *>(m_encoderFilterBuffer.data());
+    const qint64 done = convertFilter(m_blockFilterID, m_blockDeltaDistance, m_encoderFilterState, buffer, m_encoderFilterBuffer.size(), true);
+    if (m_encoder->write(m_encoderFilterBuffer.constData(), done) != done) {
+        qCDebug(KArchiveLog) << "write error" << m_encoder->error();
+        return false;
+    }
+    m_encoderFilterBuffer.remove(0, done);
+    return true;
+}
+
+bool K7Zip::K7ZipPrivate::finishBlock()
+{
+    if (m_blockUnpackSize == 0) {
+        return true;
+    }
+
+    bool ok = true;
+    if (m_encoder) {
+        // The end of the block is left unconverted
+        if (!m_encoderFilterBuffer.isEmpty()) {
+            ok = m_encoder->write(m_encoderFilterBuffer) == m_encoderFilterBuffer.size();
+            m_encoderFilterBuffer.clear();
+        }
+        m_encoder->close();
+        ok = ok && m_encoder->error() == QFileDevice::NoError;
+        delete m_encoder;
+        m_encoder = nullptr;
+        addWrittenFolder(q->device()->pos() - m_encoderStart,
+                         m_blockUnpackSize,
+                         m_blockCRC,
+                         m_encoderMethodID,
+                         m_encoderProperties,
+                         m_blockFilterID,
+                         m_blockDeltaDistance,
+                         m_blockStreams);
+    } else {
+        if (!m_compressionPool) {
+            m_compressionPool = new QThreadPool;
+            m_compressionPool->setMaxThreadCount(m_compressionThreadCount);
+        }
+        K7ZipBlockCompressor *compressor = new K7ZipBlockCompressor(m_blockData,
+                                                                     m_blockStreams,
+                                                                     m_blockCRC,
+                                                                     m_compressionMethod,
+                                                                     m_compressionLevel,
+                                                                     m_blockFilterID,
+                                                                     m_blockDeltaDistance);
+        m_blockData = QByteArray();
+        m_pendingBlocks.append(compressor);
+        m_compressionPool->start(compressor);
+
+        // Bound the memory used by the blocks waiting to be written
+        if (m_pendingBlocks.size() > m_compressionThreadCount) {
+            ok = writeOldestPendingBlock();
+        }
+    }
+
+    m_blockStreams = 0;
+    m_blockUnpackSize = 0;
+    m_blockCRC = 0;
+    m_blockFilterID = 0;
+    m_blockDeltaDistance = 1;
+    return ok;
+}
+
+bool K7Zip::K7ZipPrivate::finishBlockIfFull()
+{
+    if (m_blockUnpackSize == 0 || m_solidBlockSize == K7Zip::SolidArchive) {
+        return true;
+    }
+    if (m_solidBlockSize != K7Zip::NonSolid && m_blockUnpackSize < quint64(m_solidBlockSize)) {
+        return true;
+    }
+    return finishBlock();
+}
+
+bool K7Zip::K7ZipPrivate::writeOldestPendingBlock()
+{
+    K7ZipBlockCompressor *compressor = m_pendingBlocks.takeFirst();
+    compressor->done.acquire();
+    bool ok = compressor->ok;
+    if (ok) {
+        ok = q->device()->write(compressor->output) == compressor->output.size();
+    }
+    if (ok) {
+        addWrittenFolder(compressor->output.size(),
+                         compressor->unpackSize,
+                         compressor->crc,
+                         compressor->methodID,
+                         compressor->properties,
+                         compressor->filterID,
+                         compressor->deltaDistance,
+                         compressor->numStreams);
+    }
+    delete compressor;
+    return ok;
+}
+
+bool K7Zip::K7ZipPrivate::flushPendingBlocks()
+{
+    while (!m_pendingBlocks.isEmpty()) {
+        if (!writeOldestPendingBlock()) {
+            return false;
         }
+    }
+    return true;
+}
 
-        inflatedDatas.clear();
-
-        if (folder->unpackCRCDefined) {
-            if ((size_t)inflated.size() < unpackSize) {
-                qCDebug(KArchiveLog) << "wrong crc size data";
-                return QByteArray();
-            }
-            quint32 crc = crc32(0, (Bytef *)(inflated.data()), unpackSize);
-            if (crc != folder->unpackCRC) {
-                qCDebug(KArchiveLog) << "wrong crc";
-                return QByteArray();
-            }
-        }
+void K7Zip::K7ZipPrivate::addWrittenFolder(quint64 packSize,
+                                           quint64 unpackSize,
+                                           quint32 crc,
+                                           quint64 methodID,
+                                           const QVector<unsigned char> &properties,
+                                           quint64 filterID,
+                                           int deltaDistance,
+                                           int numStreams)
+{
+    Folder *folder = new Folder();
+    folder->unpackCRCDefined = true;
+    folder->unpackCRC = crc;
+
+    if (filterID != 0) {
+        // The filter is the main coder, its input is the output of the compression coder
+        Folder::FolderInfo *filter = new Folder::FolderInfo();
+        filter->numInStreams = 1;
+        filter->numOutStreams = 1;
+        filter->methodID = filterID;
+        filter->properties = filterProperties(filterID, deltaDistance);
+        folder->folderInfos.append(filter);
+        folder->unpackSizes.append(unpackSize);
+        folder->inIndexes.append(0);
+        folder->outIndexes.append(1);
+        folder->packedStreams.append(1);
+    }
+    folder->unpackSizes.append(unpackSize);
 
-        inflatedData.append(inflated);
-    }
+    Folder::FolderInfo *info = new Folder::FolderInfo();
+    info->numInStreams = 1;
+    info->numOutStreams = 1;
+    info->methodID = methodID;
+    info->properties = properties;
 
-    return inflatedData;
+    folder->folderInfos.append(info);
+    m_writtenFolders.append(folder);
+    m_writtenPackSizes.append(packSize);
+    m_writtenStreamCounts.append(numStreams);
 }
 
-///////////////// Write ////////////////////
-
-void K7Zip::K7ZipPrivate::createItemsFromEntities(const KArchiveDirectory *dir, const QString &path, QByteArray &data)
+void K7Zip::K7ZipPrivate::createItemsFromEntities(const KArchiveDirectory *dir, const QString &path, QHash<const KArchiveEntry *, QString> &filePaths)
 {
     const QStringList l = dir->entries();
     QStringList::ConstIterator it = l.begin();
     for (; it != l.end(); ++it) {
         const KArchiveEntry *entry = dir->entry((*it));
 
-        FileInfo *fileInfo = new FileInfo;
-        fileInfo->attribDefined = true;
-
-        fileInfo->path = path + entry->name();
-        mTimesDefined.append(true);
-        mTimes.append(rtlSecondsSince1970ToSpecTime(entry->date().toSecsSinceEpoch()));
-
         if (entry->isFile()) {
-            const K7ZipFileEntry *fileEntry = static_cast<const K7ZipFileEntry *>(entry);
-
-            fileInfo->attributes = FILE_ATTRIBUTE_ARCHIVE;
-            fileInfo->attributes |= FILE_ATTRIBUTE_UNIX_EXTENSION + ((entry->permissions() & 0xFFFF) << 16);
-            fileInfo->size = fileEntry->size();
-            QString symLink = fileEntry->symLinkTarget();
-            if (fileInfo->size > 0) {
-                fileInfo->hasStream = true;
-                data.append(outData.mid(fileEntry->position(), fileEntry->size()));
-                unpackSizes.append(fileInfo->size);
-            } else if (!symLink.isEmpty()) {
-                fileInfo->hasStream = true;
-                data.append(symLink.toUtf8());
-                unpackSizes.append(symLink.size());
-            }
-            fileInfos.append(fileInfo);
+            // Files are added in the order of their data, see closeArchive()
+            filePaths.insert(entry, path + entry->name());
         } else if (entry->isDirectory()) {
-            fileInfo->attributes = FILE_ATTRIBUTE_DIRECTORY;
-            fileInfo->attributes |= FILE_ATTRIBUTE_UNIX_EXTENSION + ((entry->permissions() & 0xFFFF) << 16);
-            fileInfo->isDir = true;
+            FileInfo fileInfo;
+            fileInfo.attribDefined = true;
+            fileInfo.path = path + entry->name();
+            mTimesDefined.append(true);
+            mTimes.append(rtlSecondsSince1970ToSpecTime(entry->date().toSecsSinceEpoch()));
+
+            fileInfo.attributes = FILE_ATTRIBUTE_DIRECTORY;
+            fileInfo.attributes |= FILE_ATTRIBUTE_UNIX_EXTENSION + ((entry->permissions() & 0xFFFF) << 16);
+            fileInfo.isDir = true;
             fileInfos.append(fileInfo);
-            createItemsFromEntities((KArchiveDirectory *)entry, path + (*it) + u'/', data);
+            createItemsFromEntities((KArchiveDirectory *)entry, path + (*it) + u'/', filePaths);
         }
     }
 }
@@ -2061,20 +3713,7 @@ QByteArray K7Zip::K7ZipPrivate::encodeStream(QVector<quint64> &packSizes, QVecto
     info->numOutStreams = 1;
     info->methodID = k_LZMA2;
 
-    quint32 dictSize = header.size();
-    const quint32 kMinReduceSize = (1 << 16);
-    if (dictSize < kMinReduceSize) {
-        dictSize = kMinReduceSize;
-    }
-
-    int dict;
-    for (dict = 0; dict < 40; dict++) {
-        if (dictSize <= LZMA2_DIC_SIZE_FROM_PROP(dict)) {
-            break;
-        }
-    }
-
-    info->properties.append(dict);
+    info->properties.append(lzma2DictionaryProperty(header.size()));
     folder->folderInfos.append(info);
 
     folds.append(folder);
@@ -2129,7 +3768,7 @@ void K7Zip::K7ZipPrivate::writeHeader(quint64 &headerOffset)
         QVector<bool> digestsDefined;
         QVector<quint32> digests;
         for (int i = 0; i < fileInfos.size(); i++) {
-            const FileInfo *file = fileInfos.at(i);
+            const FileInfo *file = &fileInfos.at(i);
             if (!file->hasStream) {
                 continue;
             }
@@ -2155,7 +3794,7 @@ void K7Zip::K7ZipPrivate::writeHeader(quint64 &headerOffset)
         QVector<bool> emptyStreamVector;
         int numEmptyStreams = 0;
         for (int i = 0; i < fileInfos.size(); i++) {
-            if (fileInfos.at(i)->hasStream) {
+            if (fileInfos.at(i).hasStream) {
                 emptyStreamVector.append(false);
             } else {
                 emptyStreamVector.append(true);
@@ -2171,7 +3810,7 @@ void K7Zip::K7ZipPrivate::writeHeader(quint64 &headerOffset)
             QVector<bool> emptyFileVector, antiVector;
             int numEmptyFiles = 0, numAntiItems = 0;
             for (int i = 0; i < fileInfos.size(); i++) {
-                const FileInfo *file = fileInfos.at(i);
+                const FileInfo *file = &fileInfos.at(i);
                 if (!file->hasStream) {
                     emptyFileVector.append(!file->isDir);
                     if (!file->isDir) {
@@ -2205,7 +3844,7 @@ void K7Zip::K7ZipPrivate::writeHeader(quint64 &headerOffset)
         int numDefined = 0;
         size_t namesDataSize = 0;
         for (int i = 0; i < fileInfos.size(); i++) {
-            const QString &name = fileInfos.at(i)->path;
+            const QString &name = fileInfos.at(i).path;
             if (!name.isEmpty()) {
                 numDefined++;
                 namesDataSize += (name.length() + 1) * 2;
@@ -2220,7 +3859,7 @@ void K7Zip::K7ZipPrivate::writeHeader(quint64 &headerOffset)
             writeNumber(namesDataSize);
             writeByte(0);
             for (int i = 0; i < fileInfos.size(); i++) {
-                const QString &name = fileInfos.at(i)->path;
+                const QString &name = fileInfos.at(i).path;
                 for (int t = 0; t < name.length(); t++) {
                     wchar_t c = name[t].toLatin1();
                     writeByte((unsigned char)c);
@@ -2243,7 +3882,7 @@ void K7Zip::K7ZipPrivate::writeHeader(quint64 &headerOffset)
         int numDefined = 0;
         boolVector.reserve(fileInfos.size());
         for (int i = 0; i < fileInfos.size(); i++) {
-            bool defined = fileInfos.at(i)->attribDefined;
+            bool defined = fileInfos.at(i).attribDefined;
             boolVector.append(defined);
             if (defined) {
                 numDefined++;
@@ -2253,7 +3892,7 @@ void K7Zip::K7ZipPrivate::writeHeader(quint64 &headerOffset)
         if (numDefined > 0) {
             writeAlignedBoolHeader(boolVector, numDefined, static_cast<int>(HeaderType::kAttributes), 4);
             for (int i = 0; i < fileInfos.size(); i++) {
-                const FileInfo *file = fileInfos.at(i);
+                const FileInfo *file = &fileInfos.at(i);
                 if (file->attribDefined) {
                     writeUInt32(file->attributes);
                 }
@@ -2298,9 +3937,116 @@ void K7Zip::K7ZipPrivate::writeSignature()
     q->device()->write((char *)buf, 8);
 }
 
+/**
+ * The files listed in the header of the archive, turned into entries as the directory tree is navigated.
+ */
+class K7ZipCatalogue : public KArchiveCatalogue
+{
+    Q_DISABLE_COPY_MOVE(K7ZipCatalogue)
+public:
+    explicit K7ZipCatalogue(K7Zip *zip, K7Zip::K7ZipPrivate *d)
+        : q(zip)
+        , d(d)
+        , openTime(time(nullptr))
+    {
+    }
+
+    int count() const override
+    {
+        return d->fileInfos.size();
+    }
+
+    QString path(int index) const override
+    {
+        QString path = QDir::cleanPath(d->fileInfos.at(index).path);
+        int start = 0;
+        while (start < path.size() && path.at(start) == u'/') {
+            ++start;
+        }
+        return start ? path.mid(start) : path;
+    }
+
+    bool isDirectory(int index) const override
+    {
+        return d->fileInfos.at(index).isDir;
+    }
+
+    KArchiveEntry *createEntry(int index, const QString &name) override
+    {
+        if (name.isEmpty() || name == QLatin1String(".")) {
+            return nullptr;
+        }
+        const FileInfo &fileInfo = d->fileInfos.at(index);
+
+        int access;
+        bool symlink = false;
+        if (fileInfo.attributes & FILE_ATTRIBUTE_UNIX_EXTENSION) {
+            access = fileInfo.attributes >> 16;
+            if ((access & QT_STAT_MASK) == QT_STAT_LNK) {
+                symlink = true;
+            }
+        } else {
+            if (fileInfo.isDir) {
+                access = S_IFDIR | 0755;
+            } else {
+                access = 0100644;
+            }
+        }
+
+        QDateTime mTime;
+        if (d->mTimesDefined.value(index)) {
+            mTime = KArchivePrivate::time_tToDateTime(toTimeT(d->mTimes.at(index)));
+        } else {
+            mTime = KArchivePrivate::time_tToDateTime(openTime);
+        }
+
+        const KArchiveDirectory *root = q->directory();
+        if (fileInfo.isDir) {
+            return new KArchiveDirectory(q, name, access, mTime, root->user(), root->group(), QString() /*symlink*/);
+        }
+        if (!symlink) {
+            return new K7ZipFileEntry(q, name, access, mTime, root->user(), root->group(), QString() /*symlink*/, fileInfo.pos, fileInfo.size, fileInfo.folderIndex);
+        }
+        // The target is stored as the content of the link, so its folder has to be decoded now
+        QString target;
+        if (fileInfo.folderIndex >= 0) {
+            const qint64 offset = fileInfo.pos - d->folderUnpackOffsets.value(fileInfo.folderIndex);
+            target = QFile::decodeName(d->folderData(fileInfo.folderIndex).mid(offset, fileInfo.size));
+        }
+        return new K7ZipFileEntry(q, name, access, mTime, root->user(), root->group(), target, 0, 0, -1);
+    }
+
+private:
+    K7Zip *const q;
+    K7Zip::K7ZipPrivate *const d;
+    const uint openTime;
+};
+
+void K7Zip::K7ZipPrivate::startReading()
+{
+    clearFolderCache();
+    folderCacheHits = 0;
+    folderCacheMisses = 0;
+    folderCacheEvictions = 0;
+
+    // The entries are only created when their directory is navigated
+    KArchivePrivate::setCatalogue(q, new K7ZipCatalogue(q, this));
+}
+
 bool K7Zip::openArchive(QIODevice::OpenMode mode)
 {
     if (!(mode & QIODevice::ReadOnly)) {
+        if (!(mode & QIODevice::WriteOnly)) {
+            return true;
+        }
+        // Entries are compressed straight after the signature header,
+        // which is written at close once the position of the header is known
+        d->resetWriting();
+        QIODevice *dev = device();
+        if (!dev || dev->write(QByteArray(32, '\0')) != 32) {
+            setErrorString(tr("Could not write the archive header"));
+            return false;
+        }
         return true;
     }
 
@@ -2310,6 +4056,7 @@ bool K7Zip::openArchive(QIODevice::OpenMode mode)
         setErrorString(tr("Could not get underlying device"));
         return false;
     }
+    d->clear();
 
     char header[32];
     // check signature
@@ -2362,6 +4109,29 @@ bool K7Zip::openArchive(QIODevice::OpenMode mode)
         return false;
     }
 
+    const bool cacheUsed = !KArchivePrivate::catalogueCacheFile(this).isEmpty();
+    QByteArray cacheKey;
+    QByteArray sharedKey;
+    if (cacheUsed || KArchivePrivate::isCatalogueShared(this)) {
+        cacheKey = d->catalogueCacheKey(header);
+    }
+    if (KArchivePrivate::isCatalogueShared(this)) {
+        sharedKey = d->sharedHeaderKey(cacheKey);
+        if (!sharedKey.isEmpty() && d->adoptSharedHeader(sharedKey)) {
+            d->startReading();
+            return true;
+        }
+    }
+    if (cacheUsed && d->loadCatalogueCache(cacheKey)) {
+        KArchivePrivate::setCatalogueCacheHit(this);
+        d->computeFolderPackStreams();
+        if (!sharedKey.isEmpty()) {
+            d->shareHeader(sharedKey);
+        }
+        d->startReading();
+        return true;
+    }
+
     dev->seek(nextHeaderOffset + 32);
 
     QByteArray inBuffer;
@@ -2387,6 +4157,7 @@ bool K7Zip::openArchive(QIODevice::OpenMode mode)
 
     int type = d->readByte();
     QByteArray decodedData;
+    bool encryptedHeader = false;
     if (static_cast<HeaderType>(type) != HeaderType::kHeader) {
         if (static_cast<HeaderType>(type) != HeaderType::kEncodedHeader) {
             setErrorString(tr("Error in header"));
@@ -2394,6 +4165,13 @@ bool K7Zip::openArchive(QIODevice::OpenMode mode)
         }
 
         decodedData = d->readAndDecodePackedStreams();
+        encryptedHeader = std::any_of(d->folders.cbegin(), d->folders.cend(), [](const Folder *folder) {
+            return folder->isEncrypted();
+        });
+        if (decodedData.isEmpty() && encryptedHeader) {
+            setErrorString(d->keyCache.hasPassword() ? tr("Wrong password") : tr("The archive is encrypted, a password is needed"));
+            return false;
+        }
 
         int external = d->readByte();
         if (external != 0) {
@@ -2453,10 +4231,16 @@ bool K7Zip::openArchive(QIODevice::OpenMode mode)
     }
 
     // read files info
-    int numFiles = d->readNumber();
-    for (int i = 0; i < numFiles; ++i) {
-        d->fileInfos.append(new FileInfo);
+    // Each file either has a stream or a bit in the kEmptyStream vector, which bounds the
+    // count before all the arrays are sized from it
+    const quint64 declaredFiles = d->readNumber();
+    if (declaredFiles > quint64(d->unpackSizes.size()) + 8 * (d->end - d->pos) || declaredFiles > quint64(std::numeric_limits<int>::max())) {
+        setErrorString(tr("Invalid number of files"));
+        return false;
     }
+    const int numFiles = int(declaredFiles);
+    d->fileInfos.resize(numFiles);
+    FileInfo *fileInfos = d->fileInfos.data();
 
     QVector<bool> emptyStreamVector;
     QVector<bool> emptyFileVector;
@@ -2482,12 +4266,7 @@ bool K7Zip::openArchive(QIODevice::OpenMode mode)
             switch (static_cast<HeaderType>(type)) {
             case HeaderType::kEmptyStream: {
                 d->readBoolVector(numFiles, emptyStreamVector);
-                for (int i = 0; i < emptyStreamVector.size(); ++i) {
-                    if (emptyStreamVector[i]) {
-                        numEmptyStreams++;
-                    }
-                }
-
+                numEmptyStreams = std::count(emptyStreamVector.cbegin(), emptyStreamVector.cend(), true);
                 break;
             }
             case HeaderType::kEmptyFile:
@@ -2523,10 +4302,8 @@ bool K7Zip::openArchive(QIODevice::OpenMode mode)
                     // TODO : go to the new index
                 }
 
-                QString name;
                 for (int i = 0; i < numFiles; i++) {
-                    name = d->readString();
-                    d->fileInfos.at(i)->path = name;
+                    fileInfos[i].path = d->readString();
                 }
                 break;
             }
@@ -2544,7 +4321,7 @@ bool K7Zip::openArchive(QIODevice::OpenMode mode)
                 }
 
                 for (int i = 0; i < numFiles; i++) {
-                    FileInfo *fileInfo = d->fileInfos.at(i);
+                    FileInfo *fileInfo = fileInfos + i;
                     fileInfo->attribDefined = attributesAreDefined[i];
                     if (fileInfo->attribDefined) {
                         fileInfo->attributes = d->readUInt32();
@@ -2608,17 +4385,19 @@ bool K7Zip::openArchive(QIODevice::OpenMode mode)
         emptyFileVector.fill(false, numEmptyStreams);
     }
 
-    for (int i = 0; i < numEmptyStreams; i++) {
-        if (antiFileVector[i]) {
-            numAntiItems++;
-        }
+    numAntiItems = std::count(antiFileVector.cbegin(), antiFileVector.cend(), true);
+    if (numAntiItems != 0) {
+        d->isAnti.reserve(numFiles);
     }
 
-    d->outData = d->readAndDecodePackedStreams(false);
+    // Only remember which folder holds each file, folders are decoded when their files are read
+    d->computeFolderPackStreams();
 
-    int oldPos = 0;
+    int currentFolder = -1;
+    quint64 streamsLeftInFolder = 0;
+    qint64 oldPos = 0; // position in the unpacked data of all the folders
     for (int i = 0; i < numFiles; i++) {
-        FileInfo *fileInfo = d->fileInfos.at(i);
+        FileInfo *fileInfo = fileInfos + i;
         bool isAnti;
         fileInfo->hasStream = !emptyStreamVector[i];
         if (fileInfo->hasStream) {
@@ -2639,81 +4418,33 @@ bool K7Zip::openArchive(QIODevice::OpenMode mode)
             d->isAnti.append(isAnti);
         }
 
-        int access;
-        bool symlink = false;
-        if (fileInfo->attributes & FILE_ATTRIBUTE_UNIX_EXTENSION) {
-            access = fileInfo->attributes >> 16;
-            if ((access & QT_STAT_MASK) == QT_STAT_LNK) {
-                symlink = true;
+        if (fileInfo->hasStream) {
+            while (streamsLeftInFolder == 0 && currentFolder + 1 < d->folders.size()) {
+                ++currentFolder;
+                streamsLeftInFolder = d->numUnpackStreamsInFolders.value(currentFolder, 1);
+                oldPos = d->folderUnpackOffsets.value(currentFolder);
             }
-        } else {
-            if (fileInfo->isDir) {
-                access = S_IFDIR | 0755;
-            } else {
-                access = 0100644;
+            if (streamsLeftInFolder > 0) {
+                fileInfo->folderIndex = currentFolder;
+                --streamsLeftInFolder;
             }
-        }
-
-        qint64 pos = 0;
-        if (!fileInfo->isDir) {
-            pos = oldPos;
+            fileInfo->pos = oldPos;
             oldPos += fileInfo->size;
+        } else if (!fileInfo->isDir) {
+            fileInfo->pos = oldPos;
         }
+    }
 
-        KArchiveEntry *e;
-        QString entryName;
-        int index = fileInfo->path.lastIndexOf(u'/');
-        if (index == -1) {
-            entryName = fileInfo->path;
-        } else {
-            entryName = fileInfo->path.mid(index + 1);
-        }
-        Q_ASSERT(!entryName.isEmpty());
-
-        QDateTime mTime;
-        if (d->mTimesDefined[i]) {
-            mTime = KArchivePrivate::time_tToDateTime(toTimeT(d->mTimes[i]));
-        } else {
-            mTime = KArchivePrivate::time_tToDateTime(time(nullptr));
-        }
-
-        if (fileInfo->isDir) {
-            QString path = QDir::cleanPath(fileInfo->path);
-            const KArchiveEntry *ent = rootDir()->entry(path);
-            if (ent && ent->isDirectory()) {
-                e = nullptr;
-            } else {
-                e = new KArchiveDirectory(this, entryName, access, mTime, rootDir()->user(), rootDir()->group(), QString() /*symlink*/);
-            }
-        } else {
-            if (!symlink) {
-                e = new K7ZipFileEntry(this,
-                                       entryName,
-                                       access,
-                                       mTime,
-                                       rootDir()->user(),
-                                       rootDir()->group(),
-                                       QString() /*symlink*/,
-                                       pos,
-                                       fileInfo->size,
-                                       d->outData);
-            } else {
-                QString target = QFile::decodeName(d->outData.mid(pos, fileInfo->size));
-                e = new K7ZipFileEntry(this, entryName, access, mTime, rootDir()->user(), rootDir()->group(), target, 0, 0, nullptr);
-            }
+    if (!encryptedHeader) {
+        if (cacheUsed) {
+            d->saveCatalogueCache(cacheKey);
         }
-
-        if (e) {
-            if (index == -1) {
-                rootDir()->addEntry(e);
-            } else {
-                QString path = QDir::cleanPath(fileInfo->path.left(index));
-                KArchiveDirectory *d = findOrCreate(path);
-                d->addEntry(e);
-            }
+        if (!sharedKey.isEmpty()) {
+            d->shareHeader(sharedKey);
         }
     }
 
+    d->startReading();
     return true;
 }
 
@@ -2726,84 +4457,55 @@ bool K7Zip::closeArchive()
     }
 
     if ((mode() == QIODevice::ReadOnly)) {
+        // Also lets go of the shared header
+        d->clear();
         return true;
     }
 
-    d->clear();
-
-    Folder *folder = new Folder();
-
-    folder->unpackSizes.clear();
-    folder->unpackSizes.append(d->outData.size());
-
-    Folder::FolderInfo *info = new Folder::FolderInfo();
-
-    info->numInStreams = 1;
-    info->numOutStreams = 1;
-    info->methodID = k_LZMA2;
-
-    quint32 dictSize = d->outData.size();
-
-    const quint32 kMinReduceSize = (1 << 16);
-    if (dictSize < kMinReduceSize) {
-        dictSize = kMinReduceSize;
-    }
-
-    // k_LZMA2 method
-    int dict;
-    for (dict = 0; dict < 40; dict++) {
-        if (dictSize <= LZMA2_DIC_SIZE_FROM_PROP(dict)) {
-            break;
-        }
+    // The packed streams were written while the entries were added, finish them
+    if (!d->finishBlock() || !d->flushPendingBlocks()) {
+        setErrorString(tr("Write error"));
+        return false;
     }
-    info->properties.append(dict);
 
-    folder->folderInfos.append(info);
-    d->folders.append(folder);
+    d->clear();
 
     const KArchiveDirectory *dir = directory();
-    QByteArray data;
-    d->createItemsFromEntities(dir, QString(), data);
-    d->outData = data;
-
-    folder->unpackCRCDefined = true;
-    folder->unpackCRC = crc32(0, (Bytef *)(d->outData.data()), d->outData.size());
-
-    // compress data
-    QByteArray encodedData;
-    if (!d->outData.isEmpty()) {
-        QByteArray enc;
-        QBuffer inBuffer(&enc);
-
-        KCompressionDevice flt(&inBuffer, false, KCompressionDevice::CompressionType::Xz);
-        flt.open(QIODevice::WriteOnly);
-
-        KFilterBase *filter = flt.filterBase();
-
-        static_cast<KXzFilter *>(filter)->init(QIODevice::WriteOnly, KXzFilter::Flag::LZMA2, info->properties);
-
-        const int ret = flt.write(d->outData);
-        if (ret != d->outData.size()) {
-            setErrorString(tr("Write error"));
-            return false;
+    QHash<const KArchiveEntry *, QString> filePaths;
+    d->createItemsFromEntities(dir, QString(), filePaths);
+
+    // Files must be listed in the same order as their data in the packed streams
+    for (const K7ZipFileEntry *fileEntry : qAsConst(d->m_entryList)) {
+        FileInfo fileInfo;
+        fileInfo.attribDefined = true;
+        fileInfo.path = filePaths.value(fileEntry);
+        d->mTimesDefined.append(true);
+        d->mTimes.append(rtlSecondsSince1970ToSpecTime(fileEntry->date().toSecsSinceEpoch()));
+
+        fileInfo.attributes = FILE_ATTRIBUTE_ARCHIVE;
+        fileInfo.attributes |= FILE_ATTRIBUTE_UNIX_EXTENSION + ((fileEntry->permissions() & 0xFFFF) << 16);
+        fileInfo.size = fileEntry->size();
+        const QString symLink = fileEntry->symLinkTarget();
+        if (!symLink.isEmpty()) {
+            fileInfo.size = QFile::encodeName(symLink).size();
         }
-
-        flt.close();
-        encodedData = inBuffer.data();
-    }
-
-    d->packSizes.append(encodedData.size());
-
-    int numUnpackStream = 0;
-    for (int i = 0; i < d->fileInfos.size(); ++i) {
-        if (d->fileInfos.at(i)->hasStream) {
-            numUnpackStream++;
+        if (fileInfo.size > 0) {
+            fileInfo.hasStream = true;
+            fileInfo.crcDefined = true;
+            fileInfo.crc = fileEntry->crc();
+            d->unpackSizes.append(fileInfo.size);
         }
+        d->fileInfos.append(fileInfo);
     }
-    d->numUnpackStreamsInFolders.append(numUnpackStream);
+
+    d->folders = d->m_writtenFolders;
+    d->m_writtenFolders.clear();
+    d->packSizes = d->m_writtenPackSizes;
+    d->numUnpackStreamsInFolders = d->m_writtenStreamCounts;
 
     quint64 headerOffset;
     d->writeHeader(headerOffset);
+    const quint64 packedSize = headerOffset;
 
     // Encode Header
     QByteArray encodedStream;
@@ -2837,12 +4539,13 @@ bool K7Zip::closeArchive()
     quint32 nextHeaderCRC = crc32(0, (Bytef *)(d->header.data()), d->header.size());
     quint64 nextHeaderOffset = headerOffset;
 
+    // The packed stream is already in place, append the headers and patch the start header
+    device()->seek(32 + packedSize);
+    device()->write(encodedStream.data(), encodedStream.size());
+    device()->write(d->header.data(), d->header.size());
     device()->seek(0);
     d->writeSignature();
     d->writeStartHeader(nextHeaderSize, nextHeaderCRC, nextHeaderOffset);
-    device()->write(encodedData.data(), encodedData.size());
-    device()->write(encodedStream.data(), encodedStream.size());
-    device()->write(d->header.data(), d->header.size());
 
     return true;
 }
@@ -2851,6 +4554,9 @@ bool K7Zip::doFinishWriting(qint64 size)
 {
     d->m_currentFile->setSize(size);
     d->m_currentFile = nullptr;
+    if (size > 0) {
+        d->m_blockStreams++;
+    }
 
     return true;
 }
@@ -2862,12 +4568,11 @@ bool K7Zip::writeData(const char *data, qint64 size)
         return false;
     }
 
-    if (d->m_currentFile->position() == d->outData.size()) {
-        d->outData.append(data, size);
-    } else {
-        d->outData.remove(d->m_currentFile->position(), d->m_currentFile->size());
-        d->outData.insert(d->m_currentFile->position(), data, size);
+    if (!d->chooseFileFilter(data, size) || !d->writeEntryData(data, size)) {
+        setErrorString(tr("Write error"));
+        return false;
     }
+    d->m_currentFile->setCrc(crc32(d->m_currentFile->crc(), reinterpret_cast<const Bytef *>(data), size));
 
     return true;
 }
@@ -2908,12 +4613,18 @@ bool K7Zip::doPrepareWriting(const QString &name,
     // test if the entry already exist
     const KArchiveEntry *entry = parentDir->entry(fileName);
     if (!entry) {
+        // Files never span blocks, so this is where a full block ends
+        if (!d->finishBlockIfFull()) {
+            setErrorString(tr("Write error"));
+            return false;
+        }
         K7ZipFileEntry *e =
-            new K7ZipFileEntry(this, fileName, perm, mtime, user, group, QString() /*symlink*/, d->outData.size(), 0 /*unknown yet*/, d->outData);
+            new K7ZipFileEntry(this, fileName, perm, mtime, user, group, QString() /*symlink*/, d->m_blockUnpackSize, 0 /*unknown yet*/, -1);
         if (!parentDir->addEntryV2(e))
             return false;
         d->m_entryList << e;
         d->m_currentFile = e;
+        d->m_currentFileHasData = false;
     } else {
         // TODO : find and replace in m_entryList
         // d->m_currentFile = static_cast<K7ZipFileEntry*>(entry);
@@ -2996,17 +4707,126 @@ bool K7Zip::doWriteSymLink(const QString &name,
     }
     QByteArray encodedTarget = QFile::encodeName(target);
 
-    K7ZipFileEntry *e = new K7ZipFileEntry(this, fileName, perm, mtime, user, group, target, 0, 0, nullptr);
-    d->outData.append(encodedTarget);
+    K7ZipFileEntry *e = new K7ZipFileEntry(this, fileName, perm, mtime, user, group, target, 0, 0, -1);
 
     if (!parentDir->addEntryV2(e))
         return false;
 
+    // The target is stored as the content of the link
+    if (!d->finishBlockIfFull() || !d->writeEntryData(encodedTarget.constData(), encodedTarget.size())) {
+        setErrorString(tr("Write error"));
+        return false;
+    }
+    e->setCrc(crc32(0, reinterpret_cast<const Bytef *>(encodedTarget.constData()), encodedTarget.size()));
     d->m_entryList << e;
+    if (!encodedTarget.isEmpty()) {
+        d->m_blockStreams++;
+    }
 
     return true;
 }
 
+void K7Zip::setFolderCacheSize(qint64 size)
+{
+    d->folderCacheSize = qMax(qint64(0), size);
+    d->trimFolderCache();
+}
+
+qint64 K7Zip::folderCacheSize() const
+{
+    return d->folderCacheSize;
+}
+
+quint64 K7Zip::folderCacheHits() const
+{
+    return d->folderCacheHits;
+}
+
+quint64 K7Zip::folderCacheMisses() const
+{
+    return d->folderCacheMisses;
+}
+
+quint64 K7Zip::folderCacheEvictions() const
+{
+    return d->folderCacheEvictions;
+}
+
+void K7Zip::setDecodingThreadCount(int count)
+{
+    d->decodingThreadCount = qMax(1, count);
+}
+
+int K7Zip::decodingThreadCount() const
+{
+    return d->decodingThreadCount;
+}
+
+void K7Zip::setPassword(const QString &password)
+{
+    d->keyCache.setPassword(password);
+}
+
+void K7Zip::setSolidBlockSize(qint64 size)
+{
+    d->m_solidBlockSize = size < 0 ? qint64(NonSolid) : size;
+}
+
+qint64 K7Zip::solidBlockSize() const
+{
+    return d->m_solidBlockSize;
+}
+
+void K7Zip::setCompressionThreadCount(int count)
+{
+    d->m_compressionThreadCount = qMax(1, count);
+}
+
+int K7Zip::compressionThreadCount() const
+{
+    return d->m_compressionThreadCount;
+}
+
+void K7Zip::setCompressionMethod(CompressionMethod method)
+{
+    d->m_compressionMethod = method;
+}
+
+K7Zip::CompressionMethod K7Zip::compressionMethod() const
+{
+    return d->m_compressionMethod;
+}
+
+void K7Zip::setCompressionLevel(int level)
+{
+    d->m_compressionLevel = level < 0 ? -1 : level;
+}
+
+int K7Zip::compressionLevel() const
+{
+    return d->m_compressionLevel;
+}
+
+void K7Zip::setFilter(Filter filter)
+{
+    d->m_filter = filter;
+}
+
+K7Zip::Filter K7Zip::filter() const
+{
+    return d->m_filter;
+}
+
+void K7Zip::setDeltaDistance(int distance)
+{
+    d->m_deltaDistance = qBound(1, distance, 256);
+}
+
+int K7Zip::deltaDistance() const
+{
+    return d->m_deltaDistance;
+}
+
 void K7Zip::virtual_hook(int id, void *data)
 {
     KArchive::virtual_hook(id, data);
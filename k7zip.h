@@ -45,6 +45,217 @@ public:
      */
     virtual ~K7Zip();
 
+    /**
+     * Special values for setSolidBlockSize().
+     * @since 5.86
+     */
+    enum SolidBlockSize : qint64 {
+        SolidArchive = 0, ///< All the files are compressed together, in a single block
+        NonSolid = -1, ///< Each file is compressed on its own
+    };
+
+    /**
+     * Call this before writing files to split the archive into several solid blocks.
+     *
+     * Files are compressed together in blocks (folders, in 7-Zip terms) of about @p size
+     * bytes of uncompressed data. A file is never split across blocks. Smaller blocks
+     * compress less well, but reading a file only needs to decode its own block, and
+     * blocks can be compressed in parallel, see setCompressionThreadCount().
+     *
+     * @param size the uncompressed size of a block in bytes, or one of the SolidBlockSize values.
+     * The default is SolidArchive.
+     * @since 5.86
+     */
+    void setSolidBlockSize(qint64 size);
+
+    /**
+     * Returns the uncompressed size of the solid blocks when writing.
+     * @see setSolidBlockSize
+     * @since 5.86
+     */
+    qint64 solidBlockSize() const;
+
+    /**
+     * Call this before writing files to set how many blocks may be compressed at the same time.
+     *
+     * Blocks are compressed in a thread pool and written to the archive in order.
+     * Up to about twice the solid block size is buffered in memory per thread; bigger
+     * blocks are compressed on the calling thread instead.
+     * This has no effect with SolidArchive, which only has one block.
+     *
+     * @param count the number of threads, QThread::idealThreadCount() by default
+     * @since 5.86
+     */
+    void setCompressionThreadCount(int count);
+
+    /**
+     * Returns how many blocks may be compressed at the same time when writing.
+     * @see setCompressionThreadCount
+     * @since 5.86
+     */
+    int compressionThreadCount() const;
+
+    /**
+     * The coders the solid blocks can be compressed with.
+     * @since 5.86
+     */
+    enum class CompressionMethod {
+        Lzma2, ///< LZMA2, readable by any 7-Zip version. This is the default
+        Zstd, ///< Zstandard, much faster but needs 7-Zip ZS or another reader supporting it
+    };
+
+    /**
+     * Call this before writing files to choose the coder used for the solid blocks.
+     * The archive header itself is always compressed with LZMA2.
+     * @since 5.86
+     */
+    void setCompressionMethod(CompressionMethod method);
+
+    /**
+     * Returns the coder used for the solid blocks when writing.
+     * @see setCompressionMethod
+     * @since 5.86
+     */
+    CompressionMethod compressionMethod() const;
+
+    /**
+     * Call this before writing files to set the compression level of the Zstd coder,
+     * from 1 to ZSTD_maxCLevel(). LZMA2 always uses its default preset.
+     *
+     * @param level the level, or -1 (the default) for the default level of the coder
+     * @since 5.86
+     */
+    void setCompressionLevel(int level);
+
+    /**
+     * Returns the compression level used when writing, -1 for the default level.
+     * @see setCompressionLevel
+     * @since 5.86
+     */
+    int compressionLevel() const;
+
+    /**
+     * The pre-filters that can be applied to the data of the solid blocks before compressing it.
+     * @since 5.86
+     */
+    enum class Filter {
+        NoFilter, ///< The data is compressed as it is. This is the default
+        X86, ///< The BCJ filter, for x86 and x86-64 executables
+        Arm64, ///< The ARM64 filter, for AArch64 executables. Needs 7-Zip 23 or newer to extract
+        Delta, ///< The delta filter, for samples of a fixed size (e.g. uncompressed audio), see setDeltaDistance()
+        Automatic, ///< Chosen for each file from its first bytes: ELF, PE and Mach-O executables, and PCM WAV files
+    };
+
+    /**
+     * Call this before writing files to choose the pre-filter of the solid blocks.
+     *
+     * Executables compress noticeably better once their relative branch targets are
+     * turned into absolute addresses, which repeat more often. Filters are stored in the
+     * archive and undone by any reader that knows them.
+     *
+     * With Filter::Automatic, files that need a different filter than the block being
+     * filled start a new block, so solid blocks may get smaller than setSolidBlockSize() asks for.
+     * @since 5.86
+     */
+    void setFilter(Filter filter);
+
+    /**
+     * Returns the pre-filter of the solid blocks when writing.
+     * @see setFilter
+     * @since 5.86
+     */
+    Filter filter() const;
+
+    /**
+     * Sets the distance, in bytes, between the samples the Delta filter computes differences of,
+     * e.g. 4 for 16-bit stereo audio.
+     *
+     * @param distance from 1 (the default) to 256
+     * @since 5.86
+     */
+    void setDeltaDistance(int distance);
+
+    /**
+     * Returns the distance used by the Delta filter.
+     * @see setDeltaDistance
+     * @since 5.86
+     */
+    int deltaDistance() const;
+
+    /**
+     * Sets how much memory is used to keep decoded folders around.
+     *
+     * The files of a 7-Zip archive are compressed in folders (solid blocks), which are
+     * decoded as a whole the first time one of their files is read. Decoded folders are
+     * kept in a cache shared by all the files of the archive, until their total size
+     * exceeds @p size; the least recently used folders are dropped first. The folder
+     * read last is always kept, whatever its size.
+     *
+     * @param size the budget in bytes, 256 MiB by default
+     * @since 5.86
+     */
+    void setFolderCacheSize(qint64 size);
+
+    /**
+     * Returns the memory budget for decoded folders.
+     * @see setFolderCacheSize
+     * @since 5.86
+     */
+    qint64 folderCacheSize() const;
+
+    /**
+     * Returns how many file reads found their folder already decoded, since the archive was opened.
+     * @see setFolderCacheSize
+     * @since 5.86
+     */
+    quint64 folderCacheHits() const;
+
+    /**
+     * Returns how many file reads had to decode their folder, since the archive was opened.
+     * @see setFolderCacheSize
+     * @since 5.86
+     */
+    quint64 folderCacheMisses() const;
+
+    /**
+     * Returns how many decoded folders were dropped to stay within the budget, since the archive was opened.
+     * @see setFolderCacheSize
+     * @since 5.86
+     */
+    quint64 folderCacheEvictions() const;
+
+    /**
+     * Sets how many folders may be decoded at the same time when reading.
+     *
+     * When a file is read from a folder that isn't decoded yet, the folders that follow it
+     * in the archive are decoded along with it in a thread pool, as long as they fit in the
+     * folder cache (see setFolderCacheSize()). This speeds up extracting a whole archive,
+     * e.g. with KArchiveDirectory::copyTo(), and other reads in archive order,
+     * when the archive has several folders.
+     *
+     * @param count the number of threads, QThread::idealThreadCount() by default; 1 to only decode the folders being read
+     * @since 5.86
+     */
+    void setDecodingThreadCount(int count);
+
+    /**
+     * Returns how many folders may be decoded at the same time when reading.
+     * @see setDecodingThreadCount
+     * @since 5.86
+     */
+    int decodingThreadCount() const;
+
+    /**
+     * Sets the password used to read encrypted archives (7zAES), call this before open().
+     *
+     * The file data and, if it was encrypted as well, the list of files can then be read.
+     * Writing encrypted archives is not supported.
+     *
+     * @param password the password, or a null string for none
+     * @since 5.86
+     */
+    void setPassword(const QString &password);
+
 protected:
     /// Reimplemented from KArchive
     bool doWriteSymLink(const QString &name,
@@ -91,6 +302,8 @@ protected:
     void virtual_hook(int id, void *data) override;
 
 private:
+    friend class K7ZipFileEntry;
+    friend class K7ZipCatalogue;
     class K7ZipPrivate;
     K7ZipPrivate *const d;
 };
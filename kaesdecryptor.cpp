@@ -0,0 +1,334 @@
+/* This file is part of the KDE libraries
+   SPDX-FileCopyrightText: 2021 KArchive authors
+
+   SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#include "kaesdecryptor_p.h"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define KAES_HAVE_AESNI 1
+#define KAES_AESNI_TARGET __attribute__((target("aes,sse2")))
+#include <wmmintrin.h>
+#elif (defined(_M_X64) || defined(_M_IX86)) && defined(_MSC_VER)
+#define KAES_HAVE_AESNI 1
+#define KAES_AESNI_TARGET
+#include <intrin.h>
+#include <wmmintrin.h>
+#endif
+
+// The ARM instructions can't be selected at runtime portably, use them when the compiler targets them
+#if (defined(__aarch64__) || defined(_M_ARM64)) && (defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO))
+#define KAES_HAVE_ARMV8_CRYPTO 1
+#include <arm_neon.h>
+#endif
+
+static const int AES_ROUNDS = 14;
+
+static inline unsigned char rotateLeft8(unsigned char x, int shift)
+{
+    return (x << shift) | (x >> (8 - shift));
+}
+
+static inline quint32 rotateRight32(quint32 x, int shift)
+{
+    return (x >> shift) | (x << (32 - shift));
+}
+
+static inline unsigned char gfMultiply(unsigned char a, unsigned char b)
+{
+    unsigned char result = 0;
+    while (b) {
+        if (b & 1) {
+            result ^= a;
+        }
+        a = (a << 1) ^ (a & 0x80 ? 0x1B : 0);
+        b >>= 1;
+    }
+    return result;
+}
+
+namespace
+{
+// Computed once rather than spelled out, they are only needed by the portable implementation
+// and the key schedule
+struct AesTables {
+    unsigned char sbox[256];
+    unsigned char inverseSbox[256];
+    quint32 decryption[4][256];
+
+    AesTables()
+    {
+        // Walk the multiplicative group with the generator 3, applying the affine
+        // transformation to the inverse of each element
+        unsigned char p = 1;
+        unsigned char q = 1;
+        do {
+            p = p ^ (p << 1) ^ (p & 0x80 ? 0x1B : 0);
+            q ^= q << 1;
+            q ^= q << 2;
+            q ^= q << 4;
+            q ^= q & 0x80 ? 0x09 : 0;
+            const unsigned char x = q ^ rotateLeft8(q, 1) ^ rotateLeft8(q, 2) ^ rotateLeft8(q, 3) ^ rotateLeft8(q, 4);
+            sbox[p] = x ^ 0x63;
+        } while (p != 1);
+        sbox[0] = 0x63;
+
+        for (int i = 0; i < 256; ++i) {
+            inverseSbox[sbox[i]] = i;
+        }
+
+        // InvSubBytes followed by InvMixColumns, for each byte position of a column
+        for (int i = 0; i < 256; ++i) {
+            const unsigned char s = inverseSbox[i];
+            const quint32 word = quint32(gfMultiply(s, 0x0E)) << 24 | quint32(gfMultiply(s, 0x09)) << 16 | quint32(gfMultiply(s, 0x0D)) << 8
+                | quint32(gfMultiply(s, 0x0B));
+            for (int j = 0; j < 4; ++j) {
+                decryption[j][i] = rotateRight32(word, 8 * j);
+            }
+        }
+    }
+};
+}
+
+static const AesTables &aesTables()
+{
+    static const AesTables tables;
+    return tables;
+}
+
+static inline quint32 readBigEndian32(const unsigned char *p)
+{
+    return quint32(p[0]) << 24 | quint32(p[1]) << 16 | quint32(p[2]) << 8 | quint32(p[3]);
+}
+
+static inline void writeBigEndian32(quint32 value, unsigned char *p)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static inline quint32 subWord(const AesTables &tables, quint32 word)
+{
+    return quint32(tables.sbox[word >> 24]) << 24 | quint32(tables.sbox[(word >> 16) & 0xFF]) << 16 | quint32(tables.sbox[(word >> 8) & 0xFF]) << 8
+        | quint32(tables.sbox[word & 0xFF]);
+}
+
+static inline quint32 inverseMixColumn(const AesTables &tables, quint32 word)
+{
+    // The decryption tables start with InvSubBytes, undo it with the S-box
+    return tables.decryption[0][tables.sbox[word >> 24]] ^ tables.decryption[1][tables.sbox[(word >> 16) & 0xFF]]
+        ^ tables.decryption[2][tables.sbox[(word >> 8) & 0xFF]] ^ tables.decryption[3][tables.sbox[word & 0xFF]];
+}
+
+#ifndef KAES_HAVE_ARMV8_CRYPTO
+static void decryptPortable(const quint32 *keys, unsigned char *iv, unsigned char *data, size_t blocks)
+{
+    const AesTables &tables = aesTables();
+    const quint32(*td)[256] = tables.decryption;
+    const unsigned char *inv = tables.inverseSbox;
+
+    unsigned char previous[16];
+    memcpy(previous, iv, 16);
+    for (size_t block = 0; block < blocks; ++block, data += 16) {
+        unsigned char cipherText[16];
+        memcpy(cipherText, data, 16);
+
+        quint32 s0 = readBigEndian32(data) ^ keys[0];
+        quint32 s1 = readBigEndian32(data + 4) ^ keys[1];
+        quint32 s2 = readBigEndian32(data + 8) ^ keys[2];
+        quint32 s3 = readBigEndian32(data + 12) ^ keys[3];
+        const quint32 *roundKey = keys + 4;
+        for (int round = 1; round < AES_ROUNDS; ++round, roundKey += 4) {
+            const quint32 t0 = td[0][s0 >> 24] ^ td[1][(s3 >> 16) & 0xFF] ^ td[2][(s2 >> 8) & 0xFF] ^ td[3][s1 & 0xFF] ^ roundKey[0];
+            const quint32 t1 = td[0][s1 >> 24] ^ td[1][(s0 >> 16) & 0xFF] ^ td[2][(s3 >> 8) & 0xFF] ^ td[3][s2 & 0xFF] ^ roundKey[1];
+            const quint32 t2 = td[0][s2 >> 24] ^ td[1][(s1 >> 16) & 0xFF] ^ td[2][(s0 >> 8) & 0xFF] ^ td[3][s3 & 0xFF] ^ roundKey[2];
+            const quint32 t3 = td[0][s3 >> 24] ^ td[1][(s2 >> 16) & 0xFF] ^ td[2][(s1 >> 8) & 0xFF] ^ td[3][s0 & 0xFF] ^ roundKey[3];
+            s0 = t0;
+            s1 = t1;
+            s2 = t2;
+            s3 = t3;
+        }
+
+        // The last round has no InvMixColumns
+        const quint32 out0 = (quint32(inv[s0 >> 24]) << 24 | quint32(inv[(s3 >> 16) & 0xFF]) << 16 | quint32(inv[(s2 >> 8) & 0xFF]) << 8 | inv[s1 & 0xFF])
+            ^ roundKey[0];
+        const quint32 out1 = (quint32(inv[s1 >> 24]) << 24 | quint32(inv[(s0 >> 16) & 0xFF]) << 16 | quint32(inv[(s3 >> 8) & 0xFF]) << 8 | inv[s2 & 0xFF])
+            ^ roundKey[1];
+        const quint32 out2 = (quint32(inv[s2 >> 24]) << 24 | quint32(inv[(s1 >> 16) & 0xFF]) << 16 | quint32(inv[(s0 >> 8) & 0xFF]) << 8 | inv[s3 & 0xFF])
+            ^ roundKey[2];
+        const quint32 out3 = (quint32(inv[s3 >> 24]) << 24 | quint32(inv[(s2 >> 16) & 0xFF]) << 16 | quint32(inv[(s1 >> 8) & 0xFF]) << 8 | inv[s0 & 0xFF])
+            ^ roundKey[3];
+        writeBigEndian32(out0, data);
+        writeBigEndian32(out1, data + 4);
+        writeBigEndian32(out2, data + 8);
+        writeBigEndian32(out3, data + 12);
+
+        for (int i = 0; i < 16; ++i) {
+            data[i] ^= previous[i];
+        }
+        memcpy(previous, cipherText, 16);
+    }
+    memcpy(iv, previous, 16);
+}
+#endif
+
+#ifdef KAES_HAVE_AESNI
+static bool cpuHasAesNi()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 25)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes");
+#endif
+}
+
+KAES_AESNI_TARGET static void decryptAesNi(const unsigned char *roundKeys, unsigned char *iv, unsigned char *data, size_t blocks)
+{
+    __m128i keys[AES_ROUNDS + 1];
+    keys[0] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(roundKeys + AES_ROUNDS * 16));
+    for (int round = 1; round < AES_ROUNDS; ++round) {
+        keys[round] = _mm_aesimc_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(roundKeys + (AES_ROUNDS - round) * 16)));
+    }
+    keys[AES_ROUNDS] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(roundKeys));
+
+    __m128i previous = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iv));
+    __m128i *blockData = reinterpret_cast<__m128i *>(data);
+    size_t block = 0;
+    // Unlike encryption, CBC decryption of consecutive blocks is independent: keep four in flight
+    for (; block + 4 <= blocks; block += 4) {
+        const __m128i c0 = _mm_loadu_si128(blockData + block);
+        const __m128i c1 = _mm_loadu_si128(blockData + block + 1);
+        const __m128i c2 = _mm_loadu_si128(blockData + block + 2);
+        const __m128i c3 = _mm_loadu_si128(blockData + block + 3);
+        __m128i b0 = _mm_xor_si128(c0, keys[0]);
+        __m128i b1 = _mm_xor_si128(c1, keys[0]);
+        __m128i b2 = _mm_xor_si128(c2, keys[0]);
+        __m128i b3 = _mm_xor_si128(c3, keys[0]);
+        for (int round = 1; round < AES_ROUNDS; ++round) {
+            b0 = _mm_aesdec_si128(b0, keys[round]);
+            b1 = _mm_aesdec_si128(b1, keys[round]);
+            b2 = _mm_aesdec_si128(b2, keys[round]);
+            b3 = _mm_aesdec_si128(b3, keys[round]);
+        }
+        b0 = _mm_aesdeclast_si128(b0, keys[AES_ROUNDS]);
+        b1 = _mm_aesdeclast_si128(b1, keys[AES_ROUNDS]);
+        b2 = _mm_aesdeclast_si128(b2, keys[AES_ROUNDS]);
+        b3 = _mm_aesdeclast_si128(b3, keys[AES_ROUNDS]);
+        _mm_storeu_si128(blockData + block, _mm_xor_si128(b0, previous));
+        _mm_storeu_si128(blockData + block + 1, _mm_xor_si128(b1, c0));
+        _mm_storeu_si128(blockData + block + 2, _mm_xor_si128(b2, c1));
+        _mm_storeu_si128(blockData + block + 3, _mm_xor_si128(b3, c2));
+        previous = c3;
+    }
+    for (; block < blocks; ++block) {
+        const __m128i c = _mm_loadu_si128(blockData + block);
+        __m128i b = _mm_xor_si128(c, keys[0]);
+        for (int round = 1; round < AES_ROUNDS; ++round) {
+            b = _mm_aesdec_si128(b, keys[round]);
+        }
+        b = _mm_aesdeclast_si128(b, keys[AES_ROUNDS]);
+        _mm_storeu_si128(blockData + block, _mm_xor_si128(b, previous));
+        previous = c;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(iv), previous);
+}
+#endif
+
+#ifdef KAES_HAVE_ARMV8_CRYPTO
+static void decryptArmv8(const unsigned char *roundKeys, unsigned char *iv, unsigned char *data, size_t blocks)
+{
+    // AESD adds the round key before InvShiftRows and InvSubBytes, AESIMC is InvMixColumns
+    uint8x16_t keys[AES_ROUNDS + 1];
+    keys[0] = vld1q_u8(roundKeys + AES_ROUNDS * 16);
+    for (int round = 1; round < AES_ROUNDS; ++round) {
+        keys[round] = vaesimcq_u8(vld1q_u8(roundKeys + (AES_ROUNDS - round) * 16));
+    }
+    keys[AES_ROUNDS] = vld1q_u8(roundKeys);
+
+    uint8x16_t previous = vld1q_u8(iv);
+    for (size_t block = 0; block < blocks; ++block, data += 16) {
+        const uint8x16_t c = vld1q_u8(data);
+        uint8x16_t b = c;
+        for (int round = 0; round < AES_ROUNDS - 1; ++round) {
+            b = vaesimcq_u8(vaesdq_u8(b, keys[round]));
+        }
+        b = veorq_u8(vaesdq_u8(b, keys[AES_ROUNDS - 1]), keys[AES_ROUNDS]);
+        vst1q_u8(data, veorq_u8(b, previous));
+        previous = c;
+    }
+    vst1q_u8(iv, previous);
+}
+#endif
+
+KAesDecryptor::KAesDecryptor(const unsigned char *key, const unsigned char *iv)
+{
+    const AesTables &tables = aesTables();
+
+    // Key expansion for 8 words of key and 14 rounds
+    quint32 w[(AES_ROUNDS + 1) * 4];
+    for (int i = 0; i < 8; ++i) {
+        w[i] = readBigEndian32(key + 4 * i);
+    }
+    unsigned char rcon = 1;
+    for (int i = 8; i < (AES_ROUNDS + 1) * 4; ++i) {
+        quint32 t = w[i - 1];
+        if (i % 8 == 0) {
+            t = subWord(tables, rotateRight32(t, 24)) ^ (quint32(rcon) << 24);
+            rcon = (rcon << 1) ^ (rcon & 0x80 ? 0x1B : 0);
+        } else if (i % 8 == 4) {
+            t = subWord(tables, t);
+        }
+        w[i] = w[i - 8] ^ t;
+    }
+
+    for (int i = 0; i < (AES_ROUNDS + 1) * 4; ++i) {
+        writeBigEndian32(w[i], m_roundKeys + 4 * i);
+    }
+
+    // The round keys in reverse order, with InvMixColumns applied to all but the first and last
+    for (int round = 0; round <= AES_ROUNDS; ++round) {
+        for (int j = 0; j < 4; ++j) {
+            const quint32 word = w[4 * (AES_ROUNDS - round) + j];
+            m_decryptionKeys[4 * round + j] = (round == 0 || round == AES_ROUNDS) ? word : inverseMixColumn(tables, word);
+        }
+    }
+
+    memcpy(m_iv, iv, sizeof(m_iv));
+}
+
+void KAesDecryptor::decrypt(unsigned char *data, size_t size)
+{
+    Q_ASSERT(size % 16 == 0);
+    const size_t blocks = size / 16;
+#ifdef KAES_HAVE_AESNI
+    if (isHardwareAccelerated()) {
+        decryptAesNi(m_roundKeys, m_iv, data, blocks);
+        return;
+    }
+#endif
+#ifdef KAES_HAVE_ARMV8_CRYPTO
+    decryptArmv8(m_roundKeys, m_iv, data, blocks);
+#else
+    decryptPortable(m_decryptionKeys, m_iv, data, blocks);
+#endif
+}
+
+bool KAesDecryptor::isHardwareAccelerated()
+{
+#if defined(KAES_HAVE_AESNI)
+    static const bool hasAesNi = cpuHasAesNi();
+    return hasAesNi;
+#elif defined(KAES_HAVE_ARMV8_CRYPTO)
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,47 @@
+/* This file is part of the KDE libraries
+   SPDX-FileCopyrightText: 2021 KArchive authors
+
+   SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#pragma once
+
+#include <QtCore/qglobal.h>
+
+/**
+ * Decrypts AES-256 in CBC mode, as used by the 7zAES coder of 7-Zip archives.
+ *
+ * The AES instructions of the CPU (AES-NI on x86, the ARMv8 cryptography extension)
+ * are used when available; this is checked at runtime on x86. Otherwise a portable
+ * table based implementation is used.
+ * @internal - used by K7Zip
+ */
+class KAesDecryptor
+{
+    Q_DISABLE_COPY_MOVE(KAesDecryptor)
+public:
+    /**
+     * Creates a decryptor.
+     * @param key the 32 bytes of the key
+     * @param iv the 16 bytes of the initialization vector
+     */
+    explicit KAesDecryptor(const unsigned char *key, const unsigned char *iv);
+
+    /**
+     * Decrypts @p size bytes in place, a multiple of the 16 bytes block size.
+     * Consecutive calls continue the same CBC chain.
+     */
+    void decrypt(unsigned char *data, size_t size);
+
+    /**
+     * Returns whether the AES instructions of the CPU are used.
+     */
+    static bool isHardwareAccelerated();
+
+private:
+    // The encryption key schedule, in the byte order of the AES state
+    unsigned char m_roundKeys[15 * 16];
+    // The key schedule of the equivalent inverse cipher, for the portable implementation
+    quint32 m_decryptionKeys[15 * 4];
+    unsigned char m_iv[16];
+};
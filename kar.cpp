@@ -101,6 +101,7 @@ bool KAr::openArchive(QIODevice::OpenMode mode)
         return false;
     }
 
+    const KArchiveEntryFilter *filter = KArchivePrivate::entryFilter(this);
     QByteArray ar_longnames;
     while (!dev->atEnd()) {
         QByteArray ar_header;
@@ -165,6 +166,11 @@ bool KAr::openArchive(QIODevice::OpenMode mode)
         name.replace('/', QByteArray());
         qCDebug(KArchiveLog) << "Filename: " << name << " Size: " << size;
 
+        if (filter && !filter->matches(name)) {
+            dev->seek(dev->pos() + size); // Skip contents
+            continue;
+        }
+
         KArchiveEntry *entry = new KArchiveFile(this,
                                                 QString::fromLocal8Bit(name.constData()),
                                                 mode,
@@ -13,17 +13,28 @@
 
 #include <qplatformdefs.h> // QT_STATBUF, QT_LSTAT
 
+#include <QtCore/qdatastream.h>
 #include <QtCore/qdebug.h>
 #include <QtCore/qdir.h>
 #include <QtCore/qfile.h>
-#include <QtCore/qmap.h>
-#include <QtCore/qstack.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qtendian.h>
+#include <QtCore/qvarlengtharray.h>
 
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
+#include <algorithm>
 #include <cassert>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <typeinfo>
+#include <utility>
+#include <zlib.h>
 
 #ifdef Q_OS_UNIX
 #include <grp.h>
@@ -47,6 +58,9 @@ class KArchiveDirectoryPrivate
 public:
     explicit KArchiveDirectoryPrivate(KArchiveDirectory *parent)
         : q(parent)
+        , catalogue(nullptr)
+        , pendingPrefix(0)
+        , indexed(false)
     {
     }
 
@@ -60,9 +74,184 @@ public:
         return directory->d;
     }
 
+    QString childPath(const QString &name) const
+    {
+        return path.isEmpty() ? name : path + u'/' + name;
+    }
+
+    // Adds an entry of this directory, and everything below it, to the path index of the archive
+    void indexEntry(KArchiveEntry *e)
+    {
+        if (!indexed) {
+            return;
+        }
+        const QString entryPath = childPath(e->name());
+        KArchivePrivate::pathIndex(q->archive())->insert(entryPath, {e, q});
+        KArchiveDirectory *directory = e->isDirectory() ? static_cast<KArchiveDirectory *>(e) : nullptr;
+        if (directory && directory->archive() == q->archive()) {
+            KArchiveDirectoryPrivate *dir = get(directory);
+            dir->indexed = true;
+            dir->path = entryPath;
+            for (KArchiveEntry *child : qAsConst(dir->entries)) {
+                dir->indexEntry(child);
+            }
+        }
+    }
+
+    void unindexEntry(KArchiveEntry *e)
+    {
+        if (!indexed) {
+            return;
+        }
+        KArchivePrivate::pathIndex(q->archive())->remove(childPath(e->name()));
+        KArchiveDirectoryPrivate *dir = e->isDirectory() ? get(static_cast<KArchiveDirectory *>(e)) : nullptr;
+        if (dir && dir->indexed) {
+            for (KArchiveEntry *child : qAsConst(dir->entries)) {
+                dir->unindexEntry(child);
+            }
+            dir->indexed = false;
+            dir->path.clear();
+        }
+    }
+
+    // Makes this directory the root of the path index of its archive
+    void indexAsRoot()
+    {
+        if (!q->archive()) {
+            return;
+        }
+        indexed = true;
+        path.clear();
+        for (KArchiveEntry *child : qAsConst(entries)) {
+            indexEntry(child);
+        }
+    }
+
+    KArchiveEntry *takeEntry(const QString &name)
+    {
+        KArchiveEntry *e = entries.take(name);
+        if (e) {
+            unindexEntry(e);
+        }
+        return e;
+    }
+
+    // Returns whether name can be looked up in the path index as it is
+    static bool isCleanPath(const QString &name)
+    {
+        if (name.isEmpty() || name.startsWith(u'/') || name.endsWith(u'/')) {
+            return false;
+        }
+        // Components must not be empty, "." or ".."
+        int componentStart = 0;
+        const int size = name.size();
+        for (int i = 0; i <= size; ++i) {
+            if (i < size && name.at(i) != u'/') {
+                continue;
+            }
+            const int length = i - componentStart;
+            if (length == 0 || (name.at(componentStart) == u'.' && (length == 1 || (length == 2 && name.at(componentStart + 1) == u'.')))) {
+                return false;
+            }
+            componentStart = i + 1;
+        }
+        return true;
+    }
+
+    // Looks name up in the path index. found is false when the index can't tell, and entry() has to walk the tree
+    const KArchiveEntry *lookup(const QString &_name, KArchiveDirectory **containingDirectory, bool *found) const
+    {
+        *found = false;
+        QString name = _name;
+        if (!isCleanPath(name)) {
+            name = QDir::cleanPath(name);
+            while (name.startsWith(u'/')) {
+                name.remove(0, 1);
+            }
+            // Paths going up, or to this directory itself, are left to the walk
+            if (name.isEmpty() || name == QLatin1String(".") || name.startsWith(QLatin1String(".."))) {
+                return nullptr;
+            }
+        }
+
+        KArchive *archive = q->archive();
+        const QHash<QString, KArchivePrivate::IndexedEntry> *index = KArchivePrivate::pathIndex(archive);
+        const auto it = index->constFind(childPath(name));
+        if (it == index->constEnd()) {
+            // Unless some entries of a catalogue aren't created yet
+            *found = !KArchivePrivate::hasCatalogue(archive);
+            return nullptr;
+        }
+        *found = true;
+        *containingDirectory = it->parent;
+        return it->entry;
+    }
+
+    // Creates the entries of the catalogue directly in this directory, and hands the deeper ones
+    // over to the subdirectories, which only create them when they are navigated in turn
+    void materialize()
+    {
+        if (pending.isEmpty()) {
+            return;
+        }
+        const QVector<int> indexes = std::move(pending);
+        pending = QVector<int>();
+        KArchive *archive = q->archive();
+
+        // The entries of this directory first, so that the directories listed in the catalogue
+        // are used rather than implied ones
+        QVector<int> deeper;
+        for (int index : indexes) {
+            const QString path = catalogue->path(index);
+            if (path.indexOf(u'/', pendingPrefix) != -1) {
+                deeper.append(index);
+                continue;
+            }
+            KArchiveEntry *e = catalogue->createEntry(index, path.mid(pendingPrefix));
+            if (e) {
+                q->addEntryV2(e);
+            }
+        }
+
+        for (int index : qAsConst(deeper)) {
+            const QString path = catalogue->path(index);
+            const int slash = path.indexOf(u'/', pendingPrefix);
+            const QString name = path.mid(pendingPrefix, slash - pendingPrefix);
+            KArchiveEntry *child = entries.value(name);
+            if (child && !child->isDirectory()) {
+                if (static_cast<KArchiveFile *>(child)->size() > 0) {
+                    qCWarning(KArchiveLog) << name << "is normal file, but there are file paths in the archive assuming it is a directory, skipping" << path;
+                    continue;
+                }
+                // An empty file, assume it is actually a directory, as findOrCreate() does
+                delete takeEntry(name);
+                child = nullptr;
+            }
+            if (!child) {
+                const KArchiveDirectory *root = archive->directory();
+                child = new KArchiveDirectory(archive, name, root->permissions(), root->date(), root->user(), root->group(), QString());
+                entries.insert(name, child);
+                indexEntry(child);
+            }
+            KArchiveDirectoryPrivate *childData = static_cast<KArchiveDirectory *>(child)->d;
+            childData->catalogue = catalogue;
+            childData->pendingPrefix = slash + 1;
+            childData->pending.append(index);
+        }
+    }
+
     // Returns in containingDirectory the directory that actually contains the returned entry
-    const KArchiveEntry *entry(const QString &_name, KArchiveDirectory **containingDirectory) const
+    const KArchiveEntry *entry(const QString &_name, KArchiveDirectory **containingDirectory)
     {
+        if (indexed) {
+            bool found;
+            const KArchiveEntry *e = lookup(_name, containingDirectory, &found);
+            if (found) {
+                return e;
+            }
+        }
+
+        materialize();
         *containingDirectory = q;
 
         QString name = QDir::cleanPath(_name);
@@ -97,8 +286,126 @@ public:
         return entries.value(name);
     }
 
+    // Removes the directories below this one that hold no files, returns whether this directory is empty then
+    bool removeEmptyDirectories()
+    {
+        for (auto it = entries.begin(); it != entries.end();) {
+            KArchiveEntry *e = it.value();
+            if (e->isDirectory() && get(static_cast<KArchiveDirectory *>(e))->removeEmptyDirectories()) {
+                unindexEntry(e);
+                it = entries.erase(it);
+                delete e;
+            } else {
+                ++it;
+            }
+        }
+        return entries.isEmpty();
+    }
+
+    // Passes the entries of this directory to visitor, path holding the path of this directory followed by a slash
+    bool visitInDirectoryOrder(KArchiveDirectory::EntryVisitor visitor, void *context, bool recursive, QString &path)
+    {
+        materialize();
+        const int prefix = path.size();
+        for (auto it = entries.cbegin(), end = entries.cend(); it != end; ++it) {
+            path.truncate(prefix);
+            path += it.key();
+            if (!visitor(context, it.value(), path)) {
+                return false;
+            }
+            if (recursive && it.value()->isDirectory()) {
+                path += u'/';
+                if (!get(static_cast<KArchiveDirectory *>(it.value()))->visitInDirectoryOrder(visitor, context, true, path)) {
+                    return false;
+                }
+            }
+        }
+        path.truncate(prefix);
+        return true;
+    }
+
+    // Passes the files to visitor sorted by position, each directory right before the first entry below it
+    bool visitInArchiveOrder(KArchiveDirectory::EntryVisitor visitor, void *context, bool recursive, QString &path)
+    {
+        struct Directory {
+            KArchiveDirectory *directory;
+            int parent;
+            QString path; // Followed by a slash, but for this directory
+            bool visited;
+        };
+        struct File {
+            qint64 position;
+            const KArchiveFile *file;
+            int directory;
+        };
+        QVector<Directory> directories;
+        QVector<File> files;
+
+        // Breadth first, so that the directories come after their parent
+        directories.append({q, -1, QString(), true});
+        for (int i = 0; i < directories.size() && (recursive || i == 0); ++i) {
+            KArchiveDirectoryPrivate *dir = get(directories.at(i).directory);
+            dir->materialize();
+            for (auto it = dir->entries.cbegin(), end = dir->entries.cend(); it != end; ++it) {
+                if (it.value()->isDirectory()) {
+                    directories.append({static_cast<KArchiveDirectory *>(it.value()), i, directories.at(i).path + it.key() + u'/', false});
+                } else {
+                    const KArchiveFile *file = static_cast<const KArchiveFile *>(it.value());
+                    files.append({file->position(), file, i});
+                }
+            }
+        }
+        std::stable_sort(files.begin(), files.end(), [](const File &file1, const File &file2) {
+            return file1.position < file2.position;
+        });
+
+        auto visitDirectory = [&](Directory &directory) {
+            directory.visited = true;
+            path.truncate(0);
+            path.append(directory.path.constData(), directory.path.size() - 1);
+            return visitor(context, directory.directory, path);
+        };
+
+        for (const File &file : qAsConst(files)) {
+            if (!directories.at(file.directory).visited) {
+                QVarLengthArray<int, 16> ancestors;
+                for (int i = file.directory; !directories.at(i).visited; i = directories.at(i).parent) {
+                    ancestors.append(i);
+                }
+                while (!ancestors.isEmpty()) {
+                    const int i = ancestors.last();
+                    ancestors.removeLast();
+                    if (!visitDirectory(directories[i])) {
+                        return false;
+                    }
+                }
+            }
+            path.truncate(0);
+            path += directories.at(file.directory).path;
+            path += file.file->name();
+            if (!visitor(context, file.file, path)) {
+                return false;
+            }
+        }
+        for (Directory &directory : directories) {
+            if (!directory.visited && !visitDirectory(directory)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     KArchiveDirectory *q;
     QHash<QString, KArchiveEntry *> entries;
+    // The entries of the catalogue below this directory that aren't created yet, see materialize().
+    // Their paths start with the pendingPrefix characters of the path of this directory
+    KArchiveCatalogue *catalogue;
+    QVector<int> pending;
+    int pendingPrefix;
+    // Whether this directory is reachable from the root directory of its archive, and its path
+    // relative to it. The entries of such directories are in the path index of the archive
+    bool indexed;
+    QString path;
 };
 
 ////////////////////////////////////////////////////////////////////////
@@ -157,11 +464,19 @@ bool KArchive::open(QIODevice::OpenMode mode)
     }
 
     d->mode = mode;
+    d->catalogueCacheHit = false;
 
     Q_ASSERT(!d->rootDir);
     d->rootDir = nullptr;
 
-    return openArchive(mode);
+    if (!openArchive(mode)) {
+        return false;
+    }
+    // Drop the directories that were only listed for the files left out. Catalogues leave them out right away
+    if (KArchivePrivate::entryFilter(this) && !d->catalogue) {
+        KArchiveDirectoryPrivate::get(rootDir())->removeEmptyDirectories();
+    }
+    return true;
 }
 
 bool KArchive::createDevice(QIODevice::OpenMode mode)
@@ -236,8 +551,12 @@ bool KArchive::close()
         delete d->dev; // we created it ourselves in open()
     }
 
+    d->pathIndex.clear();
     delete d->rootDir;
     d->rootDir = nullptr;
+    delete d->catalogue;
+    d->catalogue = nullptr;
+    d->stringPool.clear();
     d->mode = QIODevice::NotOpen;
     d->dev = nullptr;
     return closeSucceeded;
@@ -248,6 +567,43 @@ QString KArchive::errorString() const
     return d->errorStr;
 }
 
+void KArchive::setEntryFilter(const QStringList &patterns)
+{
+    delete d->entryFilter;
+    d->entryFilter = patterns.isEmpty() ? nullptr : new KArchiveEntryFilter(patterns);
+}
+
+void KArchive::setEntryFilter(EntryFilter filter, void *context)
+{
+    delete d->entryFilter;
+    d->entryFilter = filter ? new KArchiveEntryFilter(filter, context) : nullptr;
+}
+
+void KArchive::setCatalogueCacheFile(const QString &fileName)
+{
+    d->catalogueCacheFile = fileName;
+}
+
+QString KArchive::catalogueCacheFile() const
+{
+    return d->catalogueCacheFile;
+}
+
+bool KArchive::isCatalogueCacheHit() const
+{
+    return d->catalogueCacheHit;
+}
+
+void KArchive::setCatalogueShared(bool shared)
+{
+    d->catalogueShared = shared;
+}
+
+bool KArchive::isCatalogueShared() const
+{
+    return d->catalogueShared;
+}
+
 const KArchiveDirectory *KArchive::directory() const
 {
     // rootDir isn't const so that parsing-on-demand is possible
@@ -514,6 +870,7 @@ KArchiveDirectory *KArchive::rootDir()
         QString groupname = ::getCurrentGroupName();
 
         d->rootDir = new KArchiveDirectory(this, QStringLiteral("/"), int(0777 + S_IFDIR), QDateTime(), username, groupname, QString());
+        KArchiveDirectoryPrivate::get(d->rootDir)->indexAsRoot();
     }
     return d->rootDir;
 }
@@ -562,8 +919,7 @@ KArchiveDirectory *KArchivePrivate::findOrCreate(const QString &path, int recurs
 
             qCDebug(KArchiveLog) << path << " is an empty file, assuming it is actually a directory and replacing";
             KArchiveEntry *myEntry = const_cast<KArchiveEntry *>(existingEntry);
-            existingEntryParentDirectory->removeEntry(myEntry);
-            delete myEntry;
+            delete KArchiveDirectoryPrivate::get(existingEntryParentDirectory)->takeEntry(myEntry->name());
         }
     }
 
@@ -607,7 +963,11 @@ void KArchive::setRootDir(KArchiveDirectory *rootDir)
 {
     Q_ASSERT(!d->rootDir); // Call setRootDir only once during parsing please ;)
     delete d->rootDir; // but if it happens, don't leak
+    d->pathIndex.clear();
     d->rootDir = rootDir;
+    if (rootDir) {
+        KArchiveDirectoryPrivate::get(rootDir)->indexAsRoot();
+    }
 }
 
 QIODevice::OpenMode KArchive::mode() const
@@ -646,7 +1006,528 @@ QDateTime KArchivePrivate::time_tToDateTime(uint time_t)
     if (time_t == uint(-1)) {
         return QDateTime();
     }
-    return QDateTime::fromSecsSinceEpoch(time_t);
+    // In UTC, which doesn't need the time zone of the system
+    return QDateTime::fromSecsSinceEpoch(time_t, Qt::UTC);
+}
+
+void KArchivePrivate::setCatalogue(KArchive *archive, KArchiveCatalogue *catalogue)
+{
+    KArchivePrivate *d = archive->d;
+    delete d->catalogue;
+    d->catalogue = catalogue;
+
+    KArchiveDirectoryPrivate *root = KArchiveDirectoryPrivate::get(archive->rootDir());
+    root->catalogue = catalogue;
+    root->pendingPrefix = 0;
+    const int count = catalogue->count();
+    const KArchiveEntryFilter *filter = entryFilter(archive);
+    if (!filter) {
+        root->pending.resize(count);
+        std::iota(root->pending.begin(), root->pending.end(), 0);
+        return;
+    }
+
+    // The files that match, and the directories holding them
+    QVector<bool> matches(count);
+    QSet<QString> directories;
+    for (int index = 0; index < count; ++index) {
+        if (catalogue->isDirectory(index)) {
+            continue;
+        }
+        const QString path = catalogue->path(index);
+        if (!filter->matches(path)) {
+            continue;
+        }
+        matches[index] = true;
+        for (int slash = path.lastIndexOf(u'/'); slash > 0; slash = path.lastIndexOf(u'/', slash - 1)) {
+            const QString directory = path.left(slash);
+            if (directories.contains(directory)) {
+                break;
+            }
+            directories.insert(directory);
+        }
+    }
+    for (int index = 0; index < count; ++index) {
+        if (matches.at(index) || (catalogue->isDirectory(index) && directories.contains(catalogue->path(index)))) {
+            root->pending.append(index);
+        }
+    }
+}
+
+/**
+ * Finds the records below a non-empty file, which findOrCreate() refuses when the entries are
+ * created right away, so that creating them lazily doesn't turn that error into missing entries.
+ * Like findOrCreate(), a file only conflicts with the records after it, and not once its path
+ * is known to be a directory. Only the entries that pass the filter of archive are checked.
+ * @return the error message if there is one, or an empty string
+ */
+static QString checkRecordParents(const KArchiveRecordCatalogue *catalogue, const KArchiveEntryFilter *filter)
+{
+    QSet<QString> files;
+    QSet<QString> directories;
+    QString lastParent;
+    const int count = catalogue->count();
+    for (int index = 0; index < count; ++index) {
+        const KArchiveRecord &record = catalogue->record(index);
+        if (record.path.isEmpty() || (filter && (record.isDirectory || !filter->matches(record.path)))) {
+            continue;
+        }
+        const int slash = record.path.lastIndexOf(u'/');
+        const QString parent = slash == -1 ? QString() : record.path.left(slash);
+        // The records of a directory usually follow each other, check its parents once for all of them
+        if (parent != lastParent) {
+            for (QString directory = parent; !directory.isEmpty() && !directories.contains(directory);) {
+                if (files.contains(directory)) {
+                    const QString name = record.path.mid(slash + 1);
+                    return KArchive::tr("File %1 is in folder %2, but %3 is actually a file.").arg(name, parent, directory);
+                }
+                directories.insert(directory);
+                directory.truncate(qMax(0, directory.lastIndexOf(u'/')));
+            }
+            lastParent = parent;
+        }
+        if (record.isDirectory) {
+            directories.insert(record.path);
+        } else if (record.size > 0 && !directories.contains(record.path)) {
+            files.insert(record.path);
+        }
+    }
+    return QString();
+}
+
+bool KArchivePrivate::setRecords(KArchive *archive, KArchiveRecordCatalogue *catalogue)
+{
+    const int count = catalogue->count();
+    for (int index = 0; index < count; ++index) {
+        if (catalogue->path(index).isEmpty() && catalogue->isDirectory(index)) {
+            if (archive->d->rootDir) {
+                qCWarning(KArchiveLog) << "Broken archive has two root dir entries";
+                continue;
+            }
+            archive->setRootDir(static_cast<KArchiveDirectory *>(catalogue->createEntry(index, QStringLiteral("."))));
+        }
+    }
+
+    if (archive->d->mode == QIODevice::ReadOnly) {
+        const QString errorMessage = checkRecordParents(catalogue, entryFilter(archive));
+        if (!errorMessage.isEmpty()) {
+            archive->setErrorString(errorMessage);
+            delete catalogue;
+            return false;
+        }
+        setCatalogue(archive, catalogue);
+        return true;
+    }
+
+    std::unique_ptr<KArchiveRecordCatalogue> owner(catalogue);
+    for (int index = 0; index < count; ++index) {
+        const QString path = catalogue->path(index);
+        if (path.isEmpty()) {
+            continue;
+        }
+        const int slash = path.lastIndexOf(u'/');
+        const QString name = path.mid(slash + 1);
+        KArchiveDirectory *parent = slash == -1 ? archive->rootDir() : archive->findOrCreate(path.left(slash));
+        if (!parent) {
+            const QString parentPath = path.left(slash);
+            archive->setErrorString(tr("File %1 is in folder %2, but %3 is actually a file.").arg(name, parentPath, parentPath));
+            return false;
+        }
+        if (catalogue->isDirectory(index)) {
+            const KArchiveEntry *existing = parent->entry(name);
+            if (existing && existing->isDirectory()) {
+                continue;
+            }
+        }
+        if (KArchiveEntry *e = catalogue->createEntry(index, name)) {
+            parent->addEntry(e);
+        }
+    }
+    return true;
+}
+
+QString KArchivePrivate::cleanPath(const QString &path)
+{
+    QString cleanPath = QDir::cleanPath(path);
+    int start = 0;
+    while (start < cleanPath.size() && cleanPath.at(start) == u'/') {
+        ++start;
+    }
+    cleanPath.remove(0, start);
+    return cleanPath == QLatin1String(".") ? QString() : cleanPath;
+}
+
+// The cache file starts with the key the archive must match, followed by the records and a CRC32 of all that
+static const char s_recordsCacheMagic[8] = {'K', 'A', 'R', 'C', 'A', 'T', '\n', '\0'};
+static const quint32 s_recordsCacheVersion = 1;
+// The first and last bytes of the archive that the key holds
+static const int s_recordsKeyEdgeSize = 512;
+// The smallest size of a record in the cache
+static const int s_recordsCacheRecordSize = 64;
+
+// Returns the file archive is read from, or an empty string
+static QString archiveFileName(const KArchive *archive)
+{
+    if (!archive->fileName().isEmpty()) {
+        return archive->fileName();
+    }
+    if (QFileDevice *fileDevice = qobject_cast<QFileDevice *>(archive->device())) {
+        return fileDevice->fileName();
+    }
+    return QString();
+}
+
+namespace
+{
+// The catalogues shared by the archives of the process, see KArchive::setCatalogueShared(). They are
+// freed along with the last archive using them, only their expired slots are left here
+struct SharedCatalogues {
+    QMutex mutex;
+    QHash<QByteArray, std::weak_ptr<const void>> catalogues;
+};
+}
+Q_GLOBAL_STATIC(SharedCatalogues, s_sharedCatalogues)
+
+std::shared_ptr<const void> KArchivePrivate::findSharedCatalogue(const QByteArray &key)
+{
+    QMutexLocker locker(&s_sharedCatalogues->mutex);
+    return s_sharedCatalogues->catalogues.value(key).lock();
+}
+
+void KArchivePrivate::shareCatalogue(const QByteArray &key, const std::shared_ptr<const void> &data)
+{
+    QMutexLocker locker(&s_sharedCatalogues->mutex);
+    QHash<QByteArray, std::weak_ptr<const void>> &catalogues = s_sharedCatalogues->catalogues;
+    for (auto it = catalogues.begin(); it != catalogues.end();) {
+        it = it->expired() ? catalogues.erase(it) : std::next(it);
+    }
+    catalogues.insert(key, data);
+}
+
+QByteArray KArchivePrivate::sharedCatalogueKey(const KArchive *archive, const QByteArray &key)
+{
+    const QString fileName = archiveFileName(archive);
+    if (fileName.isEmpty()) {
+        return QByteArray();
+    }
+    return QFile::encodeName(QFileInfo(fileName).absoluteFilePath()) + '\0' + key;
+}
+
+QByteArray KArchivePrivate::recordsKey(KArchive *archive, const char *format)
+{
+    KArchivePrivate *d = archive->d;
+    if (d->mode != QIODevice::ReadOnly || (d->catalogueCacheFile.isEmpty() && !d->catalogueShared)) {
+        return QByteArray();
+    }
+    const QString fileName = archiveFileName(archive);
+    QFile file(fileName);
+    if (fileName.isEmpty() || !file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    const QDateTime modificationTime = file.fileTime(QFileDevice::FileModificationTime);
+    const qint64 size = file.size();
+
+    // The first and last bytes hold the headers and the trailers of most formats, and the CRC
+    // of the data for compressed files, which stands for a digest of the contents
+    const QByteArray head = file.read(s_recordsKeyEdgeSize);
+    file.seek(qMax<qint64>(size - s_recordsKeyEdgeSize, 0));
+    const QByteArray tail = file.read(s_recordsKeyEdgeSize);
+
+    QByteArray key;
+    QDataStream stream(&key, QIODevice::WriteOnly);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    stream.writeRawData(s_recordsCacheMagic, sizeof(s_recordsCacheMagic));
+    stream << s_recordsCacheVersion << QByteArray(format) << size << (modificationTime.isValid() ? modificationTime.toMSecsSinceEpoch() : qint64(-1));
+    stream << head << tail;
+    return key;
+}
+
+KArchiveCacheFile::KArchiveCacheFile(const KArchive *archive, const QByteArray &key)
+    : m_file(KArchivePrivate::catalogueCacheFile(archive))
+    , m_payload(nullptr)
+    , m_payloadSize(0)
+{
+    if (!m_file.open(QIODevice::ReadOnly) || m_file.size() < key.size() + 4) {
+        return;
+    }
+    const qint64 size = m_file.size();
+    const uchar *data = m_file.map(0, size);
+    if (!data) {
+        // Not every file system can map files
+        m_contents = m_file.readAll();
+        if (m_contents.size() != size) {
+            return;
+        }
+        data = reinterpret_cast<const uchar *>(m_contents.constData());
+    }
+
+    // A cache written for another archive, or another version of it, is simply written again
+    if (memcmp(data, key.constData(), key.size()) != 0) {
+        return;
+    }
+    if (crc32(0, data, uInt(size - 4)) != qFromLittleEndian<quint32>(data + size - 4)) {
+        qCDebug(KArchiveLog) << "Damaged catalogue cache" << m_file.fileName();
+        return;
+    }
+    m_payload = data + key.size();
+    m_payloadSize = size - 4 - key.size();
+}
+
+void KArchivePrivate::writeCatalogueCache(const KArchive *archive, QByteArray contents)
+{
+    const quint32 crc = crc32(0, reinterpret_cast<const Bytef *>(contents.constData()), uInt(contents.size()));
+    contents.resize(contents.size() + 4);
+    qToLittleEndian<quint32>(crc, contents.data() + contents.size() - 4);
+
+    const QString &cacheFile = archive->d->catalogueCacheFile;
+    QSaveFile file(cacheFile);
+    if (!file.open(QIODevice::WriteOnly) || file.write(contents) != contents.size() || !file.commit()) {
+        qCDebug(KArchiveLog) << "Could not write the catalogue cache" << cacheFile << file.errorString();
+    }
+}
+
+// Reads the records cached under key in the cache file of archive
+static std::shared_ptr<const QVector<KArchiveRecord>> loadCachedRecords(KArchive *archive, const QByteArray &key)
+{
+    const KArchiveCacheFile file(archive, key);
+    if (!file.isValid() || file.payloadSize() > std::numeric_limits<int>::max()) {
+        return nullptr;
+    }
+
+    const int recordsSize = int(file.payloadSize());
+    QDataStream stream(QByteArray::fromRawData(reinterpret_cast<const char *>(file.payload()), recordsSize));
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    quint32 count = 0;
+    stream >> count;
+    if (count > quint32(recordsSize / s_recordsCacheRecordSize)) {
+        return nullptr;
+    }
+    auto records = std::make_shared<QVector<KArchiveRecord>>(int(count));
+    for (KArchiveRecord &record : *records) {
+        quint32 access = 0;
+        stream >> record.path >> record.user >> record.group >> record.symlink >> record.storedPath;
+        stream >> record.time >> access >> record.isDirectory >> record.position >> record.size;
+        stream >> record.headerStart >> record.compressedSize >> record.crc >> record.method;
+        record.access = access;
+        record.user = KArchivePrivate::intern(archive, record.user);
+        record.group = KArchivePrivate::intern(archive, record.group);
+    }
+    if (stream.status() != QDataStream::Ok) {
+        return nullptr;
+    }
+    return records;
+}
+
+std::shared_ptr<const QVector<KArchiveRecord>> KArchivePrivate::findRecords(KArchive *archive, const QByteArray &key)
+{
+    if (key.isEmpty()) {
+        return nullptr;
+    }
+    KArchivePrivate *d = archive->d;
+    const QByteArray sharedKey = d->catalogueShared ? sharedCatalogueKey(archive, key) : QByteArray();
+    if (!sharedKey.isEmpty()) {
+        // Only records are shared under the keys of records
+        if (auto records = std::static_pointer_cast<const QVector<KArchiveRecord>>(findSharedCatalogue(sharedKey))) {
+            return records;
+        }
+    }
+    if (d->catalogueCacheFile.isEmpty()) {
+        return nullptr;
+    }
+    auto records = loadCachedRecords(archive, key);
+    if (records) {
+        d->catalogueCacheHit = true;
+        if (!sharedKey.isEmpty()) {
+            shareCatalogue(sharedKey, records);
+        }
+    }
+    return records;
+}
+
+std::shared_ptr<const QVector<KArchiveRecord>> KArchivePrivate::storeRecords(KArchive *archive, const QByteArray &key, QVector<KArchiveRecord> records)
+{
+    auto stored = std::make_shared<const QVector<KArchiveRecord>>(std::move(records));
+    if (key.isEmpty()) {
+        return stored;
+    }
+    if (archive->d->catalogueShared) {
+        const QByteArray sharedKey = sharedCatalogueKey(archive, key);
+        if (!sharedKey.isEmpty()) {
+            shareCatalogue(sharedKey, stored);
+        }
+    }
+    if (archive->d->catalogueCacheFile.isEmpty()) {
+        return stored;
+    }
+
+    QByteArray out = key;
+    {
+        QDataStream stream(&out, QIODevice::WriteOnly | QIODevice::Append);
+        stream.setVersion(QDataStream::Qt_5_15);
+        stream.setByteOrder(QDataStream::LittleEndian);
+        stream << quint32(stored->size());
+        for (const KArchiveRecord &record : *stored) {
+            stream << record.path << record.user << record.group << record.symlink << record.storedPath;
+            stream << record.time << quint32(record.access) << record.isDirectory << record.position << record.size;
+            stream << record.headerStart << record.compressedSize << record.crc << qint32(record.method);
+        }
+    }
+    writeCatalogueCache(archive, std::move(out));
+    return stored;
+}
+
+KArchiveEntry *KArchiveRecordCatalogue::createEntry(int index, const QString &name)
+{
+    if (name.isEmpty()) {
+        return nullptr;
+    }
+    const KArchiveRecord &record = m_records->at(index);
+    const QDateTime time = KArchivePrivate::time_tToDateTime(record.time);
+    if (record.isDirectory) {
+        return new KArchiveDirectory(m_archive, name, record.access, time, record.user, record.group, record.symlink);
+    }
+    return new KArchiveFile(m_archive, name, record.access, time, record.user, record.group, record.symlink, record.position, record.size);
+}
+
+QString KArchivePrivate::intern(KArchive *archive, const QString &string)
+{
+    if (!archive || string.isEmpty()) {
+        return string;
+    }
+    QSet<QString> &pool = archive->d->stringPool;
+    const auto it = pool.constFind(string);
+    if (it != pool.constEnd()) {
+        return *it;
+    }
+    pool.insert(string);
+    return string;
+}
+
+KArchiveEntryFilter::KArchiveEntryFilter(const QStringList &patterns)
+    : m_function(nullptr)
+    , m_context(nullptr)
+{
+    for (const QString &pattern : patterns) {
+        QByteArray glob = pattern.toUtf8();
+        const bool below = glob.endsWith('/');
+        // Paths are matched without leading slash
+        int start = 0;
+        while (start < glob.size() && glob.at(start) == '/') {
+            ++start;
+        }
+        glob.remove(0, start);
+        if (below) {
+            glob += "**";
+        } else if (glob.isEmpty()) {
+            continue;
+        }
+        int wildcard = 0;
+        while (wildcard < glob.size() && glob.at(wildcard) != '*' && glob.at(wildcard) != '?') {
+            ++wildcard;
+        }
+        m_patterns.append({glob.left(wildcard), glob.mid(wildcard)});
+    }
+}
+
+KArchiveEntryFilter::KArchiveEntryFilter(KArchive::EntryFilter function, void *context)
+    : m_function(function)
+    , m_context(context)
+{
+}
+
+// Returns whether path has no empty, "." or ".." component, which KArchivePrivate::cleanPath() would remove
+static bool isCleanPath(const char *path, const char *end)
+{
+    for (const char *component = path; component <= end;) {
+        const char *slash = static_cast<const char *>(memchr(component, '/', end - component));
+        if (!slash) {
+            slash = end;
+        }
+        const qptrdiff size = slash - component;
+        if (size == 0 || (component[0] == '.' && (size == 1 || (size == 2 && component[1] == '.')))) {
+            return false;
+        }
+        component = slash + 1;
+    }
+    return true;
+}
+
+bool KArchiveEntryFilter::matches(const char *path, int size) const
+{
+    // The path as it ends up in the directory tree, so that the same entries are read
+    // whether the paths come from the archive as stored or already cleaned from the cache
+    const char *end = path + size;
+    for (;;) {
+        if (path != end && *path == '/') {
+            ++path;
+        } else if (end - path >= 2 && path[0] == '.' && path[1] == '/') {
+            path += 2;
+        } else {
+            break;
+        }
+    }
+    while (end != path && end[-1] == '/') {
+        --end;
+    }
+    QByteArray cleanPath;
+    if (path != end && !isCleanPath(path, end)) {
+        cleanPath = KArchivePrivate::cleanPath(QString::fromUtf8(path, int(end - path))).toUtf8();
+        path = cleanPath.constData();
+        end = path + cleanPath.size();
+    }
+
+    if (m_function) {
+        return m_function(m_context, path, int(end - path));
+    }
+    for (const Pattern &pattern : m_patterns) {
+        const int prefixSize = pattern.prefix.size();
+        if (end - path >= prefixSize && memcmp(path, pattern.prefix.constData(), prefixSize) == 0
+            && matchGlob(pattern.glob.constData(), pattern.glob.constData() + pattern.glob.size(), path + prefixSize, end)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool KArchiveEntryFilter::matchGlob(const char *glob, const char *globEnd, const char *path, const char *pathEnd)
+{
+    while (glob != globEnd) {
+        if (*glob == '*') {
+            const bool crossSlashes = glob + 1 != globEnd && glob[1] == '*';
+            while (glob != globEnd && *glob == '*') {
+                ++glob;
+            }
+            // Match the rest of the glob from each position the wildcard can reach
+            for (const char *p = path;; ++p) {
+                if (matchGlob(glob, globEnd, p, pathEnd)) {
+                    return true;
+                }
+                if (p == pathEnd || (!crossSlashes && *p == '/')) {
+                    return false;
+                }
+            }
+        }
+        if (path == pathEnd) {
+            return false;
+        }
+        if (*glob == '?') {
+            if (*path == '/') {
+                return false;
+            }
+            // A whole UTF-8 sequence
+            ++path;
+            while (path != pathEnd && (uchar(*path) & 0xc0) == 0x80) {
+                ++path;
+            }
+        } else if (*glob != *path) {
+            return false;
+        } else {
+            ++path;
+        }
+        ++glob;
+    }
+    return path == pathEnd;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -665,16 +1546,20 @@ public:
                          const QString &_group,
                          const QString &_symlink)
         : name(_name)
-        , date(_date)
+        , time(_date.isValid() ? _date.toMSecsSinceEpoch() : invalidTime)
         , access(_access)
-        , user(_user)
-        , group(_group)
+        , user(KArchivePrivate::intern(_archive, _user))
+        , group(KArchivePrivate::intern(_archive, _group))
         , symlink(_symlink)
         , archive(_archive)
     {
     }
+
+    static constexpr qint64 invalidTime = std::numeric_limits<qint64>::min();
+
     QString name;
-    QDateTime date;
+    // In milliseconds since the epoch, only converted to local time when asked for
+    qint64 time;
     mode_t access;
     QString user;
     QString group;
@@ -700,7 +1585,10 @@ KArchiveEntry::~KArchiveEntry()
 
 QDateTime KArchiveEntry::date() const
 {
-    return d->date;
+    if (d->time == KArchiveEntryPrivate::invalidTime) {
+        return QDateTime();
+    }
+    return QDateTime::fromMSecsSinceEpoch(d->time);
 }
 
 QString KArchiveEntry::name() const
@@ -815,12 +1703,78 @@ QIODevice *KArchiveFile::createDevice() const
     return new KLimitedIODevice(archive()->device(), d->pos, d->size);
 }
 
+bool KArchiveFile::readChunks(ChunkVisitor visitor, void *context, char *buffer, qint64 bufferSize) const
+{
+    KArchiveReadChunksHook hook{visitor, context, bufferSize > 0 ? buffer : nullptr, bufferSize, false, false};
+    const_cast<KArchiveFile *>(this)->virtual_hook(KArchiveReadChunksHook::Id, &hook);
+    if (hook.handled) {
+        return hook.result;
+    }
+
+    // Plain files, as created by KTar and KAr, are stored as they are
+    if (typeid(*this) == typeid(KArchiveFile)) {
+        return KArchivePrivate::readStoredChunks(archive(), d->pos, d->size, hook);
+    }
+
+    // Other subclasses only tell how to read them through createDevice()
+    std::unique_ptr<QIODevice> dev(createDevice());
+    if (!dev || (!dev->isOpen() && !dev->open(QIODevice::ReadOnly))) {
+        return false;
+    }
+    qint64 size;
+    char *chunk = KArchivePrivate::chunkBuffer(archive(), hook, &size);
+    for (;;) {
+        const qint64 n = dev->read(chunk, size);
+        if (n <= 0) {
+            return n == 0;
+        }
+        if (!hook.visit(chunk, n)) {
+            return false;
+        }
+    }
+}
+
+char *KArchivePrivate::chunkBuffer(KArchive *archive, const KArchiveReadChunksHook &hook, qint64 *size)
+{
+    if (hook.buffer) {
+        *size = hook.bufferSize;
+        return hook.buffer;
+    }
+    QByteArray &buffer = archive->d->chunkBuffer;
+    if (buffer.isEmpty()) {
+        buffer.resize(64 * 1024);
+    }
+    *size = buffer.size();
+    return buffer.data();
+}
+
+bool KArchivePrivate::readStoredChunks(KArchive *archive, qint64 pos, qint64 size, const KArchiveReadChunksHook &hook)
+{
+    if (size == 0) {
+        return true;
+    }
+    QIODevice *dev = archive->device();
+    if (!dev || !dev->seek(pos)) {
+        return false;
+    }
+    qint64 bufferSize;
+    char *chunk = chunkBuffer(archive, hook, &bufferSize);
+    while (size > 0) {
+        const qint64 n = dev->read(chunk, qMin(size, bufferSize));
+        if (n <= 0 || !hook.visit(chunk, n)) {
+            return false;
+        }
+        size -= n;
+    }
+    return true;
+}
+
 bool KArchiveFile::isFile() const
 {
     return true;
 }
 
-static QFileDevice::Permissions withExecutablePerms(QFileDevice::Permissions filePerms, mode_t perms)
+QFileDevice::Permissions KArchivePrivate::withExecutablePerms(QFileDevice::Permissions filePerms, mode_t perms)
 {
     if (perms & 01)
         filePerms |= QFileDevice::ExeOther;
@@ -838,30 +1792,16 @@ bool KArchiveFile::copyTo(const QString &dest) const
 {
     QFile f(dest + u'/' + name());
     if (f.open(QIODevice::ReadWrite | QIODevice::Truncate)) {
-        QIODevice *inputDev = createDevice();
-        if (!inputDev) {
+        // Read and write data in chunks to minimize memory usage
+        const bool ok = readChunks([&f](const char *data, qint64 size) {
+            return f.write(data, size) == size;
+        });
+        if (!ok) {
             f.remove();
             return false;
         }
-
-        // Read and write data in chunks to minimize memory usage
-        const qint64 chunkSize = 1024 * 1024;
-        qint64 remainingSize = d->size;
-        QByteArray array;
-        array.resize(int(qMin(chunkSize, remainingSize)));
-
-        while (remainingSize > 0) {
-            const qint64 currentChunkSize = qMin(chunkSize, remainingSize);
-            const qint64 n = inputDev->read(array.data(), currentChunkSize);
-            Q_UNUSED(n) // except in Q_ASSERT
-            Q_ASSERT(n == currentChunkSize);
-            f.write(array.data(), currentChunkSize);
-            remainingSize -= currentChunkSize;
-        }
-        f.setPermissions(withExecutablePerms(f.permissions(), permissions()));
+        f.setPermissions(KArchivePrivate::withExecutablePerms(f.permissions(), permissions()));
         f.close();
-
-        delete inputDev;
         return true;
     }
     return false;
@@ -890,11 +1830,14 @@ KArchiveDirectory::~KArchiveDirectory()
 
 QStringList KArchiveDirectory::entries() const
 {
+    const auto locker = KArchivePrivate::lockTree(archive());
+    d->materialize();
     return d->entries.keys();
 }
 
 const KArchiveEntry *KArchiveDirectory::entry(const QString &_name) const
 {
+    const auto locker = KArchivePrivate::lockTree(archive());
     KArchiveDirectory *dummy;
     return d->entry(_name, &dummy);
 }
@@ -915,12 +1858,14 @@ void KArchiveDirectory::addEntry(KArchiveEntry *entry)
 
 bool KArchiveDirectory::addEntryV2(KArchiveEntry *entry)
 {
+    d->materialize();
     if (d->entries.value(entry->name())) {
         qCWarning(KArchiveLog) << "directory " << name() << "has entry" << entry->name() << "already";
         delete entry;
         return false;
     }
     d->entries.insert(entry->name(), entry);
+    d->indexEntry(entry);
     return true;
 }
 
@@ -930,6 +1875,7 @@ void KArchiveDirectory::removeEntry(KArchiveEntry *entry)
         return;
     }
 
+    d->materialize();
     QHash<QString, KArchiveEntry *>::Iterator it = d->entries.find(entry->name());
     // nothing removed?
     if (it == d->entries.end()) {
@@ -941,6 +1887,7 @@ void KArchiveDirectory::removeEntry(KArchiveEntry *entry)
         return;
     }
     d->entries.erase(it);
+    d->unindexEntry(entry);
 }
 
 bool KArchiveDirectory::isDirectory() const
@@ -948,86 +1895,241 @@ bool KArchiveDirectory::isDirectory() const
     return true;
 }
 
-static bool sortByPosition(const KArchiveFile *file1, const KArchiveFile *file2)
+bool KArchiveDirectory::visitEntries(EntryVisitor visitor, void *context, VisitOptions options) const
 {
-    return file1->position() < file2->position();
+    const auto locker = KArchivePrivate::lockTree(archive());
+    // A single buffer for all the paths, big enough for most of them
+    QString path;
+    path.reserve(256);
+    if (options & ArchiveOrder) {
+        return d->visitInArchiveOrder(visitor, context, options & Recursive, path);
+    }
+    return d->visitInDirectoryOrder(visitor, context, options & Recursive, path);
 }
 
-bool KArchiveDirectory::copyTo(const QString &dest, bool recursiveCopy) const
+// Creates the symlink entry in the directory dirName
+static void copySymLinkTo(const KArchiveEntry *entry, const QString &dirName)
+{
+    QString linkName = dirName + u'/' + entry->name();
+    // To create a valid link on Windows, linkName must have a .lnk file extension.
+#ifdef Q_OS_WINDOWS
+    if (!linkName.endsWith(QStringLiteral(".lnk"))) {
+        linkName += QStringLiteral(".lnk");
+    }
+#endif
+    QFile symLinkTarget(entry->symLinkTarget());
+    if (!symLinkTarget.link(linkName)) {
+        // qCDebug(KArchiveLog) << "symlink(" << entry->symLinkTarget() << ',' << linkName << ") failed:" << strerror(errno);
+    }
+}
+
+bool KArchivePrivate::prepareCopyTo(const KArchiveDirectory *dir, const QString &dest, bool recursive, QVector<KArchiveFileCopy> *files)
 {
     QDir root;
     const QString destDir(QDir(dest).absolutePath()); // get directory path without any "." or ".."
+    if (!root.mkpath(destDir)) {
+        return false;
+    }
 
-    QVector<const KArchiveFile *> fileList;
-    QMap<qint64, QString> fileToDir;
+    // The folders the directories are extracted to, by path in the archive. Entries whose directory
+    // isn't there are below a symlink, or in a subdirectory of a non-recursive copy
+    QHash<QString, QString> dirNames;
+    dirNames.insert(QString(), destDir);
+    QString parentPath;
+    QString parentDirName = destDir;
+
+    // Visit the files in the order of their data, so we have a linear access
+    const KArchiveDirectory::VisitOptions options =
+        recursive ? (KArchiveDirectory::Recursive | KArchiveDirectory::ArchiveOrder) : KArchiveDirectory::ArchiveOrder;
+    return dir->visitEntries(
+        [&](const KArchiveEntry *curEntry, const QString &path) {
+            const QStringView curParentPath = QStringView(path).left(qMax(path.lastIndexOf(u'/'), 0));
+            if (curParentPath.compare(parentPath) != 0) {
+                parentPath = curParentPath.toString();
+                parentDirName = dirNames.value(parentPath);
+            }
+            if (parentDirName.isEmpty()) {
+                return true;
+            }
 
-    // placeholders for iterated items
-    QStack<const KArchiveDirectory *> dirStack;
-    QStack<QString> dirNameStack;
+            if (!curEntry->symLinkTarget().isEmpty()) {
+                copySymLinkTo(curEntry, parentDirName);
+                return true;
+            }
 
-    dirStack.push(this); // init stack at current directory
-    dirNameStack.push(destDir); // ... with given path
-    do {
-        const KArchiveDirectory *curDir = dirStack.pop();
+            if (curEntry->isDirectory()) {
+                if (!recursive) {
+                    return true;
+                }
+                // extract only to specified folder if it is located within archive's extraction folder
+                // otherwise put file under root position in extraction folder
+                QString curDirName = parentDirName + u'/' + curEntry->name();
+                if (!QDir(curDirName).absolutePath().startsWith(destDir)) {
+                    qCWarning(KArchiveLog) << "Attempted export into folder" << curDirName << "which is outside of the extraction root folder" << destDir << "."
+                                           << "Changing export of contained files to extraction root folder.";
+                    curDirName = destDir;
+                }
+                if (!root.mkpath(curDirName)) {
+                    return false;
+                }
+                dirNames.insert(path, curDirName);
+                return true;
+            }
 
-        // extract only to specified folder if it is located within archive's extraction folder
-        // otherwise put file under root position in extraction folder
-        QString curDirName = dirNameStack.pop();
-        if (!QDir(curDirName).absolutePath().startsWith(destDir)) {
-            qCWarning(KArchiveLog) << "Attempted export into folder" << curDirName << "which is outside of the extraction root folder" << destDir << "."
-                                   << "Changing export of contained files to extraction root folder.";
-            curDirName = destDir;
-        }
+            if (const KArchiveFile *curFile = dynamic_cast<const KArchiveFile *>(curEntry)) {
+                files->append({curFile, parentDirName});
+            }
+            return true;
+        },
+        options);
+}
 
-        if (!root.mkpath(curDirName)) {
+bool KArchiveDirectory::copyTo(const QString &dest, bool recursiveCopy) const
+{
+    QVector<KArchiveFileCopy> files;
+    if (!KArchivePrivate::prepareCopyTo(this, dest, recursiveCopy, &files)) {
+        return false;
+    }
+    for (const KArchiveFileCopy &file : qAsConst(files)) {
+        if (!file.file->copyTo(file.dirName)) {
             return false;
         }
+    }
+    return true;
+}
 
-        const QStringList dirEntries = curDir->entries();
-        for (QStringList::const_iterator it = dirEntries.begin(); it != dirEntries.end(); ++it) {
-            const KArchiveEntry *curEntry = curDir->entry(*it);
-            if (!curEntry->symLinkTarget().isEmpty()) {
-                QString linkName = curDirName + u'/' + curEntry->name();
-                // To create a valid link on Windows, linkName must have a .lnk file extension.
-#ifdef Q_OS_WINDOWS
-                if (!linkName.endsWith(QStringLiteral(".lnk"))) {
-                    linkName += QStringLiteral(".lnk");
-                }
-#endif
-                QFile symLinkTarget(curEntry->symLinkTarget());
-                if (!symLinkTarget.link(linkName)) {
-                    // qCDebug(KArchiveLog) << "symlink(" << curEntry->symLinkTarget() << ',' << linkName << ") failed:" << strerror(errno);
+bool KArchiveDirectory::copyTo(const QStringList &paths, const QString &dest) const
+{
+    QDir root;
+    const QString destDir(QDir(dest).absolutePath()); // get directory path without any "." or ".."
+    if (!root.mkpath(destDir)) {
+        return false;
+    }
+
+    struct Entry {
+        qint64 position;
+        const KArchiveEntry *entry;
+        QString path; // Relative to destDir
+    };
+    QVector<Entry> files;
+    QStringList dirPaths;
+    bool ok = true;
+    for (const QString &path : paths) {
+        const KArchiveEntry *e = entry(path);
+        if (!e) {
+            qCWarning(KArchiveLog) << "Directory" << name() << "has no entry" << path << "to extract";
+            ok = false;
+            continue;
+        }
+        QString cleanPath = QDir::cleanPath(path);
+        while (cleanPath.startsWith(u'/')) {
+            cleanPath.remove(0, 1);
+        }
+        if (!e->isDirectory() || !e->symLinkTarget().isEmpty()) {
+            const qint64 position = e->isFile() ? static_cast<const KArchiveFile *>(e)->position() : 0;
+            files.append({position, e, cleanPath});
+            continue;
+        }
+        const QString prefix = (cleanPath.isEmpty() || cleanPath == QLatin1String(".")) ? QString() : cleanPath + u'/';
+        dirPaths.append(prefix);
+        // The entries below a symlinked directory would be written through the link, skip them
+        // as the recursive copyTo() does. The subdirectories are visited right after themselves
+        QString linkPrefix;
+        static_cast<const KArchiveDirectory *>(e)->visitEntries(
+            [&](const KArchiveEntry *child, const QString &childPath) {
+                if (!linkPrefix.isEmpty() && childPath.startsWith(linkPrefix)) {
+                    return true;
                 }
-            } else {
-                if (curEntry->isFile()) {
-                    const KArchiveFile *curFile = dynamic_cast<const KArchiveFile *>(curEntry);
-                    if (curFile) {
-                        fileList.append(curFile);
-                        fileToDir.insert(curFile->position(), curDirName);
+                if (child->isDirectory() && child->symLinkTarget().isEmpty()) {
+                    dirPaths.append(prefix + childPath);
+                } else {
+                    if (child->isDirectory()) {
+                        linkPrefix = childPath + u'/';
                     }
+                    const qint64 position = child->isFile() ? static_cast<const KArchiveFile *>(child)->position() : 0;
+                    files.append({position, child, prefix + childPath});
                 }
+                return true;
+            },
+            Recursive);
+    }
 
-                if (curEntry->isDirectory() && recursiveCopy) {
-                    const KArchiveDirectory *ad = dynamic_cast<const KArchiveDirectory *>(curEntry);
-                    if (ad) {
-                        dirStack.push(ad);
-                        dirNameStack.push(curDirName + u'/' + curEntry->name());
-                    }
-                }
+    // Read the files in the order of their data, so we have a linear access
+    std::sort(files.begin(), files.end(), [](const Entry &entry1, const Entry &entry2) {
+        return entry1.position < entry2.position || (entry1.position == entry2.position && std::less<const KArchiveEntry *>()(entry1.entry, entry2.entry));
+    });
+    files.erase(std::unique(files.begin(),
+                            files.end(),
+                            [](const Entry &entry1, const Entry &entry2) {
+                                return entry1.entry == entry2.entry;
+                            }),
+                files.end());
+
+    // extract only to specified folder if it is located within archive's extraction folder
+    // otherwise put file under root position in extraction folder
+    auto destDirName = [&destDir](const QString &path) {
+        const QString dirName = QDir::cleanPath(destDir + u'/' + path);
+        if (dirName != destDir && !dirName.startsWith(destDir + u'/')) {
+            qCWarning(KArchiveLog) << "Attempted export into folder" << dirName << "which is outside of the extraction root folder" << destDir << "."
+                                   << "Changing export of contained files to extraction root folder.";
+            return destDir;
+        }
+        return dirName;
+    };
+
+    // Nothing may be written through the symlinks this call creates, whatever the order of
+    // their creation. The paths given explicitly can still lead below a symlinked directory
+    QSet<QString> linkPaths;
+    for (const Entry &file : qAsConst(files)) {
+        if (!file.entry->symLinkTarget().isEmpty()) {
+            linkPaths.insert(file.path);
+        }
+    }
+    auto isBelowLink = [&linkPaths](QString path) {
+        while (!linkPaths.isEmpty() && !path.isEmpty()) {
+            if (linkPaths.contains(path)) {
+                qCWarning(KArchiveLog) << "Refusing to extract through the symlink" << path;
+                return true;
             }
+            path.truncate(qMax(path.lastIndexOf(u'/'), 0));
         }
-    } while (!dirStack.isEmpty());
+        return false;
+    };
 
-    std::sort(fileList.begin(), fileList.end(), sortByPosition); // sort on d->pos, so we have a linear access
+    for (const QString &dirPath : qAsConst(dirPaths)) {
+        if (isBelowLink(dirPath)) {
+            ok = false;
+            continue;
+        }
+        if (!root.mkpath(destDirName(dirPath))) {
+            return false;
+        }
+    }
 
-    for (QVector<const KArchiveFile *>::const_iterator it = fileList.constBegin(), end = fileList.constEnd(); it != end; ++it) {
-        const KArchiveFile *f = *it;
-        qint64 pos = f->position();
-        if (!f->copyTo(fileToDir[pos])) {
+    QString parentPath;
+    QString parentDirName = destDir;
+    bool parentBelowLink = false;
+    for (const Entry &file : qAsConst(files)) {
+        const QStringView curParentPath = QStringView(file.path).left(qMax(file.path.lastIndexOf(u'/'), 0));
+        if (curParentPath.compare(parentPath) != 0) {
+            parentPath = curParentPath.toString();
+            parentBelowLink = isBelowLink(parentPath);
+            parentDirName = destDirName(parentPath);
+            if (!parentBelowLink && !root.mkpath(parentDirName)) {
+                return false;
+            }
+        }
+        if (parentBelowLink) {
+            ok = false;
+            continue;
+        }
+        if (!file.entry->symLinkTarget().isEmpty()) {
+            copySymLinkTo(file.entry, parentDirName);
+        } else if (!static_cast<const KArchiveFile *>(file.entry)->copyTo(parentDirName)) {
             return false;
         }
     }
-    return true;
+    return ok;
 }
 
 void KArchive::virtual_hook(int, void *)
@@ -118,6 +118,106 @@ public:
      */
     const KArchiveDirectory *directory() const;
 
+    /**
+     * The function setEntryFilter() can call with the path of each file of the archive.
+     * @param context the context given to setEntryFilter()
+     * @param path the path of the file relative to the root directory of the archive, in UTF-8,
+     * without leading slash, and not null-terminated
+     * @param size the size of @p path in bytes
+     * @return true to read the file, false to leave it out
+     * @since 5.86
+     */
+    typedef bool (*EntryFilter)(void *context, const char *path, int size);
+
+    /**
+     * Call this before open() to only read the files of the archive whose path matches one of @p patterns.
+     *
+     * The other files are skipped while the archive is listed, before any entry is created for them,
+     * which makes opening a large archive much cheaper when only a few of its files are needed.
+     * Directories are only kept when they hold files that match.
+     *
+     * In the patterns, @c * matches any sequence of characters but slashes, @c ** any sequence
+     * of characters, and @c ? a single character but a slash. A pattern ending with a slash matches
+     * everything below that directory. For instance "data/" and "**.json" read the files below
+     * the "data" directory and the JSON files, wherever they are.
+     *
+     * The filter only applies to archives opened with QIODevice::ReadOnly, and to all the following
+     * open() calls, until it is changed.
+     *
+     * @param patterns the patterns, or an empty list to read all the files (the default)
+     * @since 5.86
+     */
+    void setEntryFilter(const QStringList &patterns);
+
+    /**
+     * Call this before open() to only read the files of the archive @p filter returns true for.
+     * This is the same as above, with a function deciding which files to read.
+     *
+     * @param filter the function, or nullptr to read all the files
+     * @param context passed to @p filter
+     * @since 5.86
+     */
+    void setEntryFilter(EntryFilter filter, void *context);
+
+    /**
+     * Sets the file the list of entries of the archive is cached in, call this before open().
+     *
+     * Opening a large archive mostly consists of listing its entries, which can take a while
+     * when there are millions of them, or when the archive is compressed as a whole.
+     * With a cache file, open() stores the list there, and later opens of the same archive
+     * read it back instead. The cache is tied to the size and modification time of the archive
+     * file and to its first and last bytes; when any of them changed, the cache is considered
+     * stale and is written again.
+     *
+     * This only applies to archives read from a file with QIODevice::ReadOnly. It is supported
+     * by KTar, KZip and K7Zip, the other formats ignore it. K7Zip never caches archives whose
+     * header is encrypted, so that the names of their files aren't written anywhere in clear.
+     *
+     * @param fileName the path of the cache file, or an empty string (the default) for no cache
+     * @since 5.86
+     */
+    void setCatalogueCacheFile(const QString &fileName);
+
+    /**
+     * Returns the file the list of entries of the archive is cached in, empty if none.
+     * @see setCatalogueCacheFile
+     * @since 5.86
+     */
+    QString catalogueCacheFile() const;
+
+    /**
+     * Returns whether the last open() read the list of entries from the cache file.
+     * @see setCatalogueCacheFile
+     * @since 5.86
+     */
+    bool isCatalogueCacheHit() const;
+
+    /**
+     * Call this before open() to share the list of entries with the other instances of the process
+     * that open the same archive file.
+     *
+     * The list of entries of an archive file is then kept in memory once, for as long as an
+     * instance that shares it is open, and opening the same file again, e.g. from another
+     * thread, reuses it instead of listing the entries again. Each instance still has its own
+     * device and entries. The archive is recognized by its path and by the same key as the
+     * cache file, see setCatalogueCacheFile().
+     *
+     * This only applies to archives read from a file with QIODevice::ReadOnly. It is supported
+     * by KTar, KZip and K7Zip, the other formats ignore it. K7Zip never shares archives whose
+     * header is encrypted, so that no instance gets their list of files without the password.
+     *
+     * @param shared whether to share the list of entries, false by default
+     * @since 5.86
+     */
+    void setCatalogueShared(bool shared);
+
+    /**
+     * Returns whether the list of entries is shared with the other instances of the process.
+     * @see setCatalogueShared
+     * @since 5.86
+     */
+    bool isCatalogueShared() const;
+
     /**
      * Writes a local file into the archive. The main difference with writeFile,
      * is that this method minimizes memory usage, by not loading the whole file
@@ -8,8 +8,239 @@
 #pragma once
 
 #include "karchive.h"
+#include "karchivefile.h"
 
+#include <QtCore/qfile.h>
+#include <QtCore/qhash.h>
+#include <QtCore/qmutex.h>
 #include <QtCore/qsavefile.h>
+#include <QtCore/qset.h>
+#include <QtCore/qvector.h>
+
+#include <memory>
+#include <mutex>
+#include <utility>
+
+/**
+ * The flat list of entries an archive read when opening, from which the KArchiveEntry objects
+ * are only created when their directory is navigated. See KArchivePrivate::setCatalogue().
+ * @internal
+ */
+class KArchiveCatalogue
+{
+public:
+    virtual ~KArchiveCatalogue() = default;
+
+    virtual int count() const = 0;
+
+    /**
+     * The path of the entry @p index, relative to the root directory, without "." or ".." components,
+     * and without leading or trailing slashes.
+     */
+    virtual QString path(int index) const = 0;
+
+    virtual bool isDirectory(int index) const = 0;
+
+    /**
+     * Creates the entry @p index, named @p name. Returns nullptr to leave it out.
+     */
+    virtual KArchiveEntry *createEntry(int index, const QString &name) = 0;
+};
+
+/**
+ * An entry as listed by the formats that don't have a catalogue of their own, see KArchiveRecordCatalogue.
+ * @internal
+ */
+struct KArchiveRecord {
+    // Relative to the root directory, without "." or ".." components, empty for the root directory itself
+    QString path;
+    QString user;
+    QString group;
+    QString symlink;
+    uint time = 0;
+    mode_t access = 0;
+    bool isDirectory = false;
+    qint64 position = 0;
+    qint64 size = 0;
+
+    // Only used by some formats
+    QString storedPath; // The path as stored in the archive
+    qint64 headerStart = 0;
+    qint64 compressedSize = 0;
+    quint32 crc = 0;
+    int method = 0;
+};
+Q_DECLARE_TYPEINFO(KArchiveRecord, Q_MOVABLE_TYPE);
+
+/**
+ * The catalogue of the formats whose entries are a list of records read while opening,
+ * see KArchivePrivate::setRecords(). Creates plain files and directories, formats with
+ * their own entry classes reimplement createEntry().
+ * @internal
+ */
+class KArchiveRecordCatalogue : public KArchiveCatalogue
+{
+    Q_DISABLE_COPY_MOVE(KArchiveRecordCatalogue)
+public:
+    explicit KArchiveRecordCatalogue(KArchive *archive, std::shared_ptr<const QVector<KArchiveRecord>> records)
+        : m_archive(archive)
+        , m_records(std::move(records))
+    {
+    }
+
+    int count() const override
+    {
+        return m_records->size();
+    }
+
+    QString path(int index) const override
+    {
+        return m_records->at(index).path;
+    }
+
+    bool isDirectory(int index) const override
+    {
+        return m_records->at(index).isDirectory;
+    }
+
+    KArchiveEntry *createEntry(int index, const QString &name) override;
+
+    const KArchiveRecord &record(int index) const
+    {
+        return m_records->at(index);
+    }
+
+    KArchive *archive() const
+    {
+        return m_archive;
+    }
+
+private:
+    KArchive *const m_archive;
+    const std::shared_ptr<const QVector<KArchiveRecord>> m_records;
+};
+
+/**
+ * The catalogue cache file of an archive, see KArchive::setCatalogueCacheFile(), mapped
+ * in memory when the file system allows it. Each format writes its own payload after its
+ * own key, see KArchivePrivate::writeCatalogueCache().
+ * @internal
+ */
+class KArchiveCacheFile
+{
+    Q_DISABLE_COPY_MOVE(KArchiveCacheFile)
+public:
+    /**
+     * Opens the cache file of @p archive. The payload is only available when the file was written
+     * under @p key, for the same archive and format, and isn't damaged.
+     */
+    KArchiveCacheFile(const KArchive *archive, const QByteArray &key);
+
+    bool isValid() const
+    {
+        return m_payload;
+    }
+
+    // The payload, valid as long as this object
+    const uchar *payload() const
+    {
+        return m_payload;
+    }
+
+    qint64 payloadSize() const
+    {
+        return m_payloadSize;
+    }
+
+private:
+    QFile m_file;
+    QByteArray m_contents;
+    const uchar *m_payload;
+    qint64 m_payloadSize;
+};
+
+/**
+ * A file left to extract by KArchiveDirectory::copyTo(), see KArchivePrivate::prepareCopyTo().
+ * @internal
+ */
+struct KArchiveFileCopy {
+    const KArchiveFile *file;
+    // The folder to extract it to
+    QString dirName;
+};
+
+/**
+ * The files to read, see KArchive::setEntryFilter().
+ * @internal
+ */
+class KArchiveEntryFilter
+{
+    Q_DISABLE_COPY_MOVE(KArchiveEntryFilter)
+public:
+    explicit KArchiveEntryFilter(const QStringList &patterns);
+    KArchiveEntryFilter(KArchive::EntryFilter function, void *context);
+
+    /**
+     * Returns whether the file at @p path, in UTF-8, is to be read.
+     * The path may be as stored in the archive, e.g. start with "./" or slashes, end with a slash
+     * or hold "." components: it is matched as cleaned by KArchivePrivate::cleanPath().
+     */
+    bool matches(const char *path, int size) const;
+    bool matches(const QByteArray &path) const
+    {
+        return matches(path.constData(), path.size());
+    }
+    bool matches(const QString &path) const
+    {
+        return matches(path.toUtf8());
+    }
+
+private:
+    struct Pattern {
+        // The characters before the first wildcard, compared before the rest is matched
+        QByteArray prefix;
+        QByteArray glob;
+    };
+    static bool matchGlob(const char *glob, const char *globEnd, const char *path, const char *pathEnd);
+
+    QVector<Pattern> m_patterns;
+    KArchive::EntryFilter m_function;
+    void *m_context;
+};
+
+/**
+ * The arguments of the virtual_hook() of KArchiveFile that implements KArchiveFile::readChunks()
+ * for the formats that store their files in another way than as they are.
+ * The hook sets handled when it took care of the call.
+ * @internal
+ */
+struct KArchiveReadChunksHook {
+    enum { Id = 1 };
+
+    KArchiveFile::ChunkVisitor visitor;
+    void *context;
+    // The buffer of the caller, or nullptr
+    char *buffer;
+    qint64 bufferSize;
+    bool handled;
+    bool result;
+
+    bool visit(const char *data, qint64 size) const
+    {
+        return size == 0 || visitor(context, data, size);
+    }
+};
+
+/**
+ * The decoder state a format keeps from one KArchiveFile::readChunks() call to the next,
+ * see KArchivePrivate::setChunkDecoder().
+ * @internal
+ */
+class KArchiveChunkDecoder
+{
+public:
+    virtual ~KArchiveChunkDecoder() = default;
+};
 
 class KArchivePrivate
 {
@@ -25,12 +256,20 @@ public:
         , fileName()
         , mode(QIODevice::NotOpen)
         , deviceOwned(false)
+        , catalogue(nullptr)
+        , catalogueCacheHit(false)
+        , catalogueShared(false)
+        , chunkDecoder(nullptr)
+        , entryFilter(nullptr)
     {
     }
     ~KArchivePrivate()
     {
         delete saveFile;
         delete rootDir;
+        delete catalogue;
+        delete chunkDecoder;
+        delete entryFilter;
     }
 
     static bool hasRootDir(KArchive *archive)
@@ -40,6 +279,133 @@ public:
 
     void abortWriting();
 
+    /**
+     * Lets the entries of @p catalogue be created on demand, instead of building the whole
+     * directory tree in openArchive(). Takes ownership of the catalogue, which lives until close().
+     */
+    static void setCatalogue(KArchive *archive, KArchiveCatalogue *catalogue);
+
+    static bool hasCatalogue(KArchive *archive)
+    {
+        return archive->d->catalogue;
+    }
+
+    /**
+     * Builds the directory tree of @p archive from the records of @p catalogue: lazily in ReadOnly
+     * mode, see setCatalogue(), and right away otherwise, since writing needs all the entries.
+     * A directory record with an empty path becomes the root directory. Takes ownership of the catalogue.
+     * @return false if an entry is below a non-empty file, which is checked over the records in ReadOnly mode
+     */
+    static bool setRecords(KArchive *archive, KArchiveRecordCatalogue *catalogue);
+
+    // Returns path relative to the root directory, without "." components, and empty for the root directory
+    static QString cleanPath(const QString &path);
+
+    // See KArchive::setCatalogueCacheFile()
+    static QString catalogueCacheFile(const KArchive *archive)
+    {
+        return archive->d->catalogueCacheFile;
+    }
+
+    static void setCatalogueCacheHit(KArchive *archive)
+    {
+        archive->d->catalogueCacheHit = true;
+    }
+
+    // Writes contents, a key followed by a payload read back by KArchiveCacheFile, to the cache file of archive
+    static void writeCatalogueCache(const KArchive *archive, QByteArray contents);
+
+    // See KArchive::setCatalogueShared()
+    static bool isCatalogueShared(const KArchive *archive)
+    {
+        return archive->d->catalogueShared;
+    }
+
+    /**
+     * Returns the catalogue data shared under @p key by another instance of the process, or nullptr.
+     * The keys start with the absolute path of the archive file, see sharedCatalogueKey().
+     */
+    static std::shared_ptr<const void> findSharedCatalogue(const QByteArray &key);
+
+    // Shares data under key, until the last instance using it drops it
+    static void shareCatalogue(const QByteArray &key, const std::shared_ptr<const void> &data);
+
+    // Returns @p key prefixed with the absolute path of the file of @p archive, or an empty key if it isn't a file
+    static QByteArray sharedCatalogueKey(const KArchive *archive, const QByteArray &key);
+
+    /**
+     * Returns the key the records of @p archive are stored under by storeRecords(), in the cache file
+     * and along with the path of the archive in the shared catalogues, which is empty when they
+     * are stored in neither. @p format tells the formats apart.
+     */
+    static QByteArray recordsKey(KArchive *archive, const char *format);
+
+    // Returns the records stored under key, or nullptr when they have to be read from the archive
+    static std::shared_ptr<const QVector<KArchiveRecord>> findRecords(KArchive *archive, const QByteArray &key);
+
+    // Stores the records read from the archive under key, and returns them
+    static std::shared_ptr<const QVector<KArchiveRecord>> storeRecords(KArchive *archive, const QByteArray &key, QVector<KArchiveRecord> records);
+
+    /**
+     * Locks the directory tree of @p archive, whose const methods create the entries on demand,
+     * so that several threads can look entries up at once.
+     */
+    static std::unique_lock<QRecursiveMutex> lockTree(KArchive *archive)
+    {
+        return archive ? std::unique_lock<QRecursiveMutex>(archive->d->treeMutex) : std::unique_lock<QRecursiveMutex>();
+    }
+
+    struct IndexedEntry {
+        KArchiveEntry *entry;
+        KArchiveDirectory *parent;
+    };
+
+    static QHash<QString, IndexedEntry> *pathIndex(KArchive *archive)
+    {
+        return &archive->d->pathIndex;
+    }
+
+    /**
+     * Returns the buffer to read the chunks of @p hook into: the one of the caller, otherwise one
+     * the archive keeps for all the reads. @p size is set to its size.
+     */
+    static char *chunkBuffer(KArchive *archive, const KArchiveReadChunksHook &hook, qint64 *size);
+
+    // Visits the size bytes stored as they are at pos in the device of archive
+    static bool readStoredChunks(KArchive *archive, qint64 pos, qint64 size, const KArchiveReadChunksHook &hook);
+
+    // Returns the files to read while opening archive, nullptr for all of them
+    static const KArchiveEntryFilter *entryFilter(const KArchive *archive)
+    {
+        return archive->d->mode == QIODevice::ReadOnly ? archive->d->entryFilter : nullptr;
+    }
+
+    static KArchiveChunkDecoder *chunkDecoder(KArchive *archive)
+    {
+        return archive->d->chunkDecoder;
+    }
+
+    // Takes ownership of decoder, which lives as long as the archive
+    static void setChunkDecoder(KArchive *archive, KArchiveChunkDecoder *decoder)
+    {
+        delete archive->d->chunkDecoder;
+        archive->d->chunkDecoder = decoder;
+    }
+
+    // Adds the executable bits of the unix permissions perms to filePerms
+    static QFileDevice::Permissions withExecutablePerms(QFileDevice::Permissions filePerms, mode_t perms);
+
+    /**
+     * Creates the directories and the symlinks that KArchiveDirectory::copyTo() extracts from @p dir
+     * to @p dest, and lists the files left to extract into @p files, in the order of their data.
+     * @return false if a directory couldn't be created
+     */
+    static bool prepareCopyTo(const KArchiveDirectory *dir, const QString &dest, bool recursive, QVector<KArchiveFileCopy> *files);
+
+    // Returns a string equal to string, sharing its data with the previous ones, for user and group names
+    static QString intern(KArchive *archive, const QString &string);
+
+    // The entries keep the time as is, it is only converted to local time by KArchiveEntry::date()
     static QDateTime time_tToDateTime(uint time_t);
 
     KArchiveDirectory *findOrCreate(const QString &path, int recursionCounter);
@@ -51,5 +417,17 @@ public:
     QString fileName;
     QIODevice::OpenMode mode;
     bool deviceOwned; // if true, we (KArchive) own dev and must delete it
+    QSet<QString> stringPool;
+    KArchiveCatalogue *catalogue;
+    QString catalogueCacheFile;
+    bool catalogueCacheHit;
+    bool catalogueShared;
+    QRecursiveMutex treeMutex;
+    // The entries reachable from the root directory, by their path relative to it
+    QHash<QString, IndexedEntry> pathIndex;
+    // Reused by KArchiveFile::readChunks()
+    QByteArray chunkBuffer;
+    KArchiveChunkDecoder *chunkDecoder;
+    KArchiveEntryFilter *entryFilter;
     QString errorStr{tr("Unknown error")};
 };
@@ -13,11 +13,14 @@
 #include <sys/types.h>
 
 #include <QtCore/qdatetime.h>
+#include <QtCore/qflags.h>
 #include <QtCore/qstring.h>
 #include <QtCore/qstringlist.h>
 
 #include "karchiveentry.h"
 
+#include <type_traits>
+
 class KArchive;
 class KArchiveDirectoryPrivate;
 class KArchiveFile;
@@ -25,6 +28,11 @@ class KArchiveFile;
  * @class KArchiveDirectory karchivedirectory.h KArchiveDirectory
  *
  * Represents a directory entry in a KArchive.
+ *
+ * The entries of an archive opened for reading can be created as their directory is first
+ * looked at, by entries(), entry(), file(), visitEntries() or copyTo(). These methods lock
+ * the archive meanwhile, so that several threads can call them at once on the same archive.
+ *
  * @short A directory in an archive.
  *
  * @see KArchive
@@ -83,6 +91,75 @@ public:
      */
     const KArchiveFile *file(const QString &name) const;
 
+    /**
+     * Options for visitEntries().
+     * @since 5.86
+     */
+    enum VisitOption {
+        NoVisitOption = 0x0,
+        Recursive = 0x1, ///< Visits the entries of the subdirectories as well, after the subdirectory itself
+        /**
+         * Visits the files in the order of their data in the archive (see KArchiveFile::position()),
+         * so that reading them in turn only ever moves forward. Directories come right before the
+         * first entry below them, the directories without any file below them come last.
+         */
+        ArchiveOrder = 0x2,
+    };
+    Q_DECLARE_FLAGS(VisitOptions, VisitOption)
+
+    /**
+     * The function visitEntries() passes the entries to.
+     * @param context the context given to visitEntries()
+     * @param entry the entry
+     * @param path the path of the entry relative to this directory, only valid during the call
+     * @return true to go on, false to stop
+     * @since 5.86
+     */
+    typedef bool (*EntryVisitor)(void *context, const KArchiveEntry *entry, const QString &path);
+
+    /**
+     * Passes the entries of this directory to @p visitor, along with their path.
+     *
+     * Unlike entries(), this doesn't copy the names into a list that then has to be looked up
+     * again with entry(). The paths are built in a single buffer reused for all the entries.
+     * With ArchiveOrder, one list of the entries to sort is allocated for the whole visit,
+     * and a path for each directory.
+     *
+     * The directories must not be modified during the visit.
+     *
+     * @param visitor called with each entry
+     * @param context passed to @p visitor
+     * @param options which entries to visit, and in which order. By default the entries
+     * of this directory only, in no particular order
+     * @return true if all the entries were visited, false if @p visitor stopped the visit
+     * @since 5.86
+     */
+    bool visitEntries(EntryVisitor visitor, void *context, VisitOptions options = NoVisitOption) const;
+
+    /**
+     * Convenience overload for any callable taking the entry and its path, e.g. a lambda:
+     * @code
+     * dir->visitEntries(
+     *     [](const KArchiveEntry *entry, const QString &path) {
+     *         qDebug() << path << entry->isFile();
+     *         return true;
+     *     },
+     *     KArchiveDirectory::Recursive | KArchiveDirectory::ArchiveOrder);
+     * @endcode
+     * @since 5.86
+     */
+    template<typename Visitor>
+    bool visitEntries(Visitor &&visitor, VisitOptions options = NoVisitOption) const
+    {
+        using VisitorType = typename std::remove_reference<Visitor>::type;
+        return visitEntries(
+            [](void *context, const KArchiveEntry *entry, const QString &path) -> bool {
+                return (*static_cast<VisitorType *>(context))(entry, path);
+            },
+            const_cast<void *>(static_cast<const void *>(&visitor)),
+            options);
+    }
+
     /**
      * @internal
      * Adds a new entry to the directory.
@@ -118,6 +195,27 @@ public:
      */
     bool copyTo(const QString &dest, bool recursive = true) const;
 
+    /**
+     * Extracts the entries at @p paths, relative to this directory, to the directory @p dest,
+     * keeping their relative path. Directories are extracted with everything below them,
+     * except for the symlinked ones, which are extracted as links: nothing is ever written
+     * through a symlink extracted by this call.
+     *
+     * This is much faster than looking up and extracting the files one by one. The files
+     * are extracted in the order of their data in the archive, in a single forward pass
+     * that skips the data in between, and the buffers and decoders are reused from one
+     * file to the next. On compressed devices that can't seek, such as a KTar reading through
+     * its decompression filter (see KTar::setTemporaryFileUsed()), the data in between is
+     * decompressed and dropped, so that the files are all read in a single decompression pass.
+     *
+     * @param paths the paths of the files and directories to extract
+     * @param dest the directory to extract to
+     * @return true on success, false if one of @p paths isn't in this directory, is below an extracted
+     * symlink or couldn't be extracted
+     * @since 5.86
+     */
+    bool copyTo(const QStringList &paths, const QString &dest) const;
+
 protected:
     void virtual_hook(int id, void *data) override;
 
@@ -125,3 +223,5 @@ private:
     friend class KArchiveDirectoryPrivate;
     KArchiveDirectoryPrivate *const d;
 };
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(KArchiveDirectory::VisitOptions)
@@ -52,7 +52,7 @@ public:
 
     /**
      * Creation date of the file.
-     * @return the creation date
+     * @return the creation date, in local time
      */
     QDateTime date() const;
 
@@ -0,0 +1,263 @@
+/* This file is part of the KDE libraries
+   SPDX-FileCopyrightText: 2021 KArchive authors
+
+   SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#include "karchivefactory.h"
+#include "k7zip.h"
+#include "kar.h"
+#include "krcc.h"
+#include "ktar.h"
+#include "kzip.h"
+
+#include <QtCore/qdebug.h>
+#include <QtCore/qfile.h>
+
+#include <cstring>
+
+// Size of the zip end of central directory record, without the comment
+static constexpr int ZIP_EOCD_SIZE = 22;
+static constexpr int ZIP_MAX_COMMENT_SIZE = 0xFFFF;
+
+static const char k7zipSignature[6] = {'7', 'z', '\xBC', '\xAF', '\x27', '\x1C'};
+
+static bool startsWith(const QByteArray &data, const char *magic, int size)
+{
+    return data.size() >= size && memcmp(data.constData(), magic, size) == 0;
+}
+
+// Looks for the end of central directory record, which must be followed by exactly its comment
+static bool hasZipEndOfCentralDirectory(const QByteArray &tail)
+{
+    const char *data = tail.constData();
+    for (qsizetype pos = tail.size() - ZIP_EOCD_SIZE; pos >= 0; --pos) {
+        if (memcmp(data + pos, "PK\5\6", 4) != 0) {
+            continue;
+        }
+        const int commentLength = uchar(data[pos + 20]) | uchar(data[pos + 21]) << 8;
+        if (pos + ZIP_EOCD_SIZE + commentLength == tail.size()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static QString tarMimeTypeForCompressionType(KCompressionDevice::CompressionType type)
+{
+    switch (type) {
+    case KCompressionDevice::CompressionType::GZip:
+        return QStringLiteral("application/gzip");
+    case KCompressionDevice::CompressionType::BZip2:
+        return QStringLiteral("application/x-bzip");
+    case KCompressionDevice::CompressionType::Xz:
+        return QStringLiteral("application/x-xz");
+    case KCompressionDevice::CompressionType::Zstd:
+        return QStringLiteral("application/zstd");
+    case KCompressionDevice::CompressionType::None:
+        return QStringLiteral("application/x-tar");
+    }
+    return QString();
+}
+
+/**
+ * A KTar reading through a KCompressionDevice that it owns.
+ */
+class KCompressedTar : public KTar
+{
+    Q_DISABLE_COPY_MOVE(KCompressedTar)
+public:
+    explicit KCompressedTar(KCompressionDevice *dev)
+        : KTar(dev)
+        , m_compressionDevice(dev)
+    {
+    }
+
+    ~KCompressedTar() override
+    {
+        // close before the device goes away, ~KTar would be too late
+        if (isOpen()) {
+            close();
+        }
+        delete m_compressionDevice;
+    }
+
+private:
+    KCompressionDevice *m_compressionDevice;
+};
+
+static KArchive *openForReading(KArchive *archive, QString *errorString)
+{
+    if (!archive->open(QIODevice::ReadOnly)) {
+        if (errorString) {
+            *errorString = archive->errorString();
+        }
+        delete archive;
+        return nullptr;
+    }
+    return archive;
+}
+
+int KArchiveFactory::headSize()
+{
+    return qMax(KCompressionDevice::magicSize(), 8);
+}
+
+int KArchiveFactory::tailSize()
+{
+    return ZIP_EOCD_SIZE + ZIP_MAX_COMMENT_SIZE;
+}
+
+KArchiveFactory::Format KArchiveFactory::formatForData(const QByteArray &head, const QByteArray &tail, KCompressionDevice::CompressionType *compression)
+{
+    if (compression) {
+        *compression = KCompressionDevice::CompressionType::None;
+    }
+
+    if (startsWith(head, "PK\3\4", 4) || startsWith(head, "PK\5\6", 4)) {
+        return Format::Zip;
+    }
+    if (startsWith(head, k7zipSignature, 6)) {
+        return Format::SevenZip;
+    }
+    if (startsWith(head, "!<arch>\n", 8)) {
+        return Format::Ar;
+    }
+    if (startsWith(head, "qres", 4)) {
+        return Format::Rcc;
+    }
+
+    bool ok = false;
+    const KCompressionDevice::CompressionType type = KCompressionDevice::compressionTypeForData(head, &ok);
+    if (ok) {
+        if (compression) {
+            *compression = type;
+        }
+        return Format::Tar;
+    }
+
+    // Self-extracting zip files start with an executable stub, but still end with the central directory
+    if (hasZipEndOfCentralDirectory(tail)) {
+        return Format::Zip;
+    }
+    return Format::Unknown;
+}
+
+KArchiveFactory::Format KArchiveFactory::formatForDevice(QIODevice *dev, KCompressionDevice::CompressionType *compression)
+{
+    if (!dev || !dev->isReadable()) {
+        return Format::Unknown;
+    }
+
+    if (dev->isSequential()) {
+        return formatForData(dev->peek(headSize()), QByteArray(), compression);
+    }
+
+    const qint64 oldPos = dev->pos();
+    if (!dev->seek(0)) {
+        return Format::Unknown;
+    }
+    const QByteArray head = dev->read(headSize());
+    QByteArray tail;
+    const qint64 size = dev->size();
+    if (size > head.size()) {
+        const qint64 tailStart = qMax(qint64(head.size()), size - tailSize());
+        if (dev->seek(tailStart)) {
+            tail = dev->read(size - tailStart);
+        }
+    } else {
+        tail = head;
+    }
+    dev->seek(oldPos);
+    return formatForData(head, tail, compression);
+}
+
+KArchive *KArchiveFactory::open(const QString &fileName, QString *errorString)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        if (errorString) {
+            *errorString = tr("Could not open %1: %2").arg(fileName, file.errorString());
+        }
+        return nullptr;
+    }
+    KCompressionDevice::CompressionType compression;
+    const Format format = formatForDevice(&file, &compression);
+    file.close();
+
+    KArchive *archive = nullptr;
+    switch (format) {
+    case Format::Zip:
+        archive = new KZip(fileName);
+        break;
+    case Format::SevenZip:
+        archive = new K7Zip(fileName);
+        break;
+    case Format::Ar:
+        archive = new KAr(fileName);
+        break;
+    case Format::Rcc:
+        archive = new KRcc(fileName);
+        break;
+    case Format::Tar:
+        // Pass the compression on, so that KTar doesn't have to detect it again
+        archive = new KTar(fileName, tarMimeTypeForCompressionType(compression));
+        break;
+    case Format::Unknown:
+        if (errorString) {
+            *errorString = tr("Unknown archive format for %1").arg(fileName);
+        }
+        return nullptr;
+    }
+    return openForReading(archive, errorString);
+}
+
+KArchive *KArchiveFactory::open(QIODevice *dev, QString *errorString)
+{
+    if (!dev) {
+        if (errorString) {
+            *errorString = tr("No device was specified");
+        }
+        return nullptr;
+    }
+    if (!dev->isOpen() && !dev->open(QIODevice::ReadOnly)) {
+        if (errorString) {
+            *errorString = tr("Could not open device: %1").arg(dev->errorString());
+        }
+        return nullptr;
+    }
+
+    KCompressionDevice::CompressionType compression;
+    const Format format = formatForDevice(dev, &compression);
+
+    KArchive *archive = nullptr;
+    switch (format) {
+    case Format::Zip:
+        archive = new KZip(dev);
+        break;
+    case Format::SevenZip:
+        archive = new K7Zip(dev);
+        break;
+    case Format::Ar:
+        archive = new KAr(dev);
+        break;
+    case Format::Tar:
+        if (compression == KCompressionDevice::CompressionType::None) {
+            archive = new KTar(dev);
+        } else {
+            archive = new KCompressedTar(new KCompressionDevice(dev, false, compression));
+        }
+        break;
+    case Format::Rcc:
+        if (errorString) {
+            *errorString = tr("Qt resources can only be opened from a file");
+        }
+        return nullptr;
+    case Format::Unknown:
+        if (errorString) {
+            *errorString = tr("Unknown archive format");
+        }
+        return nullptr;
+    }
+    return openForReading(archive, errorString);
+}
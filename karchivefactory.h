@@ -0,0 +1,107 @@
+/* This file is part of the KDE libraries
+   SPDX-FileCopyrightText: 2021 KArchive authors
+
+   SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#pragma once
+
+#include "karchive_global.h"
+#include "kcompressiondevice.h"
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qcoreapplication.h>
+#include <QtCore/qstring.h>
+
+class KArchive;
+
+/**
+ * @class KArchiveFactory karchivefactory.h KArchiveFactory
+ *
+ * Creates the right KArchive subclass for a file or a device, based on its content
+ * rather than on its file name.
+ *
+ * The format is determined from a single read of the first and the last bytes of
+ * the data (the latter to find the end of central directory record of
+ * self-extracting zip files), so callers don't have to try KZip, KTar, K7Zip,
+ * KAr and KRcc in turn.
+ *
+ * @code
+ * QScopedPointer<KArchive> archive(KArchiveFactory::open(fileName));
+ * if (archive) {
+ *     const KArchiveDirectory *dir = archive->directory();
+ *     ...
+ * }
+ * @endcode
+ *
+ * @short Opens archives of any supported format.
+ * @since 5.86
+ */
+class KARCHIVE_API KArchiveFactory
+{
+    Q_DISABLE_COPY_MOVE(KArchiveFactory)
+    Q_DECLARE_TR_FUNCTIONS(KArchiveFactory)
+
+public:
+    KArchiveFactory() = delete;
+
+    /**
+     * The archive formats that can be detected.
+     */
+    enum class Format {
+        Unknown, ///< Not recognized
+        Zip, ///< Zip archive, possibly self-extracting. Opened with KZip
+        SevenZip, ///< 7-Zip archive. Opened with K7Zip
+        Ar, ///< Unix ar archive. Opened with KAr
+        Rcc, ///< Qt binary resource. Opened with KRcc
+        Tar, ///< Tar archive, possibly compressed. Opened with KTar
+    };
+
+    /**
+     * Detects the archive format from the leading and trailing bytes of the data.
+     * @param head the first bytes of the data, see headSize()
+     * @param tail the last bytes of the data, see tailSize(). Can be empty for sequential devices,
+     * self-extracting zip files are not recognized then.
+     * @param compression if not null, set to the compression used by a tar archive
+     * @return the detected format
+     */
+    static Format formatForData(const QByteArray &head, const QByteArray &tail, KCompressionDevice::CompressionType *compression = nullptr);
+
+    /**
+     * Detects the archive format of @p dev, which must be open for reading.
+     * The position of the device is restored afterwards.
+     * @param dev the device to look at
+     * @param compression if not null, set to the compression used by a tar archive
+     * @return the detected format
+     */
+    static Format formatForDevice(QIODevice *dev, KCompressionDevice::CompressionType *compression = nullptr);
+
+    /**
+     * Creates the archive matching the content of @p fileName and opens it for reading.
+     * @param fileName a local path
+     * @param errorString if not null, set to a description of the error when nullptr is returned
+     * @return the opened archive, to be deleted by the caller, or nullptr on failure
+     */
+    static KArchive *open(const QString &fileName, QString *errorString = nullptr);
+
+    /**
+     * Creates the archive matching the content of @p dev and opens it for reading.
+     * The device is not owned by the returned archive and must outlive it.
+     * Qt resource files can only be opened by file name, see KRcc.
+     * @param dev the device to read from, opened by this method if needed
+     * @param errorString if not null, set to a description of the error when nullptr is returned
+     * @return the opened archive, to be deleted by the caller, or nullptr on failure
+     */
+    static KArchive *open(QIODevice *dev, QString *errorString = nullptr);
+
+    /**
+     * The number of leading bytes formatForData() looks at.
+     */
+    static int headSize();
+
+    /**
+     * The number of trailing bytes formatForData() looks at.
+     * This covers a zip end of central directory record with the longest possible comment.
+     */
+    static int tailSize();
+};
@@ -11,6 +11,8 @@
 
 #include "karchiveentry.h"
 
+#include <type_traits>
+
 class KArchiveFilePrivate;
 /**
  * @class KArchiveFile karchivefile.h KArchiveFile
@@ -87,6 +89,57 @@ public:
      */
     virtual QIODevice *createDevice() const;
 
+    /**
+     * The function readChunks() passes the content of the file to.
+     * @param context the context given to readChunks()
+     * @param data the next bytes of the file, only valid during the call
+     * @param size the number of bytes in @p data, never 0
+     * @return true to go on reading, false to stop
+     * @since 5.86
+     */
+    typedef bool (*ChunkVisitor)(void *context, const char *data, qint64 size);
+
+    /**
+     * Reads the content of the file chunk by chunk, without holding it in memory as a whole.
+     *
+     * Unlike data(), this works for files of any size, and unlike createDevice() it doesn't
+     * allocate a device: the chunks are read, and decompressed, with buffers and decoders the
+     * archive keeps from one call to the next. This suits hashing or forwarding the content.
+     *
+     * @param visitor called with each chunk, in order
+     * @param context passed to @p visitor
+     * @param buffer if not null, a buffer of @p bufferSize bytes the chunks are read into, instead
+     * of the one of the archive. Chunks may also point to data the archive already holds in memory.
+     * @param bufferSize the size of @p buffer
+     * @return true if the whole file was read, false on a read error or if @p visitor stopped the reading
+     * @since 5.86
+     */
+    bool readChunks(ChunkVisitor visitor, void *context, char *buffer = nullptr, qint64 bufferSize = 0) const;
+
+    /**
+     * Convenience overload for any callable taking the data and size of a chunk, e.g. a lambda:
+     * @code
+     * QCryptographicHash hash(QCryptographicHash::Sha256);
+     * file->readChunks([&hash](const char *data, qint64 size) {
+     *     hash.addData(data, size);
+     *     return true;
+     * });
+     * @endcode
+     * @since 5.86
+     */
+    template<typename Visitor>
+    bool readChunks(Visitor &&visitor, char *buffer = nullptr, qint64 bufferSize = 0) const
+    {
+        using VisitorType = typename std::remove_reference<Visitor>::type;
+        return readChunks(
+            [](void *context, const char *data, qint64 size) -> bool {
+                return (*static_cast<VisitorType *>(context))(data, size);
+            },
+            const_cast<void *>(static_cast<const void *>(&visitor)),
+            buffer,
+            bufferSize);
+    }
+
     /**
      * Checks whether this entry is a file.
      * @return true, since this entry is a file
@@ -96,7 +149,7 @@ public:
     /**
      * Extracts the file to the directory @p dest
      * @param dest the directory to extract to
-     * @return true on success, false if the file (dest + '/' + name()) couldn't be created
+     * @return true on success, false if the file (dest + '/' + name()) couldn't be created or written, or this file couldn't be read
      */
     bool copyTo(const QString &dest) const;
 
@@ -0,0 +1,380 @@
+/* This file is part of the KDE libraries
+   SPDX-FileCopyrightText: 2021 KArchive authors
+
+   SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#include "kasyncarchive.h"
+#include "karchive.h"
+#include "karchive_p.h"
+#include "karchivedirectory.h"
+#include "karchivefile.h"
+
+#include <QtCore/qabstracteventdispatcher.h>
+#include <QtCore/qfile.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qpointer.h>
+#include <QtCore/qqueue.h>
+#include <QtCore/qthreadpool.h>
+#include <QtCore/qwaitcondition.h>
+
+#include <limits>
+#include <memory>
+#include <type_traits>
+
+// The size of the chunks files are extracted by
+static const qint64 s_extractChunkSize = 1024 * 1024;
+
+/**
+ * A job of an archive that a coroutine awaits the result of.
+ *
+ * The job is queued as soon as it is created, so that the next chunk of a file can be read
+ * while the awaiting coroutine handles the previous one. Whichever of the end of the job and
+ * the suspension of the coroutine comes second resumes it.
+ */
+template<typename R>
+class KAsyncJob
+{
+public:
+    struct State {
+        std::optional<R> result;
+        std::coroutine_handle<> waiter;
+        QPointer<QObject> dispatcher;
+        // Resumes the coroutine when its thread has no event dispatcher
+        QThreadPool *pool = nullptr;
+        std::atomic<bool> handshake{false};
+    };
+
+    explicit KAsyncJob(std::shared_ptr<State> state)
+        : m_state(std::move(state))
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return m_state->handshake.load(std::memory_order_acquire);
+    }
+
+    bool await_suspend(std::coroutine_handle<> waiter)
+    {
+        m_state->waiter = waiter;
+        m_state->dispatcher = QAbstractEventDispatcher::instance();
+        return !m_state->handshake.exchange(true, std::memory_order_acq_rel);
+    }
+
+    R await_resume()
+    {
+        return std::move(*m_state->result);
+    }
+
+    static void finish(State *state, R result)
+    {
+        state->result = std::move(result);
+        if (!state->handshake.exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+        // Back to the thread the coroutine was suspended in
+        const std::coroutine_handle<> waiter = state->waiter;
+        if (QObject *dispatcher = state->dispatcher.data()) {
+            QMetaObject::invokeMethod(
+                dispatcher,
+                [waiter] {
+                    waiter.resume();
+                },
+                Qt::QueuedConnection);
+        } else {
+            // Not inline, that would hold up the next jobs of the archive, or deadlock
+            // if the coroutine deletes the KAsyncArchive
+            state->pool->start([waiter] {
+                waiter.resume();
+            });
+        }
+    }
+
+private:
+    std::shared_ptr<State> m_state;
+};
+
+/**
+ * A file being extracted by KAsyncArchive::extract(), only used by the jobs of the archive.
+ */
+class KAsyncFileCopy
+{
+public:
+    std::unique_ptr<QIODevice> input;
+    QFile output;
+    QByteArray buffer;
+};
+
+class Q_DECL_HIDDEN KAsyncArchive::KAsyncArchivePrivate
+{
+    Q_DISABLE_COPY_MOVE(KAsyncArchivePrivate)
+public:
+    explicit KAsyncArchivePrivate(KArchive *archive, QThreadPool *pool)
+        : archive(archive)
+        , pool(pool ? pool : QThreadPool::globalInstance())
+        , running(false)
+    {
+    }
+
+    // Queues function after the previous jobs of the archive
+    template<typename Function>
+    KAsyncJob<std::invoke_result_t<Function>> run(Function function)
+    {
+        using Job = KAsyncJob<std::invoke_result_t<Function>>;
+        auto state = std::make_shared<typename Job::State>();
+        state->pool = pool;
+        enqueue([state, function = std::move(function)]() mutable {
+            Job::finish(state.get(), function());
+        });
+        return Job(state);
+    }
+
+    void enqueue(std::function<void()> job);
+    void runJobs();
+
+    // Extracts file into the directory dest, one job per chunk
+    KArchiveTask<bool> copyFile(const KArchiveFile *file, QString dest);
+
+    // Returns an open device on the file at path, owned by the caller, or nullptr
+    static QIODevice *openFile(KArchive *archive, const QString &path);
+    static QIODevice *openFile(const KArchiveFile *file);
+
+    KArchive *const archive;
+    QThreadPool *const pool;
+    QMutex mutex;
+    QWaitCondition idle;
+    QQueue<std::function<void()>> jobs;
+    // Whether a thread of the pool runs the jobs of the archive
+    bool running;
+};
+
+void KAsyncArchive::KAsyncArchivePrivate::enqueue(std::function<void()> job)
+{
+    QMutexLocker locker(&mutex);
+    jobs.enqueue(std::move(job));
+    if (!running) {
+        running = true;
+        pool->start([this] {
+            runJobs();
+        });
+    }
+}
+
+void KAsyncArchive::KAsyncArchivePrivate::runJobs()
+{
+    // The jobs of an archive run one after the other, the archive isn't thread-safe
+    for (;;) {
+        std::function<void()> job;
+        {
+            QMutexLocker locker(&mutex);
+            if (jobs.isEmpty()) {
+                running = false;
+                idle.wakeAll();
+                return;
+            }
+            job = jobs.dequeue();
+        }
+        job();
+    }
+}
+
+QIODevice *KAsyncArchive::KAsyncArchivePrivate::openFile(KArchive *archive, const QString &path)
+{
+    const KArchiveFile *file = archive->isOpen() ? archive->directory()->file(path) : nullptr;
+    return file ? openFile(file) : nullptr;
+}
+
+QIODevice *KAsyncArchive::KAsyncArchivePrivate::openFile(const KArchiveFile *file)
+{
+    QIODevice *device = file->createDevice();
+    if (device && !device->isOpen() && !device->open(QIODevice::ReadOnly)) {
+        delete device;
+        device = nullptr;
+    }
+    return device;
+}
+
+KAsyncArchive::KAsyncArchive(KArchive *archive, QThreadPool *pool)
+    : d(new KAsyncArchivePrivate(archive, pool))
+{
+    Q_ASSERT(archive);
+}
+
+KAsyncArchive::~KAsyncArchive()
+{
+    {
+        QMutexLocker locker(&d->mutex);
+        while (d->running) {
+            d->idle.wait(&d->mutex);
+        }
+    }
+    delete d;
+}
+
+KArchive *KAsyncArchive::archive() const
+{
+    return d->archive;
+}
+
+KArchiveTask<bool> KAsyncArchive::open(QIODevice::OpenMode mode)
+{
+    KArchive *archive = d->archive;
+    co_return co_await d->run([archive, mode] {
+        return archive->open(mode);
+    });
+}
+
+KArchiveTask<bool> KAsyncArchive::close()
+{
+    KArchive *archive = d->archive;
+    co_return co_await d->run([archive] {
+        return archive->close();
+    });
+}
+
+KArchiveTask<QByteArray> KAsyncArchive::readFile(QString path)
+{
+    KArchive *archive = d->archive;
+    co_return co_await d->run([archive, path] {
+        const KArchiveFile *file = archive->isOpen() ? archive->directory()->file(path) : nullptr;
+        return file ? file->data() : QByteArray();
+    });
+}
+
+KArchiveTask<bool> KAsyncArchive::readChunks(QString path, std::function<bool(const QByteArray &chunk)> visitor, qint64 chunkSize)
+{
+    KArchive *archive = d->archive;
+    std::shared_ptr<QIODevice> input = co_await d->run([archive, path] {
+        return std::shared_ptr<QIODevice>(KAsyncArchivePrivate::openFile(archive, path));
+    });
+    if (!input) {
+        co_return false;
+    }
+
+    // Only the jobs own the device, so that it is deleted in the thread pool like it is used
+    QIODevice *device = input.get();
+    chunkSize = qBound<qint64>(1, chunkSize, std::numeric_limits<int>::max());
+    auto readChunk = [device, chunkSize]() -> std::optional<QByteArray> {
+        QByteArray chunk(int(chunkSize), Qt::Uninitialized);
+        const qint64 n = device->read(chunk.data(), chunkSize);
+        if (n < 0) {
+            return std::nullopt;
+        }
+        chunk.truncate(n);
+        return chunk;
+    };
+
+    bool ok = true;
+    auto next = d->run(readChunk);
+    for (;;) {
+        const std::optional<QByteArray> chunk = co_await next;
+        if (!chunk) {
+            ok = false;
+            break;
+        }
+        if (chunk->isEmpty()) {
+            break;
+        }
+        next = d->run(readChunk);
+        if (!visitor(*chunk)) {
+            ok = false;
+            break;
+        }
+    }
+
+    co_await d->run([input = std::move(input)]() mutable {
+        input.reset();
+        return true;
+    });
+    co_return ok;
+}
+
+KArchiveTask<bool> KAsyncArchive::extract(QString path, QString dest)
+{
+    KArchive *archive = d->archive;
+    const KArchiveEntry *entry = co_await d->run([archive, path]() -> const KArchiveEntry * {
+        return archive->isOpen() ? archive->directory()->entry(path) : nullptr;
+    });
+    if (!entry) {
+        co_return false;
+    }
+    if (!entry->isDirectory()) {
+        co_return co_await d->copyFile(static_cast<const KArchiveFile *>(entry), dest);
+    }
+
+    // The directories and symlinks first, in a single job, then the files one chunk at a time
+    const std::optional<QVector<KArchiveFileCopy>> files = co_await d->run([entry, dest]() -> std::optional<QVector<KArchiveFileCopy>> {
+        QVector<KArchiveFileCopy> files;
+        if (!KArchivePrivate::prepareCopyTo(static_cast<const KArchiveDirectory *>(entry), dest, true, &files)) {
+            return std::nullopt;
+        }
+        return files;
+    });
+    if (!files) {
+        co_return false;
+    }
+    for (const KArchiveFileCopy &file : *files) {
+        if (!co_await d->copyFile(file.file, file.dirName)) {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+KArchiveTask<bool> KAsyncArchive::KAsyncArchivePrivate::copyFile(const KArchiveFile *file, QString dest)
+{
+    std::shared_ptr<KAsyncFileCopy> copy = co_await run([file, dest] {
+        auto copy = std::make_shared<KAsyncFileCopy>();
+        copy->input.reset(KAsyncArchivePrivate::openFile(file));
+        copy->output.setFileName(dest + u'/' + file->name());
+        if (!copy->input || !copy->output.open(QIODevice::ReadWrite | QIODevice::Truncate)) {
+            return std::shared_ptr<KAsyncFileCopy>();
+        }
+        copy->buffer.resize(int(qMin(s_extractChunkSize, qMax<qint64>(file->size(), 1))));
+        return copy;
+    });
+    if (!copy) {
+        co_return false;
+    }
+
+    KAsyncFileCopy *state = copy.get();
+    qint64 copied;
+    do {
+        copied = co_await run([state] {
+            const qint64 n = state->input->read(state->buffer.data(), state->buffer.size());
+            if (n > 0 && state->output.write(state->buffer.constData(), n) != n) {
+                return qint64(-1);
+            }
+            return n;
+        });
+    } while (copied > 0);
+
+    const bool ok = copied == 0;
+    co_return co_await run([copy = std::move(copy), file, ok]() mutable {
+        if (ok) {
+            copy->output.setPermissions(KArchivePrivate::withExecutablePerms(copy->output.permissions(), file->permissions()));
+            copy->output.close();
+        } else {
+            copy->output.remove();
+        }
+        copy.reset();
+        return ok;
+    });
+}
+
+KArchiveTask<bool> KAsyncArchive::addLocalFile(QString fileName, QString destName)
+{
+    KArchive *archive = d->archive;
+    co_return co_await d->run([archive, fileName, destName] {
+        return archive->addLocalFile(fileName, destName);
+    });
+}
+
+KArchiveTask<bool> KAsyncArchive::addLocalDirectory(QString path, QString destName)
+{
+    KArchive *archive = d->archive;
+    co_return co_await d->run([archive, path, destName] {
+        return archive->addLocalDirectory(path, destName);
+    });
+}
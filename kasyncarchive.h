@@ -0,0 +1,293 @@
+/* This file is part of the KDE libraries
+   SPDX-FileCopyrightText: 2021 KArchive authors
+
+   SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+
+#pragma once
+
+#include "karchive_global.h"
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qiodevice.h>
+#include <QtCore/qstring.h>
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+
+class KArchive;
+class QThreadPool;
+
+/**
+ * @internal
+ */
+namespace KArchiveTaskPrivate
+{
+template<typename T>
+class Result
+{
+public:
+    void return_value(T value)
+    {
+        m_value = std::move(value);
+    }
+
+    T takeResult()
+    {
+        return std::move(*m_value);
+    }
+
+private:
+    std::optional<T> m_value;
+};
+
+template<>
+class Result<void>
+{
+public:
+    void return_void()
+    {
+    }
+
+    void takeResult()
+    {
+    }
+};
+}
+
+/**
+ * @class KArchiveTask kasyncarchive.h KArchiveTask
+ *
+ * The result of a coroutine, to be awaited with @c co_await. The operations of KAsyncArchive
+ * return it, and it can be the return type of the coroutines calling them.
+ *
+ * The coroutine starts running as soon as it is called, up to its first suspension.
+ * Destroying the task without awaiting it lets the coroutine run to completion on its own.
+ * A task can only be awaited once.
+ *
+ * @since 5.86
+ */
+template<typename T>
+class KArchiveTask
+{
+public:
+    class promise_type : public KArchiveTaskPrivate::Result<T>
+    {
+    public:
+        KArchiveTask get_return_object()
+        {
+            return KArchiveTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        auto final_suspend() noexcept
+        {
+            struct FinalAwaiter {
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                // Whichever of the end of the coroutine and the await (or the destruction of the task) comes second carries on
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+                {
+                    promise_type &promise = handle.promise();
+                    if (!promise.m_handshake.exchange(true, std::memory_order_acq_rel)) {
+                        return std::noop_coroutine();
+                    }
+                    if (promise.m_detached) {
+                        handle.destroy();
+                        return std::noop_coroutine();
+                    }
+                    return promise.m_continuation;
+                }
+
+                void await_resume() noexcept
+                {
+                }
+            };
+            return FinalAwaiter{};
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+
+    private:
+        friend class KArchiveTask;
+        std::coroutine_handle<> m_continuation;
+        bool m_detached = false;
+        std::atomic<bool> m_handshake{false};
+    };
+
+    KArchiveTask(KArchiveTask &&other) noexcept
+        : m_handle(std::exchange(other.m_handle, nullptr))
+    {
+    }
+
+    KArchiveTask(const KArchiveTask &) = delete;
+    KArchiveTask &operator=(const KArchiveTask &) = delete;
+    KArchiveTask &operator=(KArchiveTask &&) = delete;
+
+    ~KArchiveTask()
+    {
+        if (!m_handle) {
+            return;
+        }
+        promise_type &promise = m_handle.promise();
+        promise.m_detached = true;
+        if (promise.m_handshake.exchange(true, std::memory_order_acq_rel)) {
+            m_handle.destroy();
+        }
+    }
+
+    auto operator co_await() const noexcept
+    {
+        struct Awaiter {
+            bool await_ready() const noexcept
+            {
+                return handle.promise().m_handshake.load(std::memory_order_acquire);
+            }
+
+            bool await_suspend(std::coroutine_handle<> continuation) noexcept
+            {
+                promise_type &promise = handle.promise();
+                promise.m_continuation = continuation;
+                return !promise.m_handshake.exchange(true, std::memory_order_acq_rel);
+            }
+
+            T await_resume()
+            {
+                return handle.promise().takeResult();
+            }
+
+            std::coroutine_handle<promise_type> handle;
+        };
+        return Awaiter{m_handle};
+    }
+
+private:
+    explicit KArchiveTask(std::coroutine_handle<promise_type> handle)
+        : m_handle(handle)
+    {
+    }
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+/**
+ * @class KAsyncArchive kasyncarchive.h KAsyncArchive
+ *
+ * Runs the blocking operations of a KArchive in a thread pool, for C++20 coroutines.
+ *
+ * Each operation returns a KArchiveTask to @c co_await. The operations of an archive run
+ * one after the other, in the order they were started, while those of different archives
+ * run in parallel. Files are read and extracted chunk by chunk, one job per chunk, so a
+ * single thread can drive many archives at once, and its event loop keeps running.
+ *
+ * The awaiting coroutine is resumed in the thread it was suspended in, through the event
+ * loop of that thread. Threads without an event dispatcher are resumed in the thread pool instead.
+ *
+ * @code
+ * KArchiveTask<bool> hashFile(KAsyncArchive &archive, QString path)
+ * {
+ *     if (!co_await archive.open(QIODevice::ReadOnly)) {
+ *         qWarning() << archive.archive()->errorString();
+ *         co_return false;
+ *     }
+ *     QCryptographicHash hash(QCryptographicHash::Sha256);
+ *     const bool ok = co_await archive.readChunks(path, [&hash](const QByteArray &chunk) {
+ *         hash.addData(chunk);
+ *         return true;
+ *     });
+ *     co_await archive.close();
+ *     co_return ok;
+ * }
+ * @endcode
+ *
+ * The KArchive must not be used directly while operations are pending, and both it and the
+ * KAsyncArchive must outlive the coroutines that use them. Errors are reported by
+ * KArchive::errorString(), as with the blocking API.
+ *
+ * @short Awaitable operations on an archive.
+ * @since 5.86
+ */
+class KARCHIVE_API KAsyncArchive
+{
+    Q_DISABLE_COPY_MOVE(KAsyncArchive)
+
+public:
+    /**
+     * Runs the operations on @p archive, which isn't owned, in @p pool.
+     * @param pool the thread pool, QThreadPool::globalInstance() if null
+     */
+    explicit KAsyncArchive(KArchive *archive, QThreadPool *pool = nullptr);
+
+    /**
+     * Waits for the operations already started to finish.
+     */
+    ~KAsyncArchive();
+
+    /**
+     * Returns the archive the operations run on.
+     */
+    KArchive *archive() const;
+
+    /**
+     * Opens the archive, see KArchive::open().
+     */
+    KArchiveTask<bool> open(QIODevice::OpenMode mode);
+
+    /**
+     * Closes the archive, see KArchive::close().
+     */
+    KArchiveTask<bool> close();
+
+    /**
+     * Returns the content of the file at @p path, relative to the root directory of the archive.
+     * The result is empty if there is no such file.
+     */
+    KArchiveTask<QByteArray> readFile(QString path);
+
+    /**
+     * Reads the file at @p path chunk by chunk, and passes the chunks to @p visitor in the awaiting thread.
+     *
+     * The next chunk is read while @p visitor handles the current one.
+     *
+     * @param visitor returns false to stop reading
+     * @param chunkSize the size of the chunks, all but the last one
+     * @return true if the whole file was read, false if there is no such file, on errors, or if @p visitor stopped the reading
+     */
+    KArchiveTask<bool> readChunks(QString path, std::function<bool(const QByteArray &chunk)> visitor, qint64 chunkSize = 1024 * 1024);
+
+    /**
+     * Extracts the file or the directory at @p path into the directory @p dest.
+     * The contents of a directory are extracted as KArchiveDirectory::copyTo() does: its
+     * subdirectories and symlinks in a single job, then its files in the order of their data.
+     * Files are copied chunk by chunk, one job per chunk, like a single file.
+     */
+    KArchiveTask<bool> extract(QString path, QString dest);
+
+    /**
+     * Adds a local file to the archive, see KArchive::addLocalFile().
+     */
+    KArchiveTask<bool> addLocalFile(QString fileName, QString destName);
+
+    /**
+     * Adds a local directory to the archive, see KArchive::addLocalDirectory().
+     */
+    KArchiveTask<bool> addLocalDirectory(QString path, QString destName);
+
+private:
+    class KAsyncArchivePrivate;
+    KAsyncArchivePrivate *const d;
+};
@@ -17,10 +17,20 @@
 #include <QtCore/qdebug.h>
 #include <QtCore/qfile.h>
 #include <QtCore/qmimedatabase.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qqueue.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qwaitcondition.h>
 
+#include <atomic>
 #include <cassert>
 #include <cstdio> // for EOF
 #include <cstdlib>
+#include <cstring>
+
+class KCompressionDeviceReader;
+class KCompressionDeviceWriter;
 
 class KCompressionDevicePrivate
 {
@@ -33,11 +43,23 @@ public:
         , type(KCompressionDevice::CompressionType::None)
         , errorCode(QFileDevice::NoError)
         , deviceReadPos(0)
+        , writeQueueDepth(0)
+        , writer(nullptr)
+        , readAheadDepth(0)
+        , reader(nullptr)
+        , initialBufferSize(DEFAULT_BUFFER_SIZE)
+        , bufferSize(DEFAULT_BUFFER_SIZE)
         , q(q)
     {
     }
 
     void propagateErrorCode();
+    qint64 compress(const char *data, qint64 len);
+    bool finishAsynchronousWrite();
+    qint64 uncompress(char *data, qint64 maxlen);
+    void startReadAhead();
+    void stopReadAhead();
+    void growBuffer();
 
     bool bNeedHeader;
     bool bSkipHeaders;
@@ -49,9 +71,309 @@ public:
     KCompressionDevice::CompressionType type;
     QFileDevice::FileError errorCode;
     qint64 deviceReadPos;
+    int writeQueueDepth; // 0 when compressing synchronously
+    KCompressionDeviceWriter *writer;
+    int readAheadDepth; // 0 when decompressing on demand
+    KCompressionDeviceReader *reader;
+    int initialBufferSize; // as set by setBufferSize()
+    // Current size, grows while the codec keeps up. Grown by the writer or read-ahead thread
+    // when there is one, while bufferSize() reads it from the thread of the device
+    std::atomic<int> bufferSize;
     KCompressionDevice *q;
 };
 
+/**
+ * Compresses the data written to a KCompressionDevice in a separate thread.
+ *
+ * write() copies the data into a staging buffer, which is handed over to the thread
+ * once full. The thread compresses it and writes it to the underlying device, so that
+ * compression and I/O overlap with the work done by the caller.
+ * At most queueDepth full buffers are waiting at any time, write() blocks beyond that.
+ */
+class KCompressionDeviceWriter : public QThread
+{
+    Q_DISABLE_COPY_MOVE(KCompressionDeviceWriter)
+public:
+    explicit KCompressionDeviceWriter(KCompressionDevicePrivate *d, int queueDepth, int bufferSize)
+        : d(d)
+        , queueDepth(queueDepth)
+        , bufferSize(bufferSize)
+        , finishing(false)
+        , failed(false)
+    {
+    }
+
+    // Called from the thread owning the device
+    bool write(const char *data, qint64 len)
+    {
+        while (len > 0) {
+            if (current.isNull()) {
+                current = takeFreeBuffer();
+            }
+            const qint64 n = qMin(len, qint64(bufferSize - current.size()));
+            current.append(data, n);
+            data += n;
+            len -= n;
+            if (current.size() == bufferSize && !flush()) {
+                return false;
+            }
+        }
+        QMutexLocker locker(&mutex);
+        return !failed;
+    }
+
+    // Called from the thread owning the device, waits until all data was written
+    bool finish()
+    {
+        const bool ok = current.isEmpty() || flush();
+        {
+            QMutexLocker locker(&mutex);
+            finishing = true;
+            notEmpty.wakeOne();
+        }
+        wait();
+        return ok && !failed;
+    }
+
+protected:
+    void run() override
+    {
+        for (;;) {
+            QByteArray buffer;
+            {
+                QMutexLocker locker(&mutex);
+                while (queue.isEmpty() && !finishing) {
+                    notEmpty.wait(&mutex);
+                }
+                if (queue.isEmpty()) {
+                    break;
+                }
+                buffer = queue.dequeue();
+                notFull.wakeOne();
+            }
+
+            const bool ok = d->compress(buffer.constData(), buffer.size()) == buffer.size();
+
+            QMutexLocker locker(&mutex);
+            if (!ok) {
+                failed = true;
+                notFull.wakeOne();
+                return;
+            }
+            // Recycle the buffer, resize() keeps the allocated memory
+            buffer.resize(0);
+            freeBuffers.append(buffer);
+        }
+
+        if (d->compress(nullptr, 0) < 0 || d->result == KFilterBase::Result::Error) {
+            QMutexLocker locker(&mutex);
+            failed = true;
+        }
+    }
+
+private:
+    QByteArray takeFreeBuffer()
+    {
+        QMutexLocker locker(&mutex);
+        if (!freeBuffers.isEmpty()) {
+            return freeBuffers.takeLast();
+        }
+        QByteArray buffer;
+        buffer.reserve(bufferSize);
+        return buffer;
+    }
+
+    bool flush()
+    {
+        QMutexLocker locker(&mutex);
+        while (queue.size() >= queueDepth && !failed) {
+            notFull.wait(&mutex);
+        }
+        if (failed) {
+            return false;
+        }
+        queue.enqueue(current);
+        current = QByteArray();
+        notEmpty.wakeOne();
+        return true;
+    }
+
+    KCompressionDevicePrivate *const d;
+    const int queueDepth;
+    const int bufferSize;
+    QByteArray current; // being filled by write(), only accessed from the device's thread
+
+    QMutex mutex; // protects everything below
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    QQueue<QByteArray> queue;
+    QVector<QByteArray> freeBuffers;
+    bool finishing;
+    bool failed;
+};
+
+/**
+ * Decompresses the data read from a KCompressionDevice ahead of time, in a separate thread.
+ *
+ * The thread fills up to queueDepth buffers with decompressed data, which read() then
+ * copies out, so that decompression overlaps with the work done by the caller between reads.
+ * cancel() stops the thread, the filter is left at an unspecified position afterwards.
+ */
+class KCompressionDeviceReader : public QThread
+{
+    Q_DISABLE_COPY_MOVE(KCompressionDeviceReader)
+public:
+    explicit KCompressionDeviceReader(KCompressionDevicePrivate *d, int queueDepth, int bufferSize)
+        : d(d)
+        , queueDepth(queueDepth)
+        , bufferSize(bufferSize)
+        , currentPos(0)
+        , finished(false)
+        , failed(false)
+        , cancelled(false)
+    {
+    }
+
+    // Called from the thread owning the device, blocks until maxlen bytes or the end of the stream were read
+    qint64 read(char *data, qint64 maxlen)
+    {
+        qint64 copied = 0;
+        while (copied < maxlen) {
+            if (currentPos == current.size()) {
+                QMutexLocker locker(&mutex);
+                recycleCurrent();
+                while (queue.isEmpty() && !finished) {
+                    notEmpty.wait(&mutex);
+                }
+                if (queue.isEmpty()) {
+                    if (failed && copied == 0) {
+                        return -1;
+                    }
+                    break;
+                }
+                current = queue.dequeue();
+                currentPos = 0;
+                notFull.wakeOne();
+            }
+            const qint64 n = qMin(maxlen - copied, qint64(current.size() - currentPos));
+            memcpy(data + copied, current.constData() + currentPos, n);
+            copied += n;
+            currentPos += n;
+        }
+        return copied;
+    }
+
+    // Called from the thread owning the device
+    bool atEnd()
+    {
+        QMutexLocker locker(&mutex);
+        return currentPos == current.size() && queue.isEmpty() && finished;
+    }
+
+    // Called from the thread owning the device, returns once the thread has stopped
+    void cancel()
+    {
+        {
+            QMutexLocker locker(&mutex);
+            cancelled = true;
+            notFull.wakeOne();
+        }
+        wait();
+    }
+
+protected:
+    void run() override
+    {
+        for (;;) {
+            QByteArray buffer;
+            {
+                QMutexLocker locker(&mutex);
+                while (queue.size() >= queueDepth && !cancelled) {
+                    notFull.wait(&mutex);
+                }
+                if (cancelled) {
+                    return;
+                }
+                if (!freeBuffers.isEmpty()) {
+                    buffer = freeBuffers.takeLast();
+                }
+            }
+            if (buffer.isNull()) {
+                buffer.reserve(bufferSize);
+            }
+            buffer.resize(bufferSize);
+
+            const qint64 n = d->uncompress(buffer.data(), bufferSize);
+
+            QMutexLocker locker(&mutex);
+            if (n > 0) {
+                buffer.resize(n);
+                queue.enqueue(buffer);
+                notEmpty.wakeOne();
+            }
+            // A short read means that we reached the end of the stream, or an error
+            if (n < bufferSize) {
+                finished = true;
+                failed = n < 0 || d->result == KFilterBase::Result::Error;
+                notEmpty.wakeOne();
+                return;
+            }
+        }
+    }
+
+private:
+    // Must be called with the mutex locked
+    void recycleCurrent()
+    {
+        if (!current.isNull()) {
+            // resize() keeps the memory allocated by reserve()
+            current.resize(0);
+            freeBuffers.append(current);
+            current = QByteArray();
+        }
+        currentPos = 0;
+    }
+
+    KCompressionDevicePrivate *const d;
+    const int queueDepth;
+    const int bufferSize;
+    QByteArray current; // being consumed by read(), only accessed from the device's thread
+    qsizetype currentPos;
+
+    QMutex mutex; // protects everything below
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    QQueue<QByteArray> queue;
+    QVector<QByteArray> freeBuffers;
+    bool finished;
+    bool failed;
+    bool cancelled;
+};
+
+void KCompressionDevicePrivate::startReadAhead()
+{
+    Q_ASSERT(!reader);
+    if (readAheadDepth > 0) {
+        reader = new KCompressionDeviceReader(this, readAheadDepth, STAGING_BUFFER_SIZE);
+        reader->start();
+    }
+}
+
+void KCompressionDevicePrivate::stopReadAhead()
+{
+    if (reader) {
+        reader->cancel();
+        delete reader;
+        reader = nullptr;
+    }
+}
+
+void KCompressionDevicePrivate::growBuffer()
+{
+    // Only ever called from one thread at a time, the others merely read the size
+    bufferSize.store(qMin(bufferSize.load(std::memory_order_relaxed) * 2, initialBufferSize * BUFFER_GROWTH_FACTOR), std::memory_order_relaxed);
+}
+
 void KCompressionDevicePrivate::propagateErrorCode()
 {
     QIODevice *dev = filter->device();
@@ -132,6 +454,91 @@ KCompressionDevice::CompressionType KCompressionDevice::compressionTypeForMimeTy
     return KCompressionDevice::CompressionType::None;
 }
 
+// Size of a tar header block, the largest structure we need to look at
+static constexpr int MAGIC_SIZE = 0x200;
+
+static bool isTarHeader(const char *buffer)
+{
+    // The POSIX and GNU formats both have the magic at offset 257
+    if (memcmp(buffer + 257, "ustar", 5) == 0) {
+        return true;
+    }
+    // Old v7 tars have no magic, but a checksum that we can verify (see KTar::KTarPrivate::readRawHeader)
+    if (buffer[0] == 0) {
+        return false;
+    }
+    int check = 0;
+    for (int j = 0; j < MAGIC_SIZE; ++j) {
+        check += static_cast<unsigned char>(buffer[j]);
+    }
+    for (int j = 0; j < 8; ++j) {
+        check -= static_cast<unsigned char>(buffer[148 + j]);
+    }
+    check += 8 * ' ';
+    // Some tars right-justify the checksum, and terminate it with a space and/or a null
+    char field[9];
+    memcpy(field, buffer + 148, 8);
+    field[8] = 0;
+    const char *p = field;
+    while (*p == ' ') {
+        ++p;
+    }
+    char *end = nullptr;
+    const long stored = strtol(p, &end, 8);
+    return end != p && stored == check;
+}
+
+KCompressionDevice::CompressionType KCompressionDevice::compressionTypeForData(const QByteArray &data, bool *ok)
+{
+    const uchar *p = reinterpret_cast<const uchar *>(data.constData());
+    const qsizetype size = data.size();
+    if (ok) {
+        *ok = true;
+    }
+
+    if (size >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+        return KCompressionDevice::CompressionType::GZip;
+    }
+    if (size >= 4 && p[0] == 'B' && p[1] == 'Z' && p[2] == 'h' && p[3] >= '1' && p[3] <= '9') {
+        return KCompressionDevice::CompressionType::BZip2;
+    }
+    if (size >= 6 && memcmp(p, "\xFD" "7zXZ\0", 6) == 0) {
+        return KCompressionDevice::CompressionType::Xz;
+    }
+    // Legacy .lzma streams have no real magic, check the default properties byte
+    // and the low bytes of the dictionary size, like shared-mime-info does
+    if (size >= 13 && p[0] == 0x5d && p[1] == 0x00 && p[2] == 0x00) {
+        return KCompressionDevice::CompressionType::Xz;
+    }
+    if (size >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) {
+        return KCompressionDevice::CompressionType::Zstd;
+    }
+    if (size >= MAGIC_SIZE && isTarHeader(data.constData())) {
+        return KCompressionDevice::CompressionType::None;
+    }
+
+    if (ok) {
+        *ok = false;
+    }
+    return KCompressionDevice::CompressionType::None;
+}
+
+KCompressionDevice::CompressionType KCompressionDevice::compressionTypeForDevice(QIODevice *device, bool *ok)
+{
+    if (!device || !device->isReadable()) {
+        if (ok) {
+            *ok = false;
+        }
+        return KCompressionDevice::CompressionType::None;
+    }
+    return compressionTypeForData(device->peek(MAGIC_SIZE), ok);
+}
+
+int KCompressionDevice::magicSize()
+{
+    return MAGIC_SIZE;
+}
+
 KFilterBase *KCompressionDevice::filterForCompressionType(KCompressionDevice::CompressionType type)
 {
     switch (type) {
@@ -202,11 +609,12 @@ bool KCompressionDevice::open(QIODevice::OpenMode mode)
         return false;
     }
     d->bOpenedUnderlyingDevice = false;
+    d->bufferSize.store(d->initialBufferSize, std::memory_order_relaxed);
     // qCDebug(KArchiveLog) << mode;
     if (mode == QIODevice::ReadOnly) {
         d->buffer.resize(0);
     } else {
-        d->buffer.resize(BUFFER_SIZE);
+        d->buffer.resize(d->initialBufferSize);
         d->filter->setOutBuffer(d->buffer.data(), d->buffer.size());
     }
     if (!d->filter->device()->isOpen()) {
@@ -223,6 +631,13 @@ bool KCompressionDevice::open(QIODevice::OpenMode mode)
         return false;
     }
     d->result = KFilterBase::Result::Ok;
+    if (mode == QIODevice::WriteOnly && d->writeQueueDepth > 0) {
+        d->writer = new KCompressionDeviceWriter(d, d->writeQueueDepth, STAGING_BUFFER_SIZE);
+        d->writer->start();
+    }
+    if (mode == QIODevice::ReadOnly) {
+        d->startReadAhead();
+    }
     setOpenMode(mode);
     return true;
 }
@@ -232,9 +647,12 @@ void KCompressionDevice::close()
     if (!isOpen()) {
         return;
     }
-    if (d->filter->mode() == QIODevice::WriteOnly && d->errorCode == QFileDevice::NoError) {
-        write(nullptr, 0); // finish writing
+    // With a writer thread, errorCode can only be looked at once the thread is done
+    if (d->filter->mode() == QIODevice::WriteOnly && (d->writer || d->errorCode == QFileDevice::NoError)) {
+        // finish writing, a failure is reported by error() as the result doesn't tell it apart
+        write(nullptr, 0);
     }
+    d->stopReadAhead();
     // qCDebug(KArchiveLog) << "Calling terminate().";
 
     if (!d->filter->terminate()) {
@@ -268,13 +686,16 @@ bool KCompressionDevice::seek(qint64 pos)
         if (!QIODevice::seek(pos))
             return false;
 
-        // We can forget about the cached data
+        // We can forget about the cached data, including what was read ahead
+        d->stopReadAhead();
         d->bNeedHeader = !d->bSkipHeaders;
         d->result = KFilterBase::Result::Ok;
         d->filter->setInBuffer(nullptr, 0);
         d->filter->reset();
         d->deviceReadPos = 0;
-        return d->filter->device()->reset();
+        const bool ok = d->filter->device()->reset();
+        d->startReadAhead();
+        return ok;
     }
 
     qint64 bytesToRead;
@@ -297,7 +718,8 @@ bool KCompressionDevice::seek(qint64 pos)
     }
 
     // qCDebug(KArchiveLog) << "reading " << bytesToRead << " dummy bytes";
-    QByteArray dummy(qMin(bytesToRead, qint64(SEEK_BUFFER_SIZE)), 0);
+    // The read-ahead thread may be growing the buffer meanwhile, so size this one from the initial size
+    QByteArray dummy(qMin(bytesToRead, qint64(3 * d->initialBufferSize)), 0);
     while (bytesToRead > 0) {
         const qint64 bytesToReadThisTime = qMin(bytesToRead, qint64(dummy.size()));
         const bool result = (read(dummy.data(), bytesToReadThisTime) == bytesToReadThisTime);
@@ -311,6 +733,9 @@ bool KCompressionDevice::seek(qint64 pos)
 
 bool KCompressionDevice::atEnd() const
 {
+    if (d->reader) {
+        return d->reader->atEnd() && QIODevice::atEnd();
+    }
     return (d->type == KCompressionDevice::CompressionType::None || d->result == KFilterBase::Result::End) //
         && QIODevice::atEnd() // take QIODevice's internal buffer into account
         && d->filter->device()->atEnd();
@@ -319,54 +744,82 @@ bool KCompressionDevice::atEnd() const
 qint64 KCompressionDevice::readData(char *data, qint64 maxlen)
 {
     Q_ASSERT(d->filter->mode() == QIODevice::ReadOnly);
+    const qint64 dataReceived = d->reader ? d->reader->read(data, maxlen) : d->uncompress(data, maxlen);
+    if (dataReceived > 0) {
+        d->deviceReadPos += dataReceived;
+    }
+    return dataReceived;
+}
+
+// Decompresses up to maxlen bytes into data, returns the number of bytes produced or -1 on error
+qint64 KCompressionDevicePrivate::uncompress(char *data, qint64 maxlen)
+{
     // qCDebug(KArchiveLog) << "maxlen=" << maxlen;
-    KFilterBase *filter = d->filter;
 
     uint dataReceived = 0;
 
     // We came to the end of the stream
-    if (d->result == KFilterBase::Result::End) {
+    if (result == KFilterBase::Result::End) {
         return dataReceived;
     }
 
     // If we had an error, return -1.
-    if (d->result != KFilterBase::Result::Ok) {
+    if (result != KFilterBase::Result::Ok) {
         return -1;
     }
 
+    if (type == KCompressionDevice::CompressionType::None) {
+        // Nothing to decode, read straight into the caller's buffer instead of going through KNoneFilter
+        const qint64 size = filter->device()->read(data, maxlen);
+        if (size < 0) {
+            result = KFilterBase::Result::Error;
+            return -1;
+        }
+        if (size < maxlen && filter->device()->atEnd()) {
+            result = KFilterBase::Result::End;
+        }
+        return size;
+    }
+
     qint64 availOut = maxlen;
     filter->setOutBuffer(data, maxlen);
 
+    bool consumedFullBuffer = false;
     while (dataReceived < maxlen) {
         if (filter->inBufferEmpty()) {
+            // The codec went through a whole buffer and wants more, read bigger chunks from now on.
             // Not sure about the best size to set there.
             // For sure, it should be bigger than the header size (see comment in readHeader)
-            d->buffer.resize(BUFFER_SIZE);
+            if (consumedFullBuffer) {
+                growBuffer();
+            }
+            buffer.resize(bufferSize.load(std::memory_order_relaxed));
             // Request data from underlying device
-            int size = filter->device()->read(d->buffer.data(), d->buffer.size());
+            int size = filter->device()->read(buffer.data(), buffer.size());
             // qCDebug(KArchiveLog) << "got" << size << "bytes from device";
+            consumedFullBuffer = (size == buffer.size());
             if (size) {
-                filter->setInBuffer(d->buffer.data(), size);
+                filter->setInBuffer(buffer.data(), size);
             } else {
                 // Not enough data available in underlying device for now
                 break;
             }
         }
-        if (d->bNeedHeader) {
+        if (bNeedHeader) {
             (void)filter->readHeader();
-            d->bNeedHeader = false;
+            bNeedHeader = false;
         }
 
-        d->result = filter->uncompress();
+        result = filter->uncompress();
 
-        if (d->result == KFilterBase::Result::Error) {
+        if (result == KFilterBase::Result::Error) {
             // qCWarning(KArchiveLog) << "KCompressionDevice: Error when uncompressing data";
             break;
         }
 
         // We got that much data since the last time we went here
         uint outReceived = availOut - filter->outBufferAvailable();
-        // qCDebug(KArchiveLog) << "avail_out = " << filter->outBufferAvailable() << " result=" << d->result << " outReceived=" << outReceived;
+        // qCDebug(KArchiveLog) << "avail_out = " << filter->outBufferAvailable() << " result=" << result << " outReceived=" << outReceived;
         if (availOut < uint(filter->outBufferAvailable())) {
             // qCWarning(KArchiveLog) << " last availOut " << availOut << " smaller than new avail_out=" << filter->outBufferAvailable() << " !";
         }
@@ -374,7 +827,7 @@ qint64 KCompressionDevice::readData(char *data, qint64 maxlen)
         dataReceived += outReceived;
         data += outReceived;
         availOut = maxlen - dataReceived;
-        if (d->result == KFilterBase::Result::End) {
+        if (result == KFilterBase::Result::End) {
             // We're actually at the end, no more data to check
             if (filter->device()->atEnd()) {
                 break;
@@ -386,77 +839,127 @@ qint64 KCompressionDevice::readData(char *data, qint64 maxlen)
         filter->setOutBuffer(data, availOut);
     }
 
-    d->deviceReadPos += dataReceived;
     return dataReceived;
 }
 
 qint64 KCompressionDevice::writeData(const char *data /*0 to finish*/, qint64 len)
 {
-    KFilterBase *filter = d->filter;
-    Q_ASSERT(filter->mode() == QIODevice::WriteOnly);
+    Q_ASSERT(d->filter->mode() == QIODevice::WriteOnly);
+
+    if (d->writer) {
+        const bool ok = data ? d->writer->write(data, len) : d->finishAsynchronousWrite();
+        if (!ok) {
+            // The writer thread is done, errorCode is safe to look at
+            if (d->errorCode == QFileDevice::WriteError) {
+                setErrorString(tr("Could not write. Partition full?"));
+            } else {
+                d->errorCode = QFileDevice::UnspecifiedError;
+                setErrorString(tr("Could not compress the data"));
+            }
+            return data ? -1 : 0;
+        }
+        return len;
+    }
+
+    const qint64 written = d->compress(data, len);
+    if (written < 0) {
+        setErrorString(tr("Could not write. Partition full?"));
+        return 0; // indicate an error
+    }
+    return written;
+}
+
+bool KCompressionDevicePrivate::finishAsynchronousWrite()
+{
+    const bool ok = writer->finish();
+    delete writer;
+    writer = nullptr;
+    return ok;
+}
+
+// Compresses data and writes it to the underlying device, finishes the stream if data is null.
+// Returns the number of bytes consumed, or -1 if writing to the underlying device failed.
+qint64 KCompressionDevicePrivate::compress(const char *data, qint64 len)
+{
     // If we had an error, return 0.
-    if (d->result != KFilterBase::Result::Ok) {
+    if (result != KFilterBase::Result::Ok) {
         return 0;
     }
 
+    if (type == KCompressionDevice::CompressionType::None) {
+        // Nothing to encode, write straight from the caller's buffer instead of going through KNoneFilter
+        if (!data) {
+            result = KFilterBase::Result::End;
+            return 0;
+        }
+        if (filter->device()->write(data, len) != len) {
+            errorCode = QFileDevice::WriteError;
+            return -1;
+        }
+        return len;
+    }
+
     bool finish = (data == nullptr);
     if (!finish) {
         filter->setInBuffer(data, len);
-        if (d->bNeedHeader) {
-            (void)filter->writeHeader(d->origFileName);
-            d->bNeedHeader = false;
+        if (bNeedHeader) {
+            (void)filter->writeHeader(origFileName);
+            bNeedHeader = false;
         }
     }
 
     uint dataWritten = 0;
     uint availIn = len;
     while (dataWritten < len || finish) {
-        d->result = filter->compress(finish);
+        result = filter->compress(finish);
 
-        if (d->result == KFilterBase::Result::Error) {
+        if (result == KFilterBase::Result::Error) {
             // qCWarning(KArchiveLog) << "KCompressionDevice: Error when compressing data";
             // What to do ?
             break;
         }
 
         // Wrote everything ?
-        if (filter->inBufferEmpty() || (d->result == KFilterBase::Result::End)) {
+        if (filter->inBufferEmpty() || (result == KFilterBase::Result::End)) {
             // We got that much data since the last time we went here
             uint wrote = availIn - filter->inBufferAvailable();
 
-            // qCDebug(KArchiveLog) << " Wrote everything for now. avail_in=" << filter->inBufferAvailable() << "result=" << d->result << "wrote=" << wrote;
+            // qCDebug(KArchiveLog) << " Wrote everything for now. avail_in=" << filter->inBufferAvailable() << "result=" << result << "wrote=" << wrote;
 
             // Move on in the input buffer
             data += wrote;
             dataWritten += wrote;
 
             availIn = len - dataWritten;
-            // qCDebug(KArchiveLog) << " availIn=" << availIn << "dataWritten=" << dataWritten << "pos=" << pos();
+            // qCDebug(KArchiveLog) << " availIn=" << availIn << "dataWritten=" << dataWritten;
             if (availIn > 0) {
                 filter->setInBuffer(data, availIn);
             }
         }
 
-        if (filter->outBufferFull() || (d->result == KFilterBase::Result::End) || finish) {
+        if (filter->outBufferFull() || (result == KFilterBase::Result::End) || finish) {
             // qCDebug(KArchiveLog) << " writing to underlying. avail_out=" << filter->outBufferAvailable();
-            int towrite = d->buffer.size() - filter->outBufferAvailable();
+            int towrite = buffer.size() - filter->outBufferAvailable();
             if (towrite > 0) {
                 // Write compressed data to underlying device
-                int size = filter->device()->write(d->buffer.data(), towrite);
+                int size = filter->device()->write(buffer.data(), towrite);
                 if (size != towrite) {
                     // qCWarning(KArchiveLog) << "KCompressionDevice::write. Could only write " << size << " out of " << towrite << " bytes";
-                    d->errorCode = QFileDevice::WriteError;
-                    setErrorString(tr("Could not write. Partition full?"));
-                    return 0; // indicate an error
+                    errorCode = QFileDevice::WriteError;
+                    return -1; // indicate an error
                 }
                 // qCDebug(KArchiveLog) << " wrote " << size << " bytes";
             }
-            if (d->result == KFilterBase::Result::End) {
+            if (result == KFilterBase::Result::End) {
                 Q_ASSERT(finish); // hopefully we don't get end before finishing
                 break;
             }
-            d->buffer.resize(BUFFER_SIZE);
-            filter->setOutBuffer(d->buffer.data(), d->buffer.size());
+            // The codec filled a whole buffer and has more to give, write bigger chunks from now on
+            if (towrite == buffer.size() && dataWritten < len) {
+                growBuffer();
+            }
+            buffer.resize(bufferSize.load(std::memory_order_relaxed));
+            filter->setOutBuffer(buffer.data(), buffer.size());
         }
     }
 
@@ -473,6 +976,40 @@ void KCompressionDevice::setSkipHeaders()
     d->bSkipHeaders = true;
 }
 
+void KCompressionDevice::setAsynchronousWrite(bool enabled, int queueDepth)
+{
+    Q_ASSERT(!isOpen());
+    d->writeQueueDepth = enabled ? qMax(1, queueDepth) : 0;
+}
+
+bool KCompressionDevice::isAsynchronousWrite() const
+{
+    return d->writeQueueDepth > 0;
+}
+
+void KCompressionDevice::setReadAheadDepth(int depth)
+{
+    Q_ASSERT(!isOpen());
+    d->readAheadDepth = qMax(0, depth);
+}
+
+int KCompressionDevice::readAheadDepth() const
+{
+    return d->readAheadDepth;
+}
+
+void KCompressionDevice::setBufferSize(int size)
+{
+    Q_ASSERT(!isOpen());
+    d->initialBufferSize = qMax(size, MIN_BUFFER_SIZE);
+    d->bufferSize.store(d->initialBufferSize, std::memory_order_relaxed);
+}
+
+int KCompressionDevice::bufferSize() const
+{
+    return d->bufferSize.load(std::memory_order_relaxed);
+}
+
 KFilterBase *KCompressionDevice::filterBase()
 {
     return d->filter;
@@ -99,6 +99,74 @@ public:
      */
     void setSkipHeaders();
 
+    /**
+     * Call this before open() to compress in a background thread when writing.
+     *
+     * write() then only copies the data into a staging buffer and returns, while
+     * a dedicated thread compresses the filled buffers and writes them to the
+     * underlying device. This allows the CPU-bound compression to overlap with
+     * the I/O, and with whatever work the caller does between writes.
+     * The underlying device must not be used by anyone else until close().
+     *
+     * Errors that happen in the background are reported by the next write(),
+     * or by error() after close().
+     *
+     * @param enabled whether to compress in a background thread
+     * @param queueDepth how many filled buffers may wait for the compression thread
+     * before write() blocks
+     * @since 5.86
+     */
+    void setAsynchronousWrite(bool enabled, int queueDepth = 2);
+
+    /**
+     * Returns whether data is compressed in a background thread when writing.
+     * @see setAsynchronousWrite
+     * @since 5.86
+     */
+    bool isAsynchronousWrite() const;
+
+    /**
+     * Call this before open() to decompress ahead of time in a background thread when reading.
+     *
+     * A dedicated thread then decompresses into a ring of @p depth buffers ahead of the reader,
+     * so that read() mostly copies already decompressed data. Seeking back to the start cancels
+     * the thread and restarts it from there. Forward seeks consume the data read ahead.
+     * The underlying device must not be used by anyone else until close().
+     *
+     * This is meant for files and other devices that never run out of data temporarily.
+     *
+     * @param depth the number of buffers decompressed ahead, 0 (the default) to decompress on demand
+     * @since 5.86
+     */
+    void setReadAheadDepth(int depth);
+
+    /**
+     * Returns the number of buffers decompressed ahead when reading, 0 if disabled.
+     * @see setReadAheadDepth
+     * @since 5.86
+     */
+    int readAheadDepth() const;
+
+    /**
+     * Call this before open() to set the size of the chunks read from, or written to,
+     * the underlying device. The default is 64 KiB.
+     *
+     * The buffer grows, up to 16 times that size, while the codec keeps consuming
+     * (or, when writing, producing) full buffers, to reduce the number of system calls
+     * on fast storage and on network file systems.
+     *
+     * @param size the initial buffer size in bytes, at least 4 KiB
+     * @since 5.86
+     */
+    void setBufferSize(int size);
+
+    /**
+     * Returns the current size of the chunks read from, or written to, the underlying device.
+     * @see setBufferSize
+     * @since 5.86
+     */
+    int bufferSize() const;
+
     /**
      * That one can be quite slow, when going back. Use with care.
      */
@@ -121,6 +189,32 @@ public:
      */
     static CompressionType compressionTypeForMimeType(const QString &mimetype);
 
+    /**
+     * Returns the compression type detected from the magic bytes at the start of @p data.
+     * This recognizes gzip, bzip2, xz, lzma and zstd streams, as well as uncompressed
+     * tar archives (reported as None). It is much cheaper than going through QMimeDatabase,
+     * which only needs to be consulted when this method can't decide.
+     *
+     * @param data the first bytes of the stream, at least magicSize() bytes are needed
+     * to recognize an uncompressed tar archive
+     * @param ok if not null, set to false if the content couldn't be identified
+     * @since 5.86
+     */
+    static CompressionType compressionTypeForData(const QByteArray &data, bool *ok = nullptr);
+
+    /**
+     * Convenience overload, peeks at the first bytes of @p device without consuming them.
+     * The device must be open for reading.
+     * @since 5.86
+     */
+    static CompressionType compressionTypeForDevice(QIODevice *device, bool *ok = nullptr);
+
+    /**
+     * The number of leading bytes compressionTypeForData() looks at.
+     * @since 5.86
+     */
+    static int magicSize();
+
     /**
      * Returns the error code from the last failing operation.
      * This is especially useful after calling close(), which unfortunately returns void
@@ -7,5 +7,10 @@
 
 #pragma once
 
-static constexpr int BUFFER_SIZE = (8 * 1024);
-static constexpr int SEEK_BUFFER_SIZE = (3 * BUFFER_SIZE);
+// Initial size of the buffer used for reading from/writing to the underlying device,
+// see KCompressionDevice::setBufferSize. It grows up to BUFFER_GROWTH_FACTOR times that.
+static constexpr int DEFAULT_BUFFER_SIZE = (64 * 1024);
+static constexpr int MIN_BUFFER_SIZE = (4 * 1024);
+static constexpr int BUFFER_GROWTH_FACTOR = 16;
+// Size of the chunks handed over to/from the compression threads, see KCompressionDevice::setAsynchronousWrite
+static constexpr int STAGING_BUFFER_SIZE = (64 * 1024);
@@ -137,6 +137,11 @@ void KRcc::KRccPrivate::createEntries(const QDir &dir, KArchiveDirectory *parent
         const QString entryPath = dir.path() + u'/' + fileName;
         const QFileInfo info(entryPath);
         if (info.isFile()) {
+            // The path below ":" + m_prefix + "/"
+            const KArchiveEntryFilter *filter = KArchivePrivate::entryFilter(q);
+            if (filter && !filter->matches(QStringView(entryPath).mid(m_prefix.size() + 2).toUtf8())) {
+                continue;
+            }
             KArchiveEntry *entry = new KRccFileEntry(q, fileName, 0444, info.lastModified(), parentDir->user(), parentDir->group(), info.size(), entryPath);
             parentDir->addEntry(entry);
         } else {
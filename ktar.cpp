@@ -34,9 +34,120 @@ namespace MimeType
 {
 QString application_gzip()     { return QStringLiteral("application/gzip"); }
 QString application_gzip_old() { return QStringLiteral("application/x-gzip"); }
+QString application_tar()      { return QStringLiteral("application/x-tar"); }
 }
 /* clang-format on */
 
+// Maps the result of KCompressionDevice::compressionTypeForData back to the names used in d->mimetype
+static QString mimeTypeForCompressionType(KCompressionDevice::CompressionType type)
+{
+    switch (type) {
+    case KCompressionDevice::CompressionType::GZip:
+        return MimeType::application_gzip_old();
+    case KCompressionDevice::CompressionType::BZip2:
+        return QLatin1String(application_bzip);
+    case KCompressionDevice::CompressionType::Xz:
+        return QLatin1String(application_xz);
+    case KCompressionDevice::CompressionType::Zstd:
+        return QLatin1String(application_zstd);
+    case KCompressionDevice::CompressionType::None:
+        return MimeType::application_tar();
+    }
+    return QString();
+}
+
+// Decompresses the tar file fileName into out, returns an error message on failure
+static QString decompressTarFile(const QString &fileName, KCompressionDevice::CompressionType compressionType, QIODevice *out)
+{
+    KCompressionDevice filterDev(fileName, compressionType);
+    QByteArray buffer;
+    buffer.resize(8 * 1024);
+    if (!filterDev.open(QIODevice::ReadOnly)) {
+        return KTar::tr("File %1 does not exist").arg(fileName);
+    }
+    qint64 len = -1;
+    while (!filterDev.atEnd() && len != 0) {
+        len = filterDev.read(buffer.data(), buffer.size());
+        if (len < 0) { // corrupted archive
+            return KTar::tr("Archive %1 is corrupt").arg(fileName);
+        }
+        if (out->write(buffer.data(), len) != len) { // disk full
+            return KTar::tr("Disk full");
+        }
+    }
+    return QString();
+}
+
+/**
+ * The temporary file a compressed tar file is decompressed into.
+ *
+ * When the entries come from the catalogue cache, the tar file is only decompressed
+ * on the first read, or size query, of the temporary file, see fillLazily().
+ */
+class KTarTemporaryFile : public QTemporaryFile
+{
+    Q_DISABLE_COPY_MOVE(KTarTemporaryFile)
+public:
+    KTarTemporaryFile()
+        : m_compressionType(KCompressionDevice::CompressionType::None)
+        , m_pending(false)
+        , m_failed(false)
+    {
+    }
+
+    // Decompresses fileName into this file when it is first read from
+    void fillLazily(const QString &fileName, KCompressionDevice::CompressionType compressionType)
+    {
+        m_sourceFileName = fileName;
+        m_compressionType = compressionType;
+        m_pending = true;
+    }
+
+    qint64 size() const override
+    {
+        if (!const_cast<KTarTemporaryFile *>(this)->fill()) {
+            return 0;
+        }
+        return QTemporaryFile::size();
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxlen) override
+    {
+        if (!fill()) {
+            return -1;
+        }
+        return QTemporaryFile::readData(data, maxlen);
+    }
+
+private:
+    bool fill()
+    {
+        if (m_pending) {
+            m_pending = false;
+            // Through a handle of its own, this one may be in the middle of a read or a seek
+            QFile out(fileName());
+            QString errorMessage;
+            if (!out.open(QIODevice::WriteOnly)) {
+                errorMessage = out.errorString();
+            } else {
+                errorMessage = decompressTarFile(m_sourceFileName, m_compressionType, &out);
+            }
+            if (!errorMessage.isEmpty() || !out.flush()) {
+                qCWarning(KArchiveLog) << "Could not decompress" << m_sourceFileName << errorMessage;
+                setErrorString(errorMessage);
+                m_failed = true;
+            }
+        }
+        return !m_failed;
+    }
+
+    QString m_sourceFileName;
+    KCompressionDevice::CompressionType m_compressionType;
+    bool m_pending;
+    bool m_failed;
+};
+
 class Q_DECL_HIDDEN KTar::KTarPrivate
 {
     Q_DISABLE_COPY_MOVE(KTarPrivate)
@@ -46,16 +157,18 @@ public:
         , tarEnd(0)
         , tmpFile(nullptr)
         , compressionDevice(nullptr)
+        , tempFileUsed(true)
     {
     }
 
     KTar *q;
     QStringList dirList;
     qint64 tarEnd;
-    QTemporaryFile *tmpFile;
+    KTarTemporaryFile *tmpFile;
     QString mimetype;
     QByteArray origFileName;
     KCompressionDevice *compressionDevice;
+    bool tempFileUsed;
 
     bool fillTempFile(const QString &fileName);
     bool writeBackTempFile(const QString &fileName);
@@ -63,7 +176,7 @@ public:
     void writeLonglink(char *buffer, const QByteArray &name, char typeflag, const char *uname, const char *gname);
     qint64 readRawHeader(char *buffer);
     bool readLonglink(char *buffer, QByteArray &longlink);
-    qint64 readHeader(char *buffer, QString &name, QString &symlink);
+    qint64 readHeader(char *buffer, QByteArray &name, QByteArray &symlink);
 };
 
 KTar::KTar(const QString &fileName, const QString &_mimetype)
@@ -90,14 +203,26 @@ KTar::KTar(QIODevice *dev)
 // Only called when a filename was given
 bool KTar::createDevice(QIODevice::OpenMode mode)
 {
+    if (d->mimetype.isEmpty() && mode != QIODevice::WriteOnly) {
+        // Give priority to file contents: if someone renames a .tar.bz2 to .tar.gz,
+        // we can still do the right thing here.
+        // Sniffing the magic bytes ourselves is much cheaper than loading the MIME database.
+        QFile f(fileName());
+        if (f.open(QIODevice::ReadOnly)) {
+            bool ok = false;
+            const KCompressionDevice::CompressionType type = KCompressionDevice::compressionTypeForData(f.read(KCompressionDevice::magicSize()), &ok);
+            if (ok) {
+                d->mimetype = mimeTypeForCompressionType(type);
+            }
+        }
+    }
+
     if (d->mimetype.isEmpty()) {
         // Find out mimetype manually
 
         QMimeDatabase db;
         QMimeType mime;
         if (mode != QIODevice::WriteOnly && QFile::exists(fileName())) {
-            // Give priority to file contents: if someone renames a .tar.bz2 to .tar.gz,
-            // we can still do the right thing here.
             QFile f(fileName());
             if (f.open(QIODevice::ReadOnly)) {
                 mime = db.mimeTypeForData(&f);
@@ -130,7 +255,7 @@ bool KTar::createDevice(QIODevice::OpenMode mode)
         }
     }
 
-    if (d->mimetype == QStringLiteral("application/x-tar")) {
+    if (d->mimetype == MimeType::application_tar()) {
         return KArchive::createDevice(mode);
     } else if (mode == QIODevice::WriteOnly) {
         if (!KArchive::createDevice(mode)) {
@@ -144,6 +269,12 @@ bool KTar::createDevice(QIODevice::OpenMode mode)
             setDevice(d->compressionDevice);
         }
         return true;
+    } else if (mode == QIODevice::ReadOnly && !d->tempFileUsed) {
+        // Decompress while reading instead, see setTemporaryFileUsed()
+        delete d->compressionDevice;
+        d->compressionDevice = new KCompressionDevice(fileName(), KCompressionDevice::compressionTypeForMimeType(d->mimetype));
+        setDevice(d->compressionDevice);
+        return true;
     } else {
         // The compression filters are very slow with random access.
         // So instead of applying the filter to the device,
@@ -156,7 +287,7 @@ bool KTar::createDevice(QIODevice::OpenMode mode)
         // Which is in fact nearly as slow as a complete decompression for each file.
 
         Q_ASSERT(!d->tmpFile);
-        d->tmpFile = new QTemporaryFile();
+        d->tmpFile = new KTarTemporaryFile();
         d->tmpFile->setFileTemplate(QDir::tempPath() + u'/' + QStringLiteral("ktar-XXXXXX.tar"));
         d->tmpFile->open();
         // qCDebug(KArchiveLog) << "creating tempfile:" << d->tmpFile->fileName();
@@ -187,6 +318,16 @@ void KTar::setOrigFileName(const QByteArray &fileName)
     d->origFileName = fileName;
 }
 
+void KTar::setTemporaryFileUsed(bool used)
+{
+    d->tempFileUsed = used;
+}
+
+bool KTar::isTemporaryFileUsed() const
+{
+    return d->tempFileUsed;
+}
+
 qint64 KTar::KTarPrivate::readRawHeader(char *buffer)
 {
     // Read header
@@ -273,7 +414,8 @@ bool KTar::KTarPrivate::readLonglink(char *buffer, QByteArray &longlink)
     return true;
 }
 
-qint64 KTar::KTarPrivate::readHeader(char *buffer, QString &name, QString &symlink)
+// Reads the name and the symlink target as they are stored, so that files can be filtered out before decoding them
+qint64 KTar::KTarPrivate::readHeader(char *buffer, QByteArray &name, QByteArray &symlink)
 {
     name.truncate(0);
     symlink.truncate(0);
@@ -290,10 +432,10 @@ qint64 KTar::KTarPrivate::readHeader(char *buffer, QString &name, QString &symli
             if (readLonglink(buffer, longlink)) {
                 switch (typeflag) {
                 case 'L':
-                    name = QFile::decodeName(longlink.constData());
+                    name = longlink;
                     break;
                 case 'K':
-                    symlink = QFile::decodeName(longlink.constData());
+                    symlink = longlink;
                     break;
                 } /*end switch*/
             }
@@ -307,11 +449,11 @@ qint64 KTar::KTarPrivate::readHeader(char *buffer, QString &name, QString &symli
     // there are names that are exactly 100 bytes long
     // and neither longlink nor \0 terminated (bug:101472)
     {
-        name = QFile::decodeName(QByteArray(buffer, qstrnlen(buffer, 100)));
+        name.append(buffer, qstrnlen(buffer, 100));
     }
     if (symlink.isEmpty()) {
-        char *symlinkBuffer = buffer + 0x9d /*?*/;
-        symlink = QFile::decodeName(QByteArray(symlinkBuffer, qstrnlen(symlinkBuffer, 100)));
+        const char *symlinkBuffer = buffer + 0x9d /*?*/;
+        symlink.append(symlinkBuffer, qstrnlen(symlinkBuffer, 100));
     }
 
     return 0x200;
@@ -330,32 +472,15 @@ bool KTar::KTarPrivate::fillTempFile(const QString &fileName)
 
     // qCDebug(KArchiveLog) << "filling tmpFile of mimetype" << mimetype;
 
-    KCompressionDevice::CompressionType compressionType = KCompressionDevice::compressionTypeForMimeType(mimetype);
-    KCompressionDevice filterDev(fileName, compressionType);
-
     QFile *file = tmpFile;
     Q_ASSERT(file->isOpen());
     Q_ASSERT(file->openMode() & QIODevice::WriteOnly);
     file->seek(0);
-    QByteArray buffer;
-    buffer.resize(8 * 1024);
-    if (!filterDev.open(QIODevice::ReadOnly)) {
-        q->setErrorString(tr("File %1 does not exist").arg(fileName));
+    const QString errorMessage = decompressTarFile(fileName, KCompressionDevice::compressionTypeForMimeType(mimetype), file);
+    if (!errorMessage.isEmpty()) {
+        q->setErrorString(errorMessage);
         return false;
     }
-    qint64 len = -1;
-    while (!filterDev.atEnd() && len != 0) {
-        len = filterDev.read(buffer.data(), buffer.size());
-        if (len < 0) { // corrupted archive
-            q->setErrorString(tr("Archive %1 is corrupt").arg(fileName));
-            return false;
-        }
-        if (file->write(buffer.data(), len) != len) { // disk full
-            q->setErrorString(tr("Disk full"));
-            return false;
-        }
-    }
-    filterDev.close();
 
     file->flush();
     file->seek(0);
@@ -372,6 +497,16 @@ bool KTar::openArchive(QIODevice::OpenMode mode)
         return true;
     }
 
+    // Read the entries from the cache when it is up to date. It is keyed by the compressed
+    // file, so a compressed tar file is then only decompressed when a file is first read
+    const QByteArray recordsKey = KArchivePrivate::recordsKey(this, "tar");
+    if (auto cachedRecords = KArchivePrivate::findRecords(this, recordsKey)) {
+        if (d->tmpFile) {
+            d->tmpFile->fillLazily(fileName(), KCompressionDevice::compressionTypeForMimeType(d->mimetype));
+        }
+        return KArchivePrivate::setRecords(this, new KArchiveRecordCatalogue(this, std::move(cachedRecords)));
+    }
+
     if (!d->fillTempFile(fileName())) {
         return false;
     }
@@ -392,13 +527,21 @@ bool KTar::openArchive(QIODevice::OpenMode mode)
 
     // read dir information
     char buffer[0x200];
+    // The names as stored, reused from one header to the next
+    QByteArray rawName;
+    QByteArray rawSymlink;
+    QByteArray rawPath;
+    rawName.reserve(0x200);
+    rawSymlink.reserve(0x200);
+    rawPath.reserve(0x200);
+
+    // The cache lists all the entries, setRecords() leaves the filtered ones out then
+    const KArchiveEntryFilter *filter = recordsKey.isEmpty() ? KArchivePrivate::entryFilter(this) : nullptr;
+    QVector<KArchiveRecord> records;
     bool ende = false;
     do {
-        QString name;
-        QString symlink;
-
         // Read header
-        qint64 n = d->readHeader(buffer, name, symlink);
+        qint64 n = d->readHeader(buffer, rawName, rawSymlink);
         if (n < 0) {
             setErrorString(tr("Could not read tar header"));
             return false;
@@ -406,21 +549,16 @@ bool KTar::openArchive(QIODevice::OpenMode mode)
         if (n == 0x200) {
             bool isdir = false;
 
-            if (name.isEmpty()) {
+            if (rawName.isEmpty()) {
                 continue;
             }
-            if (name.endsWith(u'/')) {
+            if (rawName.endsWith('/')) {
                 isdir = true;
-                name.truncate(name.length() - 1);
+                rawName.chop(1);
             }
 
-            QByteArray prefix = QByteArray(buffer + 0x159, 155);
-            if (prefix[0] != '\0') {
-                name = (QLatin1String(prefix.constData()) + u'/' + name);
-            }
-
-            int pos = name.lastIndexOf(u'/');
-            QString nm = (pos == -1) ? name : name.mid(pos + 1);
+            const char *prefix = buffer + 0x159;
+            const int prefixLength = qstrnlen(prefix, 155);
 
             // read access
             buffer[0x6b] = 0;
@@ -431,15 +569,6 @@ bool KTar::openArchive(QIODevice::OpenMode mode)
             }
             int access = strtol(p, &dummy, 8);
 
-            // read user and group
-            const int maxUserGroupLength = 32;
-            const char *userStart = buffer + 0x109;
-            const int userLen = qstrnlen(userStart, maxUserGroupLength);
-            const QString user = QString::fromLocal8Bit(userStart, userLen);
-            const char *groupStart = buffer + 0x129;
-            const int groupLen = qstrnlen(groupStart, maxUserGroupLength);
-            const QString group = QString::fromLocal8Bit(groupStart, groupLen);
-
             // read time
             buffer[0x93] = 0;
             p = buffer + 0x88;
@@ -477,29 +606,60 @@ bool KTar::openArchive(QIODevice::OpenMode mode)
                 access |= S_IFDIR; // broken tar files...
             }
 
-            KArchiveEntry *e;
-            if (isdir) {
-                // qCDebug(KArchiveLog) << "directory" << nm;
-                e = new KArchiveDirectory(this, nm, access, KArchivePrivate::time_tToDateTime(time), user, group, symlink);
-            } else {
+            // Skip the files left out before anything is decoded, the directories are pruned once all is read
+            if (filter && !isdir && !isDumpDir) {
+                rawPath.truncate(0);
+                if (prefixLength) {
+                    rawPath.append(prefix, prefixLength);
+                    rawPath.append('/');
+                }
+                rawPath.append(rawName);
+                if (!filter->matches(rawPath)) {
+                    qint64 size = typeflag == '1' ? 0 : QByteArray(buffer + 0x7c, 12).trimmed().toLongLong(nullptr, 8 /*octal*/);
+                    qint64 rest = size % 0x200;
+                    dev->seek(dev->pos() + size + (rest ? 0x200 - rest : 0));
+                    continue;
+                }
+            }
+
+            // read user and group
+            const int maxUserGroupLength = 32;
+            const char *userStart = buffer + 0x109;
+            const int userLen = qstrnlen(userStart, maxUserGroupLength);
+            const QString user = QString::fromLocal8Bit(userStart, userLen);
+            const char *groupStart = buffer + 0x129;
+            const int groupLen = qstrnlen(groupStart, maxUserGroupLength);
+            const QString group = QString::fromLocal8Bit(groupStart, groupLen);
+
+            QString name = QFile::decodeName(rawName);
+            if (prefixLength) {
+                name = (QLatin1String(prefix, prefixLength) + u'/' + name);
+            }
+
+            KArchiveRecord record;
+            // In some tar files we can find dir/./file => clean the path
+            record.path = KArchivePrivate::cleanPath(name);
+            record.user = KArchivePrivate::intern(this, user);
+            record.group = KArchivePrivate::intern(this, group);
+            record.symlink = QFile::decodeName(rawSymlink);
+            record.time = time;
+            record.access = access;
+            // for isDumpDir we will skip the additional info about that dirs contents
+            record.isDirectory = isdir || isDumpDir;
+            if (!isdir) {
                 // read size
                 QByteArray sizeBuffer(buffer + 0x7c, 12);
                 qint64 size = sizeBuffer.trimmed().toLongLong(nullptr, 8 /*octal*/);
                 // qCDebug(KArchiveLog) << "sizeBuffer='" << sizeBuffer << "' -> size=" << size;
 
-                // for isDumpDir we will skip the additional info about that dirs contents
-                if (isDumpDir) {
-                    // qCDebug(KArchiveLog) << nm << "isDumpDir";
-                    e = new KArchiveDirectory(this, nm, access, KArchivePrivate::time_tToDateTime(time), user, group, symlink);
-                } else {
-                    // Let's hack around hard links. Our classes don't support that, so make them symlinks
-                    if (typeflag == '1') {
-                        // qCDebug(KArchiveLog) << "Hard link, setting size to 0 instead of" << size;
-                        size = 0; // no contents
-                    }
-
-                    // qCDebug(KArchiveLog) << "file" << nm << "size=" << size;
-                    e = new KArchiveFile(this, nm, access, KArchivePrivate::time_tToDateTime(time), user, group, symlink, dev->pos(), size);
+                // Let's hack around hard links. Our classes don't support that, so make them symlinks
+                if (typeflag == '1') {
+                    // qCDebug(KArchiveLog) << "Hard link, setting size to 0 instead of" << size;
+                    size = 0; // no contents
+                }
+                if (!isDumpDir) {
+                    record.position = dev->pos();
+                    record.size = size;
                 }
 
                 // Skip contents + align bytes
@@ -511,32 +671,9 @@ bool KTar::openArchive(QIODevice::OpenMode mode)
                 }
             }
 
-            if (pos == -1) {
-                if (nm == QStringLiteral(".")) { // special case
-                    if (isdir) {
-                        if (KArchivePrivate::hasRootDir(this)) {
-                            qWarning() << "Broken tar file has two root dir entries";
-                            delete e;
-                        } else {
-                            setRootDir(static_cast<KArchiveDirectory *>(e));
-                        }
-                    } else {
-                        delete e;
-                    }
-                } else {
-                    rootDir()->addEntry(e);
-                }
-            } else {
-                // In some tar files we can find dir/./file => call cleanPath
-                QString path = QDir::cleanPath(name.left(pos));
-                // Ensure container directory exists, create otherwise
-                KArchiveDirectory *d = findOrCreate(path);
-                if (d) {
-                    d->addEntry(e);
-                } else {
-                    delete e;
-                    return false;
-                }
+            // "." stands for the root directory, a file can't
+            if (!record.path.isEmpty() || record.isDirectory) {
+                records.append(std::move(record));
             }
         } else {
             // qCDebug(KArchiveLog) << "Terminating. Read " << n << " bytes, first one is " << buffer[0];
@@ -544,7 +681,10 @@ bool KTar::openArchive(QIODevice::OpenMode mode)
             ende = true;
         }
     } while (!ende);
-    return true;
+
+    // The entries are only created when their directory is navigated, in read-only mode
+    auto catalogue = new KArchiveRecordCatalogue(this, KArchivePrivate::storeRecords(this, recordsKey, std::move(records)));
+    return KArchivePrivate::setRecords(this, catalogue);
 }
 
 /*
@@ -62,6 +62,35 @@ public:
      */
     void setOrigFileName(const QByteArray &fileName);
 
+    /**
+     * Call this before open() to choose how compressed tar files are read.
+     *
+     * By default, a compressed tar file opened for reading is decompressed into a temporary
+     * file first, so that its files can then be read in any order at no extra cost. When
+     * @p used is false, it is read through the decompression filter instead: nothing is
+     * written to disk, but each read going back in the archive decompresses it again from
+     * the start. This suits reading the files in the order of the archive, e.g. with
+     * KArchiveDirectory::copyTo(), which then only decompresses it twice, once to list
+     * the files and once to read them.
+     *
+     * When the list of files comes from the catalogue cache (see KArchive::setCatalogueCacheFile()),
+     * opening doesn't decompress anything: the temporary file is only filled on the first read
+     * of a file, and without it the tar file is only decompressed once, to read the files.
+     *
+     * This only applies to tar files opened with QIODevice::ReadOnly from their file name.
+     *
+     * @param used whether to decompress into a temporary file, true by default
+     * @since 5.86
+     */
+    void setTemporaryFileUsed(bool used);
+
+    /**
+     * Returns whether compressed tar files are decompressed into a temporary file for reading.
+     * @see setTemporaryFileUsed
+     * @since 5.86
+     */
+    bool isTemporaryFileUsed() const;
+
 protected:
     /// Reimplemented from KArchive
     bool doWriteSymLink(const QString &name,
@@ -21,6 +21,7 @@
 
 #include <cstring>
 #include <ctime>
+#include <limits>
 #include <zlib.h>
 
 #ifndef QT_STAT_LNK
@@ -418,6 +419,47 @@ KZip::~KZip()
     delete d;
 }
 
+/**
+ * The entries listed in the central directory, turned into entries as the directory tree is navigated.
+ */
+class KZipCatalogue : public KArchiveRecordCatalogue
+{
+    Q_DISABLE_COPY_MOVE(KZipCatalogue)
+public:
+    // The files are added to fileList, which the central directory is written from when the archive is modified
+    explicit KZipCatalogue(KZip *zip, std::shared_ptr<const QVector<KArchiveRecord>> records, QList<KZipFileEntry *> *fileList)
+        : KArchiveRecordCatalogue(zip, std::move(records))
+        , m_zip(zip)
+        , m_fileList(fileList)
+    {
+    }
+
+    KArchiveEntry *createEntry(int index, const QString &name) override
+    {
+        if (name.isEmpty()) {
+            return nullptr;
+        }
+        const KArchiveRecord &rec = record(index);
+        const KArchiveDirectory *root = m_zip->directory();
+        const QDateTime mtime = KArchivePrivate::time_tToDateTime(rec.time);
+        if (rec.isDirectory) {
+            return new KArchiveDirectory(m_zip, name, rec.access, mtime, root->user(), root->group(), QString());
+        }
+        KZipFileEntry *entry =
+            new KZipFileEntry(m_zip, name, rec.access, mtime, root->user(), root->group(), rec.symlink, rec.storedPath, rec.position, rec.size, rec.method, rec.compressedSize);
+        entry->setHeaderStart(rec.headerStart);
+        entry->setCRC32(rec.crc);
+        if (m_zip->mode() != QIODevice::ReadOnly) {
+            m_fileList->append(entry);
+        }
+        return entry;
+    }
+
+private:
+    KZip *const m_zip;
+    QList<KZipFileEntry *> *const m_fileList;
+};
+
 bool KZip::openArchive(QIODevice::OpenMode mode)
 {
     // qCDebug(KArchiveLog);
@@ -435,9 +477,19 @@ bool KZip::openArchive(QIODevice::OpenMode mode)
     quint64 offset = 0; // holds offset, where we read
     // contains information gathered from the local file headers
     QHash<QByteArray, ParseFileInfo> pfi_map;
-
+    // The name of the current central entry, reused from one entry to the next
+    QByteArray bufferName;
     QIODevice *dev = device();
 
+    // Read the entries from the cache when it is up to date
+    const QByteArray recordsKey = KArchivePrivate::recordsKey(this, "zip");
+    if (auto cachedRecords = KArchivePrivate::findRecords(this, recordsKey)) {
+        return KArchivePrivate::setRecords(this, new KZipCatalogue(this, std::move(cachedRecords), &d->m_fileList));
+    }
+    // The cache lists all the entries, setRecords() leaves the filtered ones out then
+    const KArchiveEntryFilter *filter = recordsKey.isEmpty() ? KArchivePrivate::entryFilter(this) : nullptr;
+    QVector<KArchiveRecord> records;
+
     // We set a bool for knowing if we are allowed to skip the start of the file
     bool startOfFile = true;
 
@@ -591,7 +643,9 @@ bool KZip::openArchive(QIODevice::OpenMode mode)
                 uint skip = compr_size + namelen + extralen;
                 offset += 30 + skip;*/
             }
-            pfi_map.insert(fileName, pfi);
+            if (!filter || fileName.endsWith('/') || filter->matches(fileName)) {
+                pfi_map.insert(fileName, pfi);
+            }
         } else if (!memcmp(buffer, "PK\1\2", 4)) { // central block
             // qCDebug(KArchiveLog) << "PK12 found central block";
             startOfFile = false;
@@ -620,21 +674,33 @@ bool KZip::openArchive(QIODevice::OpenMode mode)
                 setErrorString(tr("Invalid ZIP file, file path name length smaller or equal to zero"));
                 return false;
             }
-            QByteArray bufferName = dev->read(namelen);
+            bufferName.resize(namelen);
+            bufferName.resize(qMax<qint64>(dev->read(bufferName.data(), namelen), 0));
             if (bufferName.size() < namelen) {
                 // qCWarning(KArchiveLog) << "Invalid ZIP file. Name not completely read";
             }
 
-            ParseFileInfo pfi = pfi_map.value(bufferName, ParseFileInfo());
-
-            QString name(QFile::decodeName(bufferName));
-
-            // qCDebug(KArchiveLog) << "name: " << name;
             // only in central header ! see below.
             // length of extra attributes
             int extralen = (uchar)buffer[31] << 8 | (uchar)buffer[30];
             // length of comment for this file
             int commlen = (uchar)buffer[33] << 8 | (uchar)buffer[32];
+
+            // Skip the files left out before anything is decoded, the directories are pruned once all is read
+            if (filter && !bufferName.endsWith('/') && !filter->matches(bufferName)) {
+                offset += 46 + commlen + extralen + namelen;
+                if (!dev->seek(offset)) {
+                    setErrorString(tr("Could not seek to next entry"));
+                    return false;
+                }
+                continue;
+            }
+
+            ParseFileInfo pfi = pfi_map.value(bufferName, ParseFileInfo());
+
+            QString name(QFile::decodeName(bufferName));
+
+            // qCDebug(KArchiveLog) << "name: " << name;
             // compression method of this file
             int cmethod = (uchar)buffer[11] << 8 | (uchar)buffer[10];
 
@@ -674,8 +740,6 @@ bool KZip::openArchive(QIODevice::OpenMode mode)
                 access = (uchar)buffer[40] | (uchar)buffer[41] << 8;
             }
 
-            QString entryName;
-
             if (name.endsWith(u'/')) { // Entries with a trailing slash are directories
                 isdir = true;
                 name = name.left(name.length() - 1);
@@ -686,59 +750,32 @@ bool KZip::openArchive(QIODevice::OpenMode mode)
                 }
             }
 
-            int pos = name.lastIndexOf(u'/');
-            if (pos == -1) {
-                entryName = name;
-            } else {
-                entryName = name.mid(pos + 1);
-            }
-            if (entryName.isEmpty()) {
+            if (name.endsWith(u'/') || name.isEmpty()) {
                 setErrorString(tr("Invalid ZIP file, found empty entry name"));
                 return false;
             }
 
-            KArchiveEntry *entry;
-            if (isdir) {
-                QString path = QDir::cleanPath(name);
-                const KArchiveEntry *ent = rootDir()->entry(path);
-                if (ent && ent->isDirectory()) {
-                    // qCDebug(KArchiveLog) << "Directory already exists, NOT going to add it again";
-                    entry = nullptr;
-                } else {
-                    QDateTime mtime = KArchivePrivate::time_tToDateTime(pfi.mtime);
-                    entry = new KArchiveDirectory(this, entryName, access, mtime, rootDir()->user(), rootDir()->group(), QString());
-                    // qCDebug(KArchiveLog) << "KArchiveDirectory created, entryName= " << entryName << ", name=" << name;
-                }
-            } else {
-                QString symlink;
+            KArchiveRecord record;
+            // In some zip files we can find dir/./file => clean the path
+            record.path = KArchivePrivate::cleanPath(name);
+            record.time = pfi.mtime;
+            record.access = access;
+            record.isDirectory = isdir;
+            if (!isdir) {
                 if ((access & QT_STAT_MASK) == QT_STAT_LNK) {
-                    symlink = QFile::decodeName(pfi.guessed_symlink);
+                    record.symlink = QFile::decodeName(pfi.guessed_symlink);
                 }
-                QDateTime mtime = KArchivePrivate::time_tToDateTime(pfi.mtime);
-                entry =
-                    new KZipFileEntry(this, entryName, access, mtime, rootDir()->user(), rootDir()->group(), symlink, name, dataoffset, ucsize, cmethod, csize);
-                static_cast<KZipFileEntry *>(entry)->setHeaderStart(localheaderoffset);
-                static_cast<KZipFileEntry *>(entry)->setCRC32(crc32);
-                // qCDebug(KArchiveLog) << "KZipFileEntry created, entryName= " << entryName << ", name=" << name;
-                d->m_fileList.append(static_cast<KZipFileEntry *>(entry));
+                record.storedPath = name;
+                record.position = dataoffset;
+                record.size = ucsize;
+                record.compressedSize = csize;
+                record.method = cmethod;
+                record.headerStart = localheaderoffset;
+                record.crc = crc32;
             }
-
-            if (entry) {
-                if (pos == -1) {
-                    rootDir()->addEntry(entry);
-                } else {
-                    // In some tar files we can find dir/./file => call cleanPath
-                    QString path = QDir::cleanPath(name.left(pos));
-                    // Ensure container directory exists, create otherwise
-                    KArchiveDirectory *tdir = findOrCreate(path);
-                    if (tdir) {
-                        tdir->addEntry(entry);
-                    } else {
-                        setErrorString(tr("File %1 is in folder %2, but %3 is actually a file.").arg(entryName, path, path));
-                        delete entry;
-                        return false;
-                    }
-                }
+            // A "." directory stands for the root directory, the files were already looked at
+            if (!record.path.isEmpty()) {
+                records.append(std::move(record));
             }
 
             // calculate offset to next entry
@@ -796,7 +833,10 @@ bool KZip::openArchive(QIODevice::OpenMode mode)
         }
     }
     // qCDebug(KArchiveLog) << "*** done *** ";
-    return true;
+
+    // The entries are only created when their directory is navigated, in read-only mode
+    auto catalogue = new KZipCatalogue(this, KArchivePrivate::storeRecords(this, recordsKey, std::move(records)), &d->m_fileList);
+    return KArchivePrivate::setRecords(this, catalogue);
 }
 
 bool KZip::closeArchive()
@@ -1457,3 +1497,90 @@ QIODevice *KZipFileEntry::createDevice() const
     delete limitedDev;
     return nullptr;
 }
+
+/**
+ * The raw deflate decoder KZipFileEntry::readChunks() reuses from one file to the next.
+ */
+class KZipInflater : public KArchiveChunkDecoder
+{
+    Q_DISABLE_COPY_MOVE(KZipInflater)
+public:
+    explicit KZipInflater()
+        : input(64 * 1024, Qt::Uninitialized)
+    {
+        memset(&stream, 0, sizeof(stream));
+        initialized = inflateInit2(&stream, -MAX_WBITS) == Z_OK;
+    }
+
+    ~KZipInflater() override
+    {
+        if (initialized) {
+            inflateEnd(&stream);
+        }
+    }
+
+    z_stream stream;
+    bool initialized;
+    QByteArray input;
+};
+
+void KZipFileEntry::virtual_hook(int id, void *data)
+{
+    if (id != KArchiveReadChunksHook::Id) {
+        KArchiveFile::virtual_hook(id, data);
+        return;
+    }
+    KArchiveReadChunksHook *hook = static_cast<KArchiveReadChunksHook *>(data);
+    if (encoding() == 0 || compressedSize() == 0) {
+        hook->handled = true;
+        hook->result = KArchivePrivate::readStoredChunks(archive(), position(), compressedSize(), *hook);
+        return;
+    }
+    if (encoding() != 8) {
+        // Let createDevice() report the unsupported method
+        return;
+    }
+
+    hook->handled = true;
+    hook->result = false;
+    KZipInflater *inflater = static_cast<KZipInflater *>(KArchivePrivate::chunkDecoder(archive()));
+    if (!inflater) {
+        inflater = new KZipInflater;
+        KArchivePrivate::setChunkDecoder(archive(), inflater);
+    }
+    QIODevice *dev = archive()->device();
+    if (!inflater->initialized || inflateReset(&inflater->stream) != Z_OK || !dev->seek(position())) {
+        return;
+    }
+
+    z_stream &stream = inflater->stream;
+    stream.avail_in = 0;
+    qint64 compressedLeft = compressedSize();
+    qint64 outputSize;
+    char *output = KArchivePrivate::chunkBuffer(archive(), *hook, &outputSize);
+    outputSize = qMin<qint64>(outputSize, std::numeric_limits<uInt>::max());
+    for (;;) {
+        if (stream.avail_in == 0 && compressedLeft > 0) {
+            const qint64 n = dev->read(inflater->input.data(), qMin<qint64>(compressedLeft, inflater->input.size()));
+            if (n <= 0) {
+                return;
+            }
+            stream.next_in = reinterpret_cast<Bytef *>(inflater->input.data());
+            stream.avail_in = uInt(n);
+            compressedLeft -= n;
+        }
+        stream.next_out = reinterpret_cast<Bytef *>(output);
+        stream.avail_out = uInt(outputSize);
+        const int ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            return;
+        }
+        if (!hook->visit(output, outputSize - stream.avail_out)) {
+            return;
+        }
+        if (ret == Z_STREAM_END) {
+            hook->result = true;
+            return;
+        }
+    }
+}
@@ -71,6 +71,9 @@ public:
      */
     QIODevice *createDevice() const override;
 
+protected:
+    void virtual_hook(int id, void *data) override;
+
 private:
     class KZipFileEntryPrivate;
     KZipFileEntryPrivate *const d;
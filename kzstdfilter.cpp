@@ -20,6 +20,7 @@ public:
         ZSTD_DStream *dStream;
     };
     int mode;
+    int level = ZSTD_CLEVEL_DEFAULT;
     bool isInitialized = false;
     ZSTD_inBuffer inBuffer;
     ZSTD_outBuffer outBuffer;
@@ -47,6 +48,7 @@ bool KZstdFilter::init(int mode)
         d->dStream = ZSTD_createDStream();
     } else if (mode == QIODevice::WriteOnly) {
         d->cStream = ZSTD_createCStream();
+        ZSTD_CCtx_setParameter(d->cStream, ZSTD_c_compressionLevel, d->level);
     } else {
         // qCWarning(KArchiveLog) << "Unsupported mode " << mode << ". Only QIODevice::ReadOnly and QIODevice::WriteOnly supported";
         return false;
@@ -127,3 +129,11 @@ KZstdFilter::Result KZstdFilter::compress(bool finish)
 
     return finish && result == 0 ? KFilterBase::Result::End : KFilterBase::Result::Ok;
 }
+
+void KZstdFilter::setCompressionLevel(int level)
+{
+    d->level = level;
+    if (d->isInitialized && d->mode == QIODevice::WriteOnly) {
+        ZSTD_CCtx_setParameter(d->cStream, ZSTD_c_compressionLevel, d->level);
+    }
+}
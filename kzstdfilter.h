@@ -40,6 +40,12 @@ public:
     Result uncompress() override;
     Result compress(bool finish) override;
 
+    /**
+     * Sets the compression level used when writing, ZSTD_CLEVEL_DEFAULT by default.
+     * Takes effect immediately if no data was compressed yet, otherwise at the next init().
+     */
+    void setCompressionLevel(int level);
+
 private:
     class Private;
     const std::unique_ptr<Private> d;